@@ -6,21 +6,349 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__NR_io_uring_setup) && !defined(DISK_NO_URING)
+#pragma push_macro("BLOCK_SIZE")
+#undef BLOCK_SIZE
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE // from linux/fs.h, ours is below
+#pragma pop_macro("BLOCK_SIZE")
+#define DISK_HAVE_URING
+#endif
+#ifndef IOV_MAX
+#define IOV_MAX 1024 //Linux value, hidden by strict -std modes
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 
+//Block size of the disks made by DiskDriver_init(), and the one SimpleFS
+//structures are built for. Can be overridden at compile time 
+//(-DBLOCK_SIZE=4096), the driver alone takes any size with _initGeometry()
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE 512
-#define PAGE_SIZE 4096
+#endif
+#define PAGE_SIZE 4096 // used if the host doesn't tell its own
 
+//Valid block sizes: powers of 2 in this range
+#define DISK_MIN_BLOCK_SIZE 512
+#define DISK_MAX_BLOCK_SIZE 65536
+#define DISK_LEGACY_BLOCK_SIZE 512 // disks made before the superblock
+
+//Block indices are returned as int (-1 when there is none), so a disk
+//has at most this many blocks, DISK_MAX_BYTES() bytes: 1 TiB with 512 B
+//blocks, 8 TiB with 4 KiB, 128 TiB with 64 KiB. Disks of several TiB
+//need blocks of 4 KiB or more. Byte offsets are always 64-bit (off_t)
+#define DISK_MAX_BLOCKS INT_MAX
+#define DISK_MAX_BYTES(block_size) ((off_t)DISK_MAX_BLOCKS*(block_size))
+#if BLOCK_SIZE < DISK_MIN_BLOCK_SIZE || BLOCK_SIZE > DISK_MAX_BLOCK_SIZE \
+										|| (BLOCK_SIZE & (BLOCK_SIZE-1)) != 0
+#error "BLOCK_SIZE has to be a power of 2 from 512 to 65536"
+#endif
+
+//The disk begins with this header (the superblock), followed by the bitmap
+#define DISK_MAGIC 0x31534653 // "SFS1", absent in old byte-per-block disks
+#define DISK_VERSION 6 // 0 on disks made before block and page size were stored
+#define DISK_CHUNK_UNKNOWN 0xFFFFFFFF // chunk_free of a chunk not counted yet
+#define DISK_HEADER_SIZE 256 // room reserved for the header, bitmap begins here
+
+//The bitmap is summarized in chunks of 4 KiB (32768 blocks):
+//allocation looks for a chunk with empty blocks before scanning bits
+#define DISK_CHUNK_WORDS 512 // bitmap words in a chunk
+#define DISK_CHUNK_BLOCKS (DISK_CHUNK_WORDS*64) // blocks in a chunk
+
+typedef struct {
+  unsigned int magic; // DISK_MAGIC
+  unsigned int num_blocks; // number of blocks on the disk
+  unsigned int first_block_offset; // offset of block 0 (bitmap + padding)
+  unsigned int version; // DISK_VERSION
+  unsigned int block_size; // bytes per block
+  unsigned int page_size; // page size of the host that made the disk
+  unsigned int clean; // 1 if the disk was unmounted, 0 while in use (or crashed)
+  unsigned int free_blocks; // free blocks at the last unmount, valid if clean
+  unsigned int generation; // increases at every mount
+  unsigned int init_chunks; // bitmap chunks initialized: the others are all empty
+                            // whatever they contain (DISK_LAZY format)
+  unsigned int fs_flags; // layout of the file system on top, the driver ignores it
+  unsigned int journal_offset; // offset of the journal (DISK_JOURNAL), after the bitmap
+  unsigned int journal_slots; // blocks in the journal, 0 if the disk has none
+} DiskHeader;
+
+//Number of block windows kept mmapped at the same time.
+//Can be overridden at compile time (-DDISK_WINDOWS=16)
+#ifndef DISK_WINDOWS
+#define DISK_WINDOWS 8
+#endif
+
+//Size of every window. Has to be a power of 2, windows grow 
+//to the block size or the page size if they are bigger
+#ifndef DISK_WINDOW_SIZE
+#define DISK_WINDOW_SIZE PAGE_SIZE
+#endif
+
+//Images whose block area is bigger than this are never mapped as a whole,
+//DISK_WHOLE_MAP falls back to windows for them
+#ifndef DISK_WHOLE_MAP_LIMIT
+#define DISK_WHOLE_MAP_LIMIT (1024UL*1024*1024)
+#endif
+
+//Mode flags for DiskDriver_initMode() and DiskDriver_resumeMode()
+#define DISK_WHOLE_MAP 0x1 // map the whole block area once at startup
+#define DISK_POPULATE 0x2 // prefault the whole mapping (MAP_POPULATE)
+#define DISK_SEQUENTIAL 0x4 // madvise() hint for mostly sequential access
+#define DISK_RANDOM 0x8 // madvise() hint for mostly random access
+#define DISK_PIO 0x10 // pread()/pwrite() backend instead of mmap (no DISK_WHOLE_MAP)
+#define DISK_ASYNC 0x20 // like DISK_PIO, but vectored calls are queued on io_uring
+#define DISK_THREADS 0x40 // with DISK_ASYNC, use the thread pool even if io_uring works
+#define DISK_LAZY 0x80 // _init() leaves the bitmap uninitialized, and the file as it is
+#define DISK_JOURNAL 0x100 // _init() makes a metadata journal (see DiskDriver_begin())
+#define DISK_SHARED 0x200 // the disk is used by several threads at once
+
+//Start of DiskDriver_allocBlock() that means "where this thread
+//allocated last time" (threads begin in different chunks)
+#define DISK_NO_HINT 0xFFFFFFFF
+
+//Requests in flight at most on io_uring (rounded by the kernel to a power of 2)
+#ifndef DISK_QUEUE_DEPTH
+#define DISK_QUEUE_DEPTH 64
+#endif
+
+//Threads of the pread()/pwrite() pool used where io_uring is missing
+#ifndef DISK_IO_THREADS
+#define DISK_IO_THREADS 4
+#endif
+
+//Bytes of journal made by _init() with DISK_JOURNAL (at least 
+//DISK_JOURNAL_MIN_SLOTS blocks), and operations committed together
+#ifndef DISK_JOURNAL_SIZE
+#define DISK_JOURNAL_SIZE (1 << 20)
+#endif
+#define DISK_JOURNAL_MIN_SLOTS 16
+#ifndef DISK_JOURNAL_GROUP
+#define DISK_JOURNAL_GROUP 64
+#endif
+//Longest a group waits for more operations, in ms (with DISK_SYNC_TIME
+//the flush interval is used instead)
+#ifndef DISK_JOURNAL_DELAY
+#define DISK_JOURNAL_DELAY 1000
+#endif
+
+//The journal is a circular array of slots, one block each, between the
+//bitmap and block 0. Slot 0 holds a DiskJournalHeader, the others the
+//committed groups: descriptors, block images, then a commit record
+#define DISK_JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+#define DISK_JOURNAL_DESC 1
+#define DISK_JOURNAL_COMMIT 2
+#define DISK_JOURNAL_FREE 0x80000000 // descriptor entry of a freed block
+
+//Flush policies for DiskDriver_setSync(): when written blocks and bitmap
+//are made durable without an explicit DiskDriver_sync()
+#define DISK_SYNC_CLOSE 0 // at _unmount() only (default)
+#define DISK_SYNC_NONE 1 // never: _unmount() doesn't even mark the disk clean
+#define DISK_SYNC_OPS 2 // every interval blocks written or freed
+#define DISK_SYNC_TIME 3 // at the first write or free interval ms after the last flush
+
+//Dirty ranges of the file remembered at most: past them, the two
+//closest ranges are merged (and the gap between them flushed too)
+#ifndef DISK_DIRTY_RANGES
+#define DISK_DIRTY_RANGES 64
+#endif
+
+typedef struct {
+  unsigned int magic; // DISK_JOURNAL_MAGIC
+  unsigned int tail; // oldest slot (from 0, after slot 0) not checkpointed
+  uint64_t seq; // sequence number of the group at tail
+} DiskJournalHeader;
+
+//First bytes of every descriptor and commit slot
+typedef struct {
+  unsigned int magic; // DISK_JOURNAL_MAGIC
+  unsigned int type; // DISK_JOURNAL_DESC or DISK_JOURNAL_COMMIT
+  uint64_t seq; // group the slot belongs to
+  unsigned int count; // DESC: entries of the group, COMMIT: slots before it
+  unsigned int checksum; // COMMIT: of the slots before it
+} DiskJournalRecord;
+//Descriptors go on with the entries: written blocks first (their images 
+//follow the descriptors in the same order), then freed blocks | DISK_JOURNAL_FREE
+
+//A block touched by the running group
+typedef struct {
+  unsigned int block_num;
+  int image; // index in DiskJournal.images, -1 if it was only freed
+  int freed; // freed after its last write, applied at commit
+} DiskJournalEntry;
+
+typedef struct {
+  off_t offset; // offset of slot 0 in the file
+  unsigned int slots; // slots after slot 0
+  unsigned int tail, used; // oldest slot still needed, slots in use from it
+  uint64_t seq; // sequence number of the next group
+  int depth; // DiskDriver_begin() calls not ended yet
+  int ops; // operations ended in the running group
+  unsigned long started; // DiskDriver_msec() at the end of its first one
+  
+  DiskJournalEntry* entries; // running group, not on disk yet
+  int num_entries, max_entries;
+  int* table; // block_num -> index in entries, open addressing (-1 empty)
+  int table_size; // power of 2, at least twice num_entries
+  char* images; // latest image of every written block (slots blocks at most)
+  int num_images;
+  unsigned long commits; // groups committed
+  unsigned long replayed; // groups replayed by _resume()
+  
+  pthread_t committer; // DISK_SHARED: commits a group left alone
+  pthread_cond_t wake; // a group began, or the committer has to stop
+  int committer_on; // 1 while the committer runs
+} DiskJournal;
+
+struct DiskDriver;
+
+//Part of the file written since the last flush, page aligned
+typedef struct {
+  off_t begin, end; // bytes [begin, end)
+} DiskRange;
+
+//One block of a vectored read or write
+typedef struct {
+  unsigned int block_num; // block on the disk
+  void* buf; // block_size bytes in memory
+} DiskIOVec;
+
+//Run of blocks reserved in memory (DiskDriver_reserveExtent())
 typedef struct {
-  char* disk_map; // (mmapped) bitmap
-  int num_entries; // number of blocks mapped (= bitmap lenght without padding and int)
+  unsigned int start; // first block
+  unsigned int len; // blocks in the run
+} DiskExtent;
+
+//Run of adjacent blocks, moved by a single queued request
+typedef struct {
+  unsigned int block_num; // first block of the run
+  struct iovec* iov; // one iovec per block
+  int len; // blocks in the run
+} DiskRun;
+
+//Queue of the DISK_ASYNC backend: an io_uring instance or, where it is 
+//not available, a pool of threads calling preadv()/pwritev()
+typedef struct {
+  int fd; // disk file
+  off_t first_block_offset; // same as DiskDriver's
+  unsigned int block_size; // same as DiskDriver's
+  
+  int ring_fd; // io_uring, -1 if the thread pool is used
+  unsigned int depth; // submission queue entries
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array; // inside sq_ring
+  unsigned int *cq_head, *cq_tail, *cq_mask; // inside cq_ring
+  void* sqes; // submission entries (struct io_uring_sqe)
+  void* cqes; // completion entries (struct io_uring_cqe), inside cq_ring
+  char* sq_ring;
+  char* cq_ring;
+  size_t sq_ring_size, cq_ring_size, sqes_size;
+  
+  pthread_t threads[DISK_IO_THREADS];
+  int num_threads; // 0 if io_uring is used
+  pthread_mutex_t lock; // protects everything below
+  pthread_cond_t work; // a batch was posted (or the pool has to stop)
+  pthread_cond_t done; // the last run of the batch was completed
+  DiskRun* runs; // batch being served
+  int num_runs, next_run, finished, error, is_write, stop;
+} DiskAsync;
+
+//Backend table: the way blocks are moved between disk and memory.
+//It is chosen by DiskDriver_selectBackend() at init or resume time.
+typedef struct {
+  const char* name;
+  // copies block_num in dest, bitmap was already checked by the caller
+  int (*read)(struct DiskDriver* disk, void* dest, unsigned int block_num);
+  // copies src in block_num, bitmap was already updated by the caller
+  int (*write)(struct DiskDriver* disk, const void* src, unsigned int block_num);
+  // same as above, for count blocks sorted by block_num
+  int (*readBlocks)(struct DiskDriver* disk, DiskIOVec* vec, int count);
+  int (*writeBlocks)(struct DiskDriver* disk, DiskIOVec* vec, int count);
+} DiskBackend;
+
+//Locks of a DISK_SHARED disk. The bitmap needs none: its words, 
+//chunk_free and the summary are changed by atomic operations (a block is
+//claimed by the thread that turns its bit on), lookups just read them.
+//Windows are taken under the window lock and pinned while they are 
+//copied, so no thread can unmap them meanwhile. 
+//Order: journal, chunks, windows, reserved
+typedef struct {
+  pthread_mutex_t chunks; // header->init_chunks (DISK_LAZY)
+  pthread_mutex_t windows; // windows[], block_map, LRU clock and counters
+  pthread_mutex_t journal; // running group of the journal
+  pthread_mutex_t queue; // DISK_ASYNC queue, one batch at a time
+  pthread_mutex_t reserved; // reserved runs
+} DiskLocks;
+
+//One of the locks above, NULL if the disk is not shared
+#define DISK_LOCK(disk, name) ((disk)->locks != NULL ? &(disk)->locks->name : NULL)
+
+//A mmapped portion of the block area
+typedef struct {
+  char* map; // mmapped window, NULL if the slot is unused
+  unsigned int first_block; // index of the first block in the window
+  unsigned long last_use; // LRU stamp, taken from DiskDriver.window_clock
+  int pins; // blocks pinned in the window, never evicted while > 0
+} DiskWindow;
+
+typedef struct DiskDriver {
+  char* disk_map; // (mmapped) header and bitmap
+  DiskHeader* header; // superblock, points inside disk_map
+  uint64_t* bitmap; // 1 bit per block (1 = full), points inside disk_map
+  unsigned int bitmap_words; // bitmap lenght in 64-bit words
   
-  char* block_map; // mmapped block page (1 page = 4096 byte = 8 blocks).
+  unsigned int num_chunks; // bitmap chunks (the last one can be shorter)
+  unsigned int* chunk_free; // empty blocks in every chunk (in memory only),
+                            // DISK_CHUNK_UNKNOWN until the chunk is looked at
+  uint64_t* summary; // 1 bit per chunk, 1 = the chunk has empty blocks
+  int num_entries; // number of blocks mapped (= bitmap lenght in bits without padding)
+  unsigned int block_size; // bytes per block, from the superblock
+  unsigned int window_size; // bytes mapped by every window
+  unsigned int map_shift; // first_block_offset%page size: mmaps begin that early
+  unsigned int page_size; // of the host
+  
+  char* block_map; // most recently used window (fast path into windows[])
   unsigned int first_mapped_block; //index of the first block on the block_map.
   
+  DiskWindow windows[DISK_WINDOWS]; // set of mmapped windows, LRU evicted
+  unsigned long window_clock; // increases on every window access
+  unsigned long window_hits; // getBlock calls served by a mapped window
+  unsigned long window_misses; // getBlock calls that needed a new mmap
+  unsigned long prefetched; // blocks asked in advance by DiskDriver_prefetch()
+  
+  char* whole_map; // whole block area, NULL if windows are used
+  size_t whole_map_size; // lenght of the mapping (begins map_shift bytes before)
+  int mode; // DISK_* flags the disk was opened with
+  const DiskBackend* backend; // how blocks are read and written
+  DiskAsync* async; // queue of the DISK_ASYNC backend, NULL otherwise
+  DiskJournal* journal; // metadata journal, NULL if the disk has none
+  DiskLocks* locks; // DISK_SHARED only, NULL otherwise
+  DiskExtent* reserved; // runs reserved in memory only, sorted by start
+  int num_reserved, max_reserved;
+  
+  DiskRange dirty[DISK_DIRTY_RANGES]; // written and not flushed, sorted
+  int num_dirty;
+  int dirty_any; // DISK_SHARED: something was written (ranges are not kept)
+  int sync_policy; // DISK_SYNC_*
+  unsigned int sync_interval; // blocks or ms, see DISK_SYNC_OPS/_TIME
+  unsigned int sync_ops; // blocks written or freed since the last flush
+  unsigned long sync_time; // ms (monotonic) of the last flush
+  unsigned long syncs; // flushes done
+  unsigned long written; // blocks written (_writeBlock(s)(), _unpinWrite())
+  unsigned long synced_ranges; // ranges written back by them
+  
   int fd; // for us
   unsigned int free_blocks;     // free blocks
   unsigned int first_block_offset; // offset for reading first block
+  int unclean; // 1 if _resume() found it not cleanly unmounted (crashed)
 } DiskDriver;
 
 /**
@@ -37,6 +365,21 @@ typedef struct {
 int DiskDriver_init(DiskDriver* disk, const char* filename, 
 											unsigned int num_blocks);
 
+// same as DiskDriver_init(), but opens the disk with the DISK_* flags in mode.
+// With DISK_LAZY nothing but the header is written: bitmap chunks are 
+// zeroed the first time a block in them is marked, so formatting takes
+// the same time on every disk size
+int DiskDriver_initMode(DiskDriver* disk, const char* filename, 
+								unsigned int num_blocks, int mode);
+
+// same as DiskDriver_initMode(), with blocks of block_size bytes
+// (a power of 2 from DISK_MIN_BLOCK_SIZE to DISK_MAX_BLOCK_SIZE).
+// The size is stored in the superblock and found again by _resume().
+// returns -1 if block_size or num_blocks (up to DISK_MAX_BLOCKS, so the
+// disk is at most DISK_MAX_BYTES(block_size) bytes) is not valid
+int DiskDriver_initGeometry(DiskDriver* disk, const char* filename, 
+			unsigned int num_blocks, unsigned int block_size, int mode);
+
 // reads the block in position block_num
 // returns -1 if the block is free according to the bitmap
 // 0 otherwise
@@ -52,49 +395,464 @@ int DiskDriver_writeBlock(DiskDriver* disk, void* src,
 // returns -1 if operation not possible
 int DiskDriver_freeBlock(DiskDriver* disk, unsigned int block_num);
 
-// returns the first free block in the disk from position (checking the bitmap)
+// vectored versions of the three functions above: block_nums[i] is 
+// read in dest[i] / written from src[i]. Blocks are sorted by position, 
+// so that every window (or run of adjacent blocks) is handled at once.
+// block_nums must not repeat. Return values are the same, and nothing
+// is read if one of the blocks is invalid or empty.
+int DiskDriver_readBlocks(DiskDriver* disk, void** dest, 
+								unsigned int* block_nums, int count);
+int DiskDriver_writeBlocks(DiskDriver* disk, void** src, 
+								unsigned int* block_nums, int count);
+int DiskDriver_freeBlocks(DiskDriver* disk, unsigned int* block_nums, 
+														int count);
+
+// returns the first free block in the disk from position (checking the bitmap),
+// skipping the ones reserved by DiskDriver_reserveExtent()
 int DiskDriver_getFreeBlock(DiskDriver* disk, unsigned int start);
 
+// finds the first free block from start (wrapping around) and reserves it:
+// it is full in the bitmap until written or freed. On a DISK_SHARED disk 
+// the block is claimed with an atomic operation, so threads allocating at
+// the same time never get the same block. With start DISK_NO_HINT the
+// search begins after the block this thread got last (threads begin
+// in different chunks), keeping them out of each other's way.
+// returns the block, -1 if the disk is full
+int DiskDriver_allocBlock(DiskDriver* disk, unsigned int start);
+
+// chunks (DISK_CHUNK_BLOCKS blocks, with their own bitmap words, free 
+// count and summary bit) are the allocation groups of the disk. This
+// returns the first block of the group after the one of block (wrapping
+// around) that has at least the average number of free blocks, where 
+// a new tree of blocks has room to grow (i.e. a new directory). On a 
+// DISK_LAZY disk the groups already initialized come first: a new one
+// is zeroed only when none of them has room
+unsigned int DiskDriver_spreadGroup(DiskDriver* disk, unsigned int block);
+
+// counts the free blocks and stores them in free_blocks. DISK_SHARED disks
+// don't keep it up to date while threads allocate
+unsigned int DiskDriver_countFree(DiskDriver* disk);
+
+// looks for a run of at least min_len adjacent free blocks, starting from 
+// goal and wrapping around. The run (at most max_len blocks) is reserved:
+// its blocks are full in the bitmap until written or freed.
+// returns the first block of the run and its lenght by side effect in len
+// -1 if no such run exists
+int DiskDriver_getFreeExtent(DiskDriver* disk, unsigned int goal, 
+				unsigned int min_len, unsigned int max_len, unsigned int* len);
+
+// frees len blocks from start (i.e. the unused part of a reserved run)
+int DiskDriver_freeExtent(DiskDriver* disk, unsigned int start, 
+												unsigned int len);
+
+// same as DiskDriver_getFreeExtent(), but the run is reserved in memory 
+// only: its blocks stay empty in the bitmap, so a crash (or a run never
+// released) leaks nothing, and every lookup of this disk skips them until
+// DiskDriver_releaseExtent() or _unmount(). Only the one that reserved a
+// block is expected to write it.
+int DiskDriver_reserveExtent(DiskDriver* disk, unsigned int goal, 
+				unsigned int min_len, unsigned int max_len, unsigned int* len);
+
+// gives back the reservation of len blocks from start (written or not, 
+// any part of the reserved runs)
+void DiskDriver_releaseExtent(DiskDriver* disk, unsigned int start, 
+												unsigned int len);
+
+// returns a pointer to the block in position block_num, straight into
+// the mapped disk (no copy). Its window can't be evicted, so the pointer
+// stays valid until DiskDriver_unpinBlock(). The block is read only.
+// Works on every backend (pinned blocks are always mmapped).
+// returns NULL if the block is invalid or free, or every window is pinned
+const void* DiskDriver_pinBlock(DiskDriver* disk, unsigned int block_num);
+
+// releases a pointer returned by DiskDriver_pinBlock()
+void DiskDriver_unpinBlock(DiskDriver* disk, const void* block);
+
+// same as DiskDriver_pinBlock(), but the block is written in place through
+// the pointer instead of copied from a buffer: it becomes full in the 
+// bitmap (any content it had stays there until overwritten), and
+// DiskDriver_unpinWrite() releases it, counting it as written. 
+// returns NULL if the block is invalid, logged by the running journal 
+// group (DiskDriver_writeBlock() has to be used), or every window is pinned
+void* DiskDriver_pinWrite(DiskDriver* disk, unsigned int block_num);
+void DiskDriver_unpinWrite(DiskDriver* disk, void* block, 
+												unsigned int block_num);
+
+// tells the disk that count blocks from block_num will be read soon, so
+// that they are read in the background: madvise(MADV_WILLNEED) on the
+// whole mapping, posix_fadvise(POSIX_FADV_WILLNEED) for windows and 
+// pread backends (all of them read through the page cache). 
+// It is only a hint: blocks past the end are ignored, free ones too
+void DiskDriver_prefetch(DiskDriver* disk, unsigned int block_num, 
+												unsigned int count);
+
+// begin and end an operation on a DISK_JOURNAL disk: every block written
+// or freed in between is logged, and reaches its place only after the
+// group of operations it belongs to is committed. Groups of
+// DISK_JOURNAL_GROUP operations share a single flush (a group older than
+// DISK_JOURNAL_DELAY ms, or the DISK_SYNC_TIME interval, commits at the 
+// next end, write or free, or by itself on a DISK_SHARED disk), so an
+// operation is
+// durable when its group commits: after a crash _resume() replays the 
+// committed groups, the others are lost as a whole. Calls can nest,
+// the outer pair is the operation. An operation bigger than the journal
+// is committed in pieces. Blocks freed by an operation can be taken 
+// again only after its commit. Without journal these do nothing.
+void DiskDriver_begin(DiskDriver* disk);
+void DiskDriver_end(DiskDriver* disk);
+
+// commits the running group now, returns -1 on error
+int DiskDriver_commit(DiskDriver* disk);
+
+// makes every block written or freed so far durable: the dirty ranges of
+// blocks and bitmap (adjacent ones merged) are written back and waited 
+// for (sync_file_range()), then a single fdatasync() flushes the device
+// cache and the header. Does nothing if nothing changed.
+// returns -1 on error
+int DiskDriver_sync(DiskDriver* disk);
+
+// chooses when DiskDriver_sync() is called by the driver itself:
+// a DISK_SYNC_* policy, with interval blocks or ms for _OPS and _TIME.
+// The timer is checked on writes and frees, no thread is started
+void DiskDriver_setSync(DiskDriver* disk, int policy, unsigned int interval);
+
 
 
 /**Auxiliary funcions!**/
 //Shuts down the fs
 void DiskDriver_close(DiskDriver* disk);
 
+//Same as DiskDriver_close(), but gives control back to the caller
+void DiskDriver_unmount(DiskDriver* disk);
+
 //Recovers DiskDriver struct, bitmap and disk mapping from a non-new disk
 int DiskDriver_resume(DiskDriver* disk, const char* filename);
 
+//Same as DiskDriver_resume(), but opens the disk with the DISK_* flags in mode
+int DiskDriver_resumeMode(DiskDriver* disk, const char* filename, int mode);
+
+//Maps the whole block area if DISK_WHOLE_MAP is requested and the disk is
+//small enough. Otherwise the disk keeps working with windows.
+void DiskDriver_mapWhole(DiskDriver* disk, int mode);
+
+//Bitmap helpers: status (0 empty, 1 full) of block_num, and its update
+int DiskDriver_bitmapGet(DiskDriver* disk, unsigned int block_num);
+void DiskDriver_bitmapSet(DiskDriver* disk, unsigned int block_num, int status);
+
+//Word w of the bitmap (a plain load, that other threads may change)
+uint64_t DiskDriver_word(DiskDriver* disk, unsigned int w);
+
+//Counts the full bits in the first num_words bitmap words
+unsigned int DiskDriver_countFull(uint64_t* bitmap, unsigned int num_words);
+
+//Marks block_num as full/empty, keeping free_blocks and the summary right.
+//returns 1, or 0 if on a shared disk the block already was (so that 
+//another thread took or freed it first)
+int DiskDriver_markFull(DiskDriver* disk, unsigned int block_num);
+int DiskDriver_markEmpty(DiskDriver* disk, unsigned int block_num);
+
+//The two above on a DISK_SHARED disk, without locks: the bit is flipped
+//by an atomic operation, the counters follow. free_blocks is left alone
+//(every thread would write it), see DiskDriver_countFree()
+int DiskDriver_markShared(DiskDriver* disk, unsigned int block_num, 
+															int status);
+
+//Sets the summary bit of chunk (atomically on a shared disk)
+void DiskDriver_summarySet(DiskDriver* disk, unsigned int chunk, int status);
+
+//(Re)builds chunk_free, summary and free_blocks from the bitmap
+void DiskDriver_buildSummary(DiskDriver* disk);
+
+//Same, for a cleanly unmounted disk: free_blocks comes from the superblock
+//and chunks are counted only when the allocator reaches them
+void DiskDriver_lazySummary(DiskDriver* disk);
+
+//Empty blocks in chunk, counting them if it was never done
+unsigned int DiskDriver_chunkFree(DiskDriver* disk, unsigned int chunk);
+
+//Marks the disk as in use (not clean) and bumps the generation
+void DiskDriver_markMounted(DiskDriver* disk);
+
+//Zeroes every uninitialized chunk up to chunk (DISK_LAZY disks), 
+//then moves header->init_chunks past it
+void DiskDriver_initChunks(DiskDriver* disk, unsigned int chunk);
+
+//Number of blocks in chunk (the last one can have less)
+unsigned int DiskDriver_chunkBlocks(DiskDriver* disk, unsigned int chunk);
+
+//Releases the summary
+void DiskDriver_freeSummary(DiskDriver* disk);
+
+//Returns the first chunk from chunk on that has empty blocks, -1 if none
+int DiskDriver_nextChunk(DiskDriver* disk, unsigned int chunk);
+
+//Number of adjacent empty blocks from start, counting at most max
+unsigned int DiskDriver_runLength(DiskDriver* disk, unsigned int start, 
+												unsigned int max);
+
+//Body of DiskDriver_getFreeBlock(), reserved blocks are not skipped
+int DiskDriver_findFree(DiskDriver* disk, unsigned int start);
+
+//Body of DiskDriver_getFreeExtent() and, if reserve, _reserveExtent()
+int DiskDriver_findExtent(DiskDriver* disk, unsigned int goal, 
+	unsigned int min_len, unsigned int max_len, unsigned int* len, int reserve);
+
+//First reserved block from block on (num_entries if none), 
+//and in end the end of its run
+unsigned int DiskDriver_reservedNext(DiskDriver* disk, unsigned int block, 
+														unsigned int* end);
+
+//Reserves len empty blocks from block, up to the first one reserved or 
+//taken meanwhile. returns how many (none is kept if less than min_len)
+unsigned int DiskDriver_reserveRun(DiskDriver* disk, unsigned int block, 
+									unsigned int len, unsigned int min_len);
+
+//Returns the first empty block from start, looking only 
+//in the bitmap words before end_word, -1 if none
+int DiskDriver_scanBitmap(DiskDriver* disk, unsigned int start, 
+												unsigned int end_word);
+
+//Converts an old disk (an int and a byte per block) in place to the
+//bit-packed format. Blocks don't move: the old bitmap area is reused.
+int DiskDriver_migrate(int fd);
+
+//Page size of the host
+unsigned int DiskDriver_pageSize(void);
+
+//Sets block_size, window_size and map_shift for a disk laid out as header says
+void DiskDriver_setGeometry(DiskDriver* disk, DiskHeader* header);
+
+//Picks the backend matching disk->mode (and the outcome of _mapWhole())
+void DiskDriver_selectBackend(DiskDriver* disk);
+
+//Sets up io_uring (or the thread pool) for DISK_ASYNC, -1 on error
+int DiskDriver_asyncInit(DiskDriver* disk);
+
+//Releases the queue of DISK_ASYNC
+void DiskDriver_asyncClose(DiskDriver* disk);
+
+//Queues count runs on io_uring / the thread pool and waits for all of them
+int DiskDriver_ringSubmit(DiskAsync* async, DiskRun* runs, int count, 
+														int is_write);
+int DiskDriver_poolSubmit(DiskAsync* async, DiskRun* runs, int count, 
+														int is_write);
+
+//Body of every thread of the pool
+void* DiskDriver_poolWorker(void* arg);
+
+//Builds the DiskIOVec array for a vectored call, sorted by block_num
+DiskIOVec* DiskDriver_makeVec(void** bufs, unsigned int* block_nums, 
+														int count);
+
+//Backends
+int DiskDriver_windowRead(DiskDriver* disk, void* dest, unsigned int block_num);
+int DiskDriver_windowWrite(DiskDriver* disk, const void* src, 
+												unsigned int block_num);
+//Same as the two above on a DISK_SHARED disk (dest or src is NULL)
+int DiskDriver_windowShared(DiskDriver* disk, void* dest, const void* src, 
+												unsigned int block_num);
+int DiskDriver_wholeRead(DiskDriver* disk, void* dest, unsigned int block_num);
+int DiskDriver_wholeWrite(DiskDriver* disk, const void* src, 
+												unsigned int block_num);
+int DiskDriver_pioRead(DiskDriver* disk, void* dest, unsigned int block_num);
+int DiskDriver_pioWrite(DiskDriver* disk, const void* src, 
+												unsigned int block_num);
+int DiskDriver_mapReadBlocks(DiskDriver* disk, DiskIOVec* vec, int count);
+int DiskDriver_mapWriteBlocks(DiskDriver* disk, DiskIOVec* vec, int count);
+//Body of the two above: each window met is looked for once, and the 
+//blocks of the call in it copied straight from (or to) its mapping
+int DiskDriver_mapBlocks(DiskDriver* disk, DiskIOVec* vec, int count, 
+														int is_write);
+int DiskDriver_pioReadBlocks(DiskDriver* disk, DiskIOVec* vec, int count);
+int DiskDriver_pioWriteBlocks(DiskDriver* disk, DiskIOVec* vec, int count);
+int DiskDriver_asyncBlocks(DiskDriver* disk, DiskIOVec* vec, int count, 
+														int is_write);
+int DiskDriver_asyncReadBlocks(DiskDriver* disk, DiskIOVec* vec, int count);
+int DiskDriver_asyncWriteBlocks(DiskDriver* disk, DiskIOVec* vec, int count);
+
+const DiskBackend WINDOW_BACKEND = {"mmap windows", 
+					DiskDriver_windowRead, DiskDriver_windowWrite,
+					DiskDriver_mapReadBlocks, DiskDriver_mapWriteBlocks};
+const DiskBackend WHOLE_MAP_BACKEND = {"whole mmap", 
+					DiskDriver_wholeRead, DiskDriver_wholeWrite,
+					DiskDriver_mapReadBlocks, DiskDriver_mapWriteBlocks};
+const DiskBackend PIO_BACKEND = {"pread/pwrite", 
+					DiskDriver_pioRead, DiskDriver_pioWrite,
+					DiskDriver_pioReadBlocks, DiskDriver_pioWriteBlocks};
+const DiskBackend RING_BACKEND = {"io_uring", 
+					DiskDriver_pioRead, DiskDriver_pioWrite,
+					DiskDriver_asyncReadBlocks, DiskDriver_asyncWriteBlocks};
+const DiskBackend POOL_BACKEND = {"pread/pwrite pool", 
+					DiskDriver_pioRead, DiskDriver_pioWrite,
+					DiskDriver_asyncReadBlocks, DiskDriver_asyncWriteBlocks};
+
 //Upon request, this maps a page containing the block needed and retuns a pointer to it.
 char* DiskDriver_getBlock(DiskDriver* disk, unsigned int block_index);
 
+//Forgets every window without unmapping it (used on a fresh struct)
+void DiskDriver_resetWindows(DiskDriver* disk);
+
+//Unmaps every window still alive
+void DiskDriver_unmapWindows(DiskDriver* disk);
+
+//Journal helpers
+//Sets up disk->journal for a disk with header->journal_slots slots:
+//a new, empty one (_init()) or the one on disk, replayed if asked (_resume())
+int DiskDriver_journalOpen(DiskDriver* disk, int create, int replay);
+
+//Commits what is left, checkpoints and releases disk->journal
+void DiskDriver_journalClose(DiskDriver* disk);
+
+//Body of DiskDriver_commit(), the journal lock is held
+int DiskDriver_commitGroup(DiskDriver* disk);
+
+//Longest a group waits for more operations, in ms: DISK_JOURNAL_DELAY,
+//or the interval of DISK_SYNC_TIME
+unsigned long DiskDriver_journalDelay(DiskDriver* disk);
+
+//Body of the thread of a DISK_SHARED journal: it commits the running
+//group once it is too old and no operation is running (one still running
+//commits it when it ends). Single-threaded disks have none: a group left
+//alone commits at the next write or free (DiskDriver_syncTick())
+void* DiskDriver_committer(void* arg);
+
+//1 if a write or a free of block_num has to go through the journal
+int DiskDriver_journaled(DiskDriver* disk, unsigned int block_num);
+
+//Entry of block_num in the running group, added if create. NULL if none
+DiskJournalEntry* DiskDriver_journalFind(DiskDriver* disk, 
+									unsigned int block_num, int create);
+
+//Logs a write or a free of block_num in the running group
+int DiskDriver_journalWrite(DiskDriver* disk, const void* src, 
+												unsigned int block_num);
+void DiskDriver_journalFree(DiskDriver* disk, unsigned int block_num);
+
+//Slots the running group would take, with extra more entries and images
+unsigned int DiskDriver_journalSlots(DiskDriver* disk, int extra_entries, 
+													int extra_images);
+
+//Syncs every block written so far and frees the whole journal
+int DiskDriver_journalCheckpoint(DiskDriver* disk);
+
+//Moves count slots from pos (wrapping around) between buf and the file
+int DiskDriver_journalIO(DiskDriver* disk, char* buf, unsigned int pos, 
+										unsigned int count, int is_write);
+
+//Applies the groups committed after the last checkpoint
+int DiskDriver_journalReplay(DiskDriver* disk);
+
+//Checksum of len bytes (a multiple of 8)
+unsigned int DiskDriver_checksum(const char* data, size_t len);
+
+//Lock helpers (DISK_SHARED)
+//Allocates disk->locks if mode has DISK_SHARED, sets it to NULL otherwise
+void DiskDriver_lockInit(DiskDriver* disk, int mode);
+
+//Releases disk->locks
+void DiskDriver_lockClose(DiskDriver* disk);
+
+//Lock and unlock, doing nothing on NULL
+void DiskDriver_lock(pthread_mutex_t* lock);
+void DiskDriver_unlock(pthread_mutex_t* lock);
+
+//Window containing ptr, NULL if none
+DiskWindow* DiskDriver_windowOf(DiskDriver* disk, const char* ptr);
+
+//Flush helpers
+//No dirty range, default policy (at open time)
+void DiskDriver_resetSync(DiskDriver* disk);
+
+//Adds bytes [begin, end) of the file to the dirty ranges
+void DiskDriver_dirty(DiskDriver* disk, off_t begin, off_t end);
+
+//Same, for count blocks from block_num
+void DiskDriver_dirtyBlocks(DiskDriver* disk, unsigned int block_num, 
+												unsigned int count);
+
+//Counts ops blocks written or freed, and flushes if the policy says so
+void DiskDriver_syncTick(DiskDriver* disk, unsigned int ops);
+
+//Milliseconds of the monotonic clock
+unsigned long DiskDriver_msec(void);
+
 
 
 
 /** Implementation of the functions **/
 int DiskDriver_init(DiskDriver* disk, const char* filename, unsigned int num_blocks){
+	return DiskDriver_initMode(disk, filename, num_blocks, 0);
+}
+
+
+int DiskDriver_initMode(DiskDriver* disk, const char* filename, 
+								unsigned int num_blocks, int mode){
+	return DiskDriver_initGeometry(disk, filename, num_blocks, BLOCK_SIZE, mode);
+}
+
+
+int DiskDriver_initGeometry(DiskDriver* disk, const char* filename, 
+			unsigned int num_blocks, unsigned int block_size, int mode){
+	
+	if(block_size < DISK_MIN_BLOCK_SIZE || block_size > DISK_MAX_BLOCK_SIZE 
+								|| (block_size & (block_size-1)) != 0){
+		printf("Invalid block size %u!\n", block_size);
+		return -1;
+	}
+	if(num_blocks > DISK_MAX_BLOCKS){
+		printf("Invalid number of blocks %u: at most %d, %lld GiB with %u byte\
+ blocks (bigger disks need bigger blocks)!\n", num_blocks, DISK_MAX_BLOCKS, 
+			(long long)(DISK_MAX_BYTES(block_size) >> 30), block_size);
+		return -1;
+	}
 	
-	int res = open(filename, O_CREAT | O_TRUNC| O_RDWR, 0777);
 	//I want an already made disk to be opened by DiskDriver_resume() function
+	//A lazy format doesn't care about old contents: they are not even freed
+	int flags = O_CREAT | O_RDWR;
+	if(!(mode & DISK_LAZY)) flags |= O_TRUNC;
+	int res = open(filename, flags, 0777);
+	if(res == -1){
+		printf("Error opening file! \n");
+		return -1;
+	}
+	DiskDriver_resetSync(disk);
+	DiskDriver_lockInit(disk, mode);
+	disk->unclean = 0;
+	disk->reserved = NULL; //Nothing is reserved at open time
+	disk->num_reserved = disk->max_reserved = 0;
 	
-	int bitmap_size = sizeof(int) + num_blocks*sizeof(char);
+	unsigned int bitmap_words = (num_blocks+63)/64;
+	int bitmap_size = DISK_HEADER_SIZE + bitmap_words*sizeof(uint64_t);
 	int padding_size; 
 	
-	if(bitmap_size%PAGE_SIZE!=0) padding_size = 
-								PAGE_SIZE-(bitmap_size%PAGE_SIZE);
+	//Block 0 is aligned to a page, or to a block if they are bigger
+	unsigned int page_size = DiskDriver_pageSize();
+	unsigned int align = (block_size > page_size) ? block_size : page_size;
+	
+	if(bitmap_size%align!=0) padding_size = align-(bitmap_size%align);
 	/*It solves a bug that allocates a unuseful extra page 
 	 * if previous page was exactly full
 	 */
 	 
-	else padding_size = bitmap_size%PAGE_SIZE;
+	else padding_size = bitmap_size%align;
 	
-	char* bitmap_padding = (char*)malloc(sizeof(char)*padding_size); 
 	printf("Number of blocks = %d\nBitmap size = \
 %d\nPadding bytes = %d\n",num_blocks,bitmap_size,padding_size);
 
 	bitmap_size += padding_size; 
 	printf("Final Bitmap size = %d\n", bitmap_size);
-	unsigned int disk_size = bitmap_size + num_blocks*BLOCK_SIZE;
-	printf("Final Disk size = %ud\n", disk_size);
+	
+	//The journal goes between bitmap and block 0, still aligned
+	int journal_offset = bitmap_size;
+	unsigned int journal_slots = 0;
+	if(mode & DISK_JOURNAL){
+		journal_slots = DISK_JOURNAL_SIZE/block_size;
+		if(journal_slots < DISK_JOURNAL_MIN_SLOTS) 
+			journal_slots = DISK_JOURNAL_MIN_SLOTS;
+		bitmap_size += (journal_slots*block_size + align-1)/align*align;
+	}
+	off_t disk_size = bitmap_size + (off_t)num_blocks*block_size;
+	printf("Final Disk size = %lld\n", (long long)disk_size);
 	
 	//Mapping my disk in process memory
 	if(ftruncate(res, disk_size) == -1){  
@@ -102,38 +860,60 @@ int DiskDriver_init(DiskDriver* disk, const char* filename, unsigned int num_blo
 			exit(-1);
 	}
 	
+	//The block area stays sparse, but header and bitmap are reserved:
+	//writing a hole through the mapping on a full file system is fatal
+	if(mode & DISK_LAZY) posix_fallocate(res, 0, bitmap_size);
+	
 	char* disk_map = (char*)mmap(NULL, bitmap_size, 
 		PROT_READ|PROT_WRITE, MAP_SHARED, res, 0); //mmapping bitmap area on fd
 	disk->disk_map = disk_map;
 	disk->num_entries = num_blocks;
 	
-	//Writing down bitmap to mmapped area
-	memcpy(disk_map, &num_blocks, sizeof(int)); //Writing down first integer
-	
-	char* dest = disk_map + sizeof(int);
-	int i, j;
-	char zero, one;
-	zero = 0x00;	
-	one = 0xFF;
+	//Writing down header to mmapped area
+	DiskHeader header;
+	memset(&header, 0, sizeof(DiskHeader));
+	header.magic = DISK_MAGIC;
+	header.num_blocks = num_blocks;
+	header.first_block_offset = bitmap_size;
+	header.version = DISK_VERSION;
+	header.block_size = block_size;
+	header.page_size = page_size;
+	header.free_blocks = num_blocks;
+	header.init_chunks = (bitmap_words+DISK_CHUNK_WORDS-1)/DISK_CHUNK_WORDS;
+	if(mode & DISK_LAZY) header.init_chunks = 0;
+	header.journal_offset = journal_offset;
+	header.journal_slots = journal_slots;
+	memcpy(disk_map, &header, sizeof(DiskHeader));
+	disk->header = (DiskHeader*)disk_map;
 	
-	for(i=0;i<num_blocks;i++){	//Writing down bitmap itself
-	 memcpy(dest+i, &zero, sizeof(char));  
-	}
-	
-	for(j=0;j<padding_size;j++){		
-	 memcpy(dest+i+j, &one, sizeof(char)); //Writing down padding
+	//Writing down bitmap itself: all empty, but the padding bits
+	//after the last block are full so that no one will ever pick them
+	disk->bitmap = (uint64_t*)(disk_map + DISK_HEADER_SIZE);
+	disk->bitmap_words = bitmap_words;
+	if(!(mode & DISK_LAZY)){
+		memset(disk->bitmap, 0, bitmap_words*sizeof(uint64_t));
+		if(num_blocks%64 != 0) 
+			disk->bitmap[bitmap_words-1] = ~0ULL << (num_blocks%64);
 	}
 	
 	//Compiling struct
-	disk->disk_map = disk_map;
-	disk->block_map = NULL; //This will be mapped upon use
 	disk->fd = res;
-	disk->free_blocks = num_blocks;
+	//Every block is free, nothing to count (shared disks count anyway,
+	//so that their counters are never DISK_CHUNK_UNKNOWN)
+	if(mode & DISK_SHARED) DiskDriver_buildSummary(disk);
+	else DiskDriver_lazySummary(disk);
 	disk->first_block_offset = bitmap_size;
-	disk->first_mapped_block = 0xFFFFFFFF;
-	
-	//Polishment
-	free(bitmap_padding);
+	DiskDriver_setGeometry(disk, &header);
+	if(!(mode & DISK_LAZY)) DiskDriver_dirty(disk, DISK_HEADER_SIZE, 
+							DISK_HEADER_SIZE + bitmap_words*sizeof(uint64_t));
+	DiskDriver_resetWindows(disk);
+	DiskDriver_mapWhole(disk, mode);
+	DiskDriver_selectBackend(disk);
+	if(DiskDriver_journalOpen(disk, 1, 0) != 0){
+		printf("Error writing the journal!\n");
+		return -1;
+	}
+	DiskDriver_markMounted(disk);
 	
 	return 0;
 }
@@ -144,27 +924,24 @@ int DiskDriver_readBlock(DiskDriver* disk, void* dest,
 	
 	if(block_num<0 || block_num > 
 					disk->num_entries -1) return -2; //Invalid block num
-	char* cursor = disk->disk_map;
-	cursor += sizeof(disk->num_entries);
-	if((int)cursor[block_num] != 0 
-				&& (int)cursor[block_num]!=1){ //Something went wrong
-		printf("The bitmap is damaged!\n");
-		exit(-1);
-	}
 	
-	if((int)cursor[block_num] == 0) return -1; //Empty block
-
-	if((int)cursor[block_num] == 1){  //Copying full block in dest memory	
-		char* src = DiskDriver_getBlock(disk, block_num);
-		//printf("DBG src pointer: %p\n", src);
-		if(src==NULL){
-			printf("Can't read from invalid address\n");
-			return -1;
+	if(DiskDriver_bitmapGet(disk, block_num) == 0) return -1; //Empty block
+	
+	//Written by a group not committed yet: the image is in the journal
+	if(disk->journal != NULL && disk->journal->num_images > 0){
+		DiskDriver_lock(DISK_LOCK(disk, journal));
+		DiskJournalEntry* e = DiskDriver_journalFind(disk, block_num, 0);
+		if(e != NULL && e->image >= 0){
+			memcpy(dest, disk->journal->images 
+					+ (size_t)e->image*disk->block_size, disk->block_size);
+			DiskDriver_unlock(DISK_LOCK(disk, journal));
+			return 0;
 		}
-		memcpy(dest, src, BLOCK_SIZE); //TODO: Serious bug here. Seek and destroy.
+		DiskDriver_unlock(DISK_LOCK(disk, journal));
 	}
-	return 0;
 	
+	//Copying full block in dest memory	
+	return disk->backend->read(disk, dest, block_num);
 }
 
 
@@ -173,177 +950,2473 @@ int DiskDriver_writeBlock(DiskDriver* disk, void* src,
 	
 	if(block_num<0 || block_num>disk->num_entries -1) 
 										return -1; //Invalid block num
-	char* cursor = disk->disk_map;
-	cursor += sizeof(disk->num_entries);
 	
-	if(cursor[block_num]==0) {
-		disk->free_blocks -= 1;
-		cursor[block_num] = 1;  //Updating Bitmap
+	if(DiskDriver_bitmapGet(disk, block_num) == 0) {
+		DiskDriver_markFull(disk, block_num);  //Updating Bitmap
 	}
 	
-	//Copying full block in dest memory
-	char* res = DiskDriver_getBlock(disk, block_num);
-	if(res!=NULL) memcpy(res, src, BLOCK_SIZE); 
-	else {
-
-		return -1;
+	int res;
+	if(DiskDriver_journaled(disk, block_num)) 
+		res = DiskDriver_journalWrite(disk, src, block_num);
+	else{
+		//Copying full block in dest memory
+		DiskDriver_dirtyBlocks(disk, block_num, 1);
+		res = disk->backend->write(disk, src, block_num);
 	}
-	
-	return 0;
+	__atomic_fetch_add(&disk->written, 1, __ATOMIC_RELAXED);
+	DiskDriver_syncTick(disk, 1);
+	return res;
 }
 
 
 int DiskDriver_freeBlock(DiskDriver* disk, unsigned int block_num){
 	
 	if(block_num<0 || block_num>disk->num_entries-1) return -1; //Invalid block num
-	char* cursor = disk->disk_map;
-	cursor += sizeof(disk->num_entries);
 	
-	if(cursor[block_num] == 1) {
-		disk->free_blocks++;
-		cursor[block_num] = 0; 
+	if(DiskDriver_bitmapGet(disk, block_num) == 1) {
+		//The bit is cleared by the commit
+		if(DiskDriver_journaled(disk, block_num)) 
+			DiskDriver_journalFree(disk, block_num);
+		else DiskDriver_markEmpty(disk, block_num);
+		DiskDriver_syncTick(disk, 1);
 	}
 		
 	return 0;
 }
 
 
-int DiskDriver_getFreeBlock(DiskDriver* disk, unsigned int start){
-	
-	if(start<0 || start>disk->num_entries-1) return -1; //Invalid start block
-	char* cursor = disk->disk_map;
-	cursor += sizeof(disk->num_entries);
+int DiskDriver_readBlocks(DiskDriver* disk, void** dest, 
+								unsigned int* block_nums, int count){
 	
-	int i = start;
-	while(i<disk->num_entries){
-		if(cursor[i] == 0) return i;
-		i++;
+	int i;
+	for(i=0;i<count;i++){
+		if(block_nums[i] > disk->num_entries-1) return -2; //Invalid block num
+		if(DiskDriver_bitmapGet(disk, block_nums[i]) == 0) return -1; //Empty block
 	}
+	if(count == 0) return 0;
 	
-	return -1;
+	DiskIOVec* vec = DiskDriver_makeVec(dest, block_nums, count);
+	int res = disk->backend->readBlocks(disk, vec, count);
+	free(vec);
+	
+	//Images of the running group replace what was read
+	if(res == 0 && disk->journal != NULL && disk->journal->num_images > 0){
+		DiskDriver_lock(DISK_LOCK(disk, journal));
+		for(i=0;i<count;i++){
+			DiskJournalEntry* e = DiskDriver_journalFind(disk, block_nums[i], 0);
+			if(e != NULL && e->image >= 0) memcpy(dest[i], disk->journal->images 
+					+ (size_t)e->image*disk->block_size, disk->block_size);
+		}
+		DiskDriver_unlock(DISK_LOCK(disk, journal));
+	}
+	return res;
 }
 
 
-void DiskDriver_close(DiskDriver* disk){
-	
-	//Updating bitmap
-	munmap(disk->block_map, sizeof(char)*8); //Unmapping blocks, assuming 8 blocks for portion
+int DiskDriver_writeBlocks(DiskDriver* disk, void** src, 
+								unsigned int* block_nums, int count){
 	
-	int bitmap_size = sizeof(int) + disk->num_entries*sizeof(char);
-	int padding_size; 
-	if(bitmap_size%PAGE_SIZE!=0) padding_size = 
-						PAGE_SIZE-(bitmap_size%PAGE_SIZE); 
-	/*It solves a bug that allocates a unuseful extra page 
-	 *if previous page was exactly full
-	 */
+	int i;
+	for(i=0;i<count;i++){
+		if(block_nums[i] > disk->num_entries-1) return -1; //Invalid block num
+	}
+	if(count <= 0) return 0;
 	
-	else padding_size = bitmap_size%PAGE_SIZE;
-	bitmap_size += padding_size; 
+	for(i=0;i<count;i++){ //Updating Bitmap
+		if(DiskDriver_bitmapGet(disk, block_nums[i]) == 0) 
+			DiskDriver_markFull(disk, block_nums[i]);
+	}
 	
-	munmap(disk->disk_map, bitmap_size); //Unmapping disk
-	close(disk->fd);  //Closing disk file
-	exit(0); //Bye!
+	//Blocks that go through the journal are taken out of the batch
+	void** bufs = src;
+	unsigned int* nums = block_nums;
+	int n = count, res = 0;
+	if(disk->journal != NULL && (disk->journal->depth > 0 
+							|| disk->journal->num_entries > 0)){
+		bufs = (void**)malloc(count*sizeof(void*));
+		nums = (unsigned int*)malloc(count*sizeof(int));
+		n = 0;
+		for(i=0;i<count && res==0;i++){
+			if(DiskDriver_journaled(disk, block_nums[i])){
+				res = DiskDriver_journalWrite(disk, src[i], block_nums[i]);
+				continue;
+			}
+			bufs[n] = src[i];
+			nums[n++] = block_nums[i];
+		}
+	}
 	
+	if(res == 0 && n > 0){
+		DiskIOVec* vec = DiskDriver_makeVec(bufs, nums, n);
+		for(i=0;i<n;i++) DiskDriver_dirtyBlocks(disk, vec[i].block_num, 1);
+		res = disk->backend->writeBlocks(disk, vec, n);
+		free(vec);
+	}
+	if(bufs != src){
+		free(bufs);
+		free(nums);
+	}
+	__atomic_fetch_add(&disk->written, count, __ATOMIC_RELAXED);
+	DiskDriver_syncTick(disk, count);
+	return res;
 }
 
 
-int DiskDriver_resume(DiskDriver* disk, const char* filename){
-	
-	int num_blocks;
-	int fd;
+int DiskDriver_freeBlocks(DiskDriver* disk, unsigned int* block_nums, 
+														int count){
 	
-	fd = open(filename, O_RDWR);
-	if(fd == -1){
-		printf("Error opening file! \n");
-		return -1;
-		
+	int i;
+	for(i=0;i<count;i++){
+		if(DiskDriver_freeBlock(disk, block_nums[i]) != 0) return -1;
 	}
-	disk->fd = fd;
+	return 0;
+}
+
+
+int DiskDriver_getFreeBlock(DiskDriver* disk, unsigned int start){
 	
-	//Retrieving bitmap lenght!
-	int* temp = (int*)mmap(NULL, sizeof(int), PROT_READ|PROT_WRITE, 
-											MAP_SHARED, disk->fd, 0);
-	num_blocks = *temp; 
-	munmap(temp, sizeof(int));
+	//Reserved runs are jumped over
+	int block = DiskDriver_findFree(disk, start);
+	unsigned int end;
+	while(block != -1 && DiskDriver_reservedNext(disk, block, &end) == block)
+		block = (end < disk->num_entries) ? DiskDriver_findFree(disk, end) : -1;
+	return block;
+}
+
+
+int DiskDriver_findFree(DiskDriver* disk, unsigned int start){
 	
-	disk->num_entries = num_blocks;
-		
-	int bitmap_size = sizeof(int) + num_blocks*sizeof(char);
-	int padding_size; 
-	if(bitmap_size%PAGE_SIZE!=0) padding_size = 
-					PAGE_SIZE-(bitmap_size%PAGE_SIZE); 
-	/*Solves a bug that allocates a unuseful extra page 
-	 * if previous page was exactly full
-	 */
-	 
-	else padding_size = bitmap_size%PAGE_SIZE;
-	bitmap_size += padding_size; 
-	unsigned int disk_size = bitmap_size + num_blocks*BLOCK_SIZE;
+	if(start<0 || start>disk->num_entries-1) return -1; //Invalid start block
 	
-	//Mapping my disk in process memory
-	if(ftruncate(disk->fd, disk_size) == -1){  
-			printf("Error truncating file /n");
-			exit(-1);
+	//The chunk of start first, if it has empty blocks at all
+	unsigned int chunk = start/DISK_CHUNK_BLOCKS;
+	unsigned int end_word = (chunk+1)*DISK_CHUNK_WORDS;
+	if(end_word > disk->bitmap_words) end_word = disk->bitmap_words;
+	
+	if(DiskDriver_chunkFree(disk, chunk) != 0){
+		int res = DiskDriver_scanBitmap(disk, start, end_word);
+		if(res != -1) return res;
 	}
 	
-	char* disk_map = (char*)mmap(NULL, bitmap_size, 
-		PROT_READ|PROT_WRITE, MAP_SHARED, disk->fd, 0); //mmapping bitmap area on fd
-	disk->disk_map = disk_map;
+	//Then straight to the next chunk with empty blocks
+	//(chunks not counted yet are candidates until they are)
+	int next = DiskDriver_nextChunk(disk, chunk+1);
+	while(next != -1 && DiskDriver_chunkFree(disk, next) == 0) 
+		next = DiskDriver_nextChunk(disk, next+1);
+	if(next == -1) return -1;
 	
-	disk->block_map = (char*)NULL;
-	disk->first_mapped_block = 0xFFFFFFFF; //Int doesn't support null value in C
+	end_word = (next+1)*DISK_CHUNK_WORDS;
+	if(end_word > disk->bitmap_words) end_word = disk->bitmap_words;
+	return DiskDriver_scanBitmap(disk, next*DISK_CHUNK_BLOCKS, end_word);
+}
 
-	disk->first_block_offset = bitmap_size;
+
+int DiskDriver_getFreeExtent(DiskDriver* disk, unsigned int goal, 
+				unsigned int min_len, unsigned int max_len, unsigned int* len){
+	return DiskDriver_findExtent(disk, goal, min_len, max_len, len, 0);
+}
+
+
+int DiskDriver_reserveExtent(DiskDriver* disk, unsigned int goal, 
+				unsigned int min_len, unsigned int max_len, unsigned int* len){
+	return DiskDriver_findExtent(disk, goal, min_len, max_len, len, 1);
+}
+
+
+int DiskDriver_findExtent(DiskDriver* disk, unsigned int goal, 
+	unsigned int min_len, unsigned int max_len, unsigned int* len, int reserve){
 	
-	//Calculating free space
-	int i;
-	disk->free_blocks = 0; 
-	char* cursor = disk->disk_map;
-	cursor += sizeof(disk->num_entries);
-	for (i=0; i<num_blocks; i++){
-		if (cursor[i] == 0) disk->free_blocks += 1;
-	}
+	if(min_len == 0 || min_len > max_len) return -1; //Invalid lenght
+	if(goal > disk->num_entries-1) goal = 0;
 	
-	printf("Resumed!\n");
-	return 0;
+	//From goal to the end, then from the beginning to goal
+	int pass, block;
+	unsigned int run, i, next, end;
+	for(pass=0;pass<2;pass++){
+		unsigned int cursor = (pass == 0) ? goal : 0;
+		unsigned int stop = (pass == 0) ? disk->num_entries : goal;
+		
+		while(cursor < stop){
+			block = DiskDriver_getFreeBlock(disk, cursor);
+			if(block == -1 || block >= stop) break;
+			
+			//The run ends at the next full or reserved block
+			run = DiskDriver_runLength(disk, block, max_len);
+			next = DiskDriver_reservedNext(disk, block, &end);
+			if(run > next - block) run = next - block;
+			if(run >= min_len && reserve){
+				i = DiskDriver_reserveRun(disk, block, run, min_len);
+				if(i > 0){
+					*len = i;
+					return block;
+				}
+				cursor = block + 1;
+				continue;
+			}
+			if(run >= min_len && disk->locks != NULL){
+				//Blocks are claimed one by one, up to the first lost race,
+				//and given back if a reservation got there first
+				for(i=0;i<run && DiskDriver_markFull(disk, block+i);i++);
+				next = DiskDriver_reservedNext(disk, block, &end);
+				while(i > next - block) DiskDriver_markEmpty(disk, block + --i);
+				if(i >= min_len){
+					*len = i;
+					return block;
+				}
+				while(i > 0) DiskDriver_markEmpty(disk, block + --i);
+				cursor = block + 1;
+				continue;
+			}
+			if(run >= min_len){
+				for(i=0;i<run;i++) DiskDriver_markFull(disk, block+i);
+				*len = run;
+				return block;
+			}
+			cursor = block + run; //Too short, the next one is full anyway
+		}
+	}
 	
+	*len = 0;
+	return -1;
 }
 
 
-char* DiskDriver_getBlock(DiskDriver* disk, unsigned int block_index){
-	
-	//printf("DBG block to point: %d\n", block_index);
+int DiskDriver_allocBlock(DiskDriver* disk, unsigned int start){
 	
-	if(block_index<0 || block_index > disk->num_entries-1){ //Security check
-		printf("Invalid block index!\n");
-		return (char*)NULL; 
+	//Where this thread goes on: after its last block, or a chunk of its own
+	static __thread DiskDriver* hint_disk = NULL;
+	static __thread unsigned int hint = 0;
+	static unsigned int threads = 0;
+	if(start == DISK_NO_HINT){
+		if(hint_disk != disk){
+			unsigned int id = __atomic_fetch_add(&threads, 1, __ATOMIC_RELAXED);
+			hint_disk = disk;
+			hint = (unsigned int)((id*2654435761U) % disk->num_chunks)
+														*DISK_CHUNK_BLOCKS;
+		}
+		start = hint;
 	}
+	if(start > disk->num_entries-1) start = 0;
 	
-	int mapped_blocks = PAGE_SIZE/BLOCK_SIZE; //This has likely to be == 8
-	int offset;
-	
-	if(disk->first_mapped_block != 0xFFFFFFFF){
-		if(block_index >= disk->first_mapped_block 
-			  && block_index < (disk->first_mapped_block+mapped_blocks)){
-			//Calculating relative block index into mmapped block portion
-			offset = block_index - disk->first_mapped_block;
-			
-			//Moving to the first byte of that block and returning it
-			return &(disk->block_map[offset*BLOCK_SIZE]); 
+	//The block found may be taken (or reserved) before it is marked:
+	//going on from there
+	int block, pass;
+	unsigned int end;
+	for(pass=0;pass<2;pass++){
+		block = DiskDriver_getFreeBlock(disk, start);
+		while(block != -1 && !DiskDriver_markFull(disk, block)) 
+			block = DiskDriver_getFreeBlock(disk, block);
+		while(block != -1 && disk->locks != NULL 
+				&& DiskDriver_reservedNext(disk, block, &end) == block){
+			DiskDriver_markEmpty(disk, block);
+			block = DiskDriver_getFreeBlock(disk, block);
+			while(block != -1 && !DiskDriver_markFull(disk, block)) 
+				block = DiskDriver_getFreeBlock(disk, block);
 		}
+		if(block != -1) break;
+		if(start == 0) return -1;
+		start = 0; //Then from the beginning
 	}
+	if(block == -1) return -1;
 	
-	//It represents the portion of blocks that has to be mmapped to get the block "block_index"
-	offset = (block_index/mapped_blocks)*PAGE_SIZE; 
-	if(disk->block_map != NULL)
-		munmap(disk->block_map, BLOCK_SIZE*PAGE_SIZE); //Avoids mem leaks
+	if(hint_disk == disk) hint = block + 1;
+	return block;
+}
+
+
+unsigned int DiskDriver_spreadGroup(DiskDriver* disk, unsigned int block){
 	
-	disk->block_map = (char*)mmap(NULL, BLOCK_SIZE*PAGE_SIZE , 
-						PROT_READ|PROT_WRITE, MAP_SHARED, disk->fd, 
-										disk->first_block_offset+offset);
-	disk->first_mapped_block = (block_index/mapped_blocks)*mapped_blocks; 
+	//free_blocks is only refreshed by DiskDriver_countFree() on shared 
+	//disks: a rough average is fine here
+	unsigned int group = (block % disk->num_entries)/DISK_CHUNK_BLOCKS;
+	unsigned int average = disk->free_blocks/disk->num_chunks, i, next, count;
+	
+	//Initialized groups first, so that new dirs don't push init_chunks on
+	unsigned int init = __atomic_load_n(&disk->header->init_chunks, 
+														__ATOMIC_ACQUIRE);
+	for(i=1;group<init && i<init;i++){
+		next = (group+i) % init;
+		count = DiskDriver_chunkFree(disk, next);
+		if(count > 0 && count >= average) return next*DISK_CHUNK_BLOCKS;
+	}
+	for(i=1;i<=disk->num_chunks;i++){
+		next = (group+i) % disk->num_chunks;
+		count = DiskDriver_chunkFree(disk, next);
+		if(count > 0 && count >= average) return next*DISK_CHUNK_BLOCKS;
+	}
+	return group*DISK_CHUNK_BLOCKS;
+}
+
+
+unsigned int DiskDriver_countFree(DiskDriver* disk){
+	
+	unsigned int i, res = 0;
+	for(i=0;i<disk->num_chunks;i++) res += DiskDriver_chunkFree(disk, i);
+	disk->free_blocks = res;
+	return res;
+}
+
+
+int DiskDriver_freeExtent(DiskDriver* disk, unsigned int start, 
+												unsigned int len){
+	
+	unsigned int i;
+	for(i=0;i<len;i++){
+		if(DiskDriver_freeBlock(disk, start+i) != 0) return -1;
+	}
+	return 0;
+}
+
+
+void DiskDriver_releaseExtent(DiskDriver* disk, unsigned int start, 
+												unsigned int len){
+	
+	//Nothing to give back (a handle with an empty pool): no run is split
+	if(len == 0) return;
+	DiskDriver_lock(DISK_LOCK(disk, reserved));
+	unsigned int stop = start + len;
+	int i = 0;
+	while(i < disk->num_reserved){
+		DiskExtent* r = &disk->reserved[i];
+		unsigned int r_end = r->start + r->len;
+		if(r_end <= start || r->start >= stop){
+			i++;
+			continue;
+		}
+		
+		//What is left of the run on each side of the range
+		if(r->start < start && r_end > stop){ //Split in two
+			if(disk->num_reserved == disk->max_reserved){
+				disk->max_reserved = 2*disk->max_reserved;
+				disk->reserved = (DiskExtent*)realloc(disk->reserved, 
+									disk->max_reserved*sizeof(DiskExtent));
+				r = &disk->reserved[i];
+			}
+			memmove(r+2, r+1, (disk->num_reserved-i-1)*sizeof(DiskExtent));
+			r[1].start = stop;
+			r[1].len = r_end - stop;
+			r->len = start - r->start;
+			__atomic_store_n(&disk->num_reserved, disk->num_reserved+1, 
+														__ATOMIC_SEQ_CST);
+			break;
+		}
+		if(r->start < start){
+			r->len = start - r->start;
+			i++;
+		}
+		else if(r_end > stop){
+			r->len = r_end - stop;
+			r->start = stop;
+			i++;
+		}
+		else{
+			memmove(r, r+1, (disk->num_reserved-i-1)*sizeof(DiskExtent));
+			__atomic_store_n(&disk->num_reserved, disk->num_reserved-1, 
+														__ATOMIC_SEQ_CST);
+		}
+	}
+	DiskDriver_unlock(DISK_LOCK(disk, reserved));
+}
+
+
+unsigned int DiskDriver_reservedNext(DiskDriver* disk, unsigned int block, 
+														unsigned int* end){
+	
+	//Nothing reserved: no lock taken (the store of num_reserved is
+	//sequentially consistent, like the bitmap changes it is ordered with)
+	*end = disk->num_entries;
+	if(__atomic_load_n(&disk->num_reserved, __ATOMIC_SEQ_CST) == 0) 
+		return disk->num_entries;
+	
+	//First run ending after block
+	DiskDriver_lock(DISK_LOCK(disk, reserved));
+	int low = 0, high = disk->num_reserved;
+	while(low < high){
+		int mid = (low + high)/2;
+		DiskExtent* r = &disk->reserved[mid];
+		if(r->start + r->len <= block) low = mid + 1;
+		else high = mid;
+	}
+	unsigned int res = disk->num_entries;
+	if(low < disk->num_reserved){
+		DiskExtent* r = &disk->reserved[low];
+		res = (r->start > block) ? r->start : block;
+		*end = r->start + r->len;
+	}
+	DiskDriver_unlock(DISK_LOCK(disk, reserved));
+	return res;
+}
+
+
+unsigned int DiskDriver_reserveRun(DiskDriver* disk, unsigned int block, 
+									unsigned int len, unsigned int min_len){
+	
+	//Cut at a run reserved meanwhile, then added in order
+	DiskDriver_lock(DISK_LOCK(disk, reserved));
+	int low = 0, high = disk->num_reserved;
+	while(low < high){
+		int mid = (low + high)/2;
+		if(disk->reserved[mid].start + disk->reserved[mid].len <= block) 
+			low = mid + 1;
+		else high = mid;
+	}
+	if(low < disk->num_reserved && disk->reserved[low].start < block + len) 
+		len = (disk->reserved[low].start > block) ? 
+								disk->reserved[low].start - block : 0;
+	if(len < min_len){
+		DiskDriver_unlock(DISK_LOCK(disk, reserved));
+		return 0;
+	}
+	if(disk->num_reserved == disk->max_reserved){
+		disk->max_reserved = (disk->max_reserved > 0) ? 2*disk->max_reserved : 16;
+		disk->reserved = (DiskExtent*)realloc(disk->reserved, 
+								disk->max_reserved*sizeof(DiskExtent));
+	}
+	DiskExtent* r = &disk->reserved[low];
+	memmove(r+1, r, (disk->num_reserved-low)*sizeof(DiskExtent));
+	r->start = block;
+	r->len = len;
+	__atomic_store_n(&disk->num_reserved, disk->num_reserved+1, 
+													__ATOMIC_SEQ_CST);
+	DiskDriver_unlock(DISK_LOCK(disk, reserved));
+	
+	//On a shared disk a block may have been claimed before the run was 
+	//recorded: only the part still empty is kept
+	unsigned int i = len;
+	if(disk->locks != NULL){
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		for(i=0;i<len && DiskDriver_bitmapGet(disk, block+i) == 0;i++);
+		if(i < min_len) i = 0;
+		if(i < len) DiskDriver_releaseExtent(disk, block+i, len-i);
+	}
+	return i;
+}
+
+
+unsigned int DiskDriver_runLength(DiskDriver* disk, unsigned int start, 
+												unsigned int max){
+	
+	//Padding bits of uninitialized chunks are not set yet: 
+	//a run never goes past the last block anyway
+	if(max > disk->num_entries - start) max = disk->num_entries - start;
+	
+	unsigned int init_words = __atomic_load_n(&disk->header->init_chunks, 
+									__ATOMIC_ACQUIRE)*DISK_CHUNK_WORDS;
+	unsigned int w = start/64, run = 0;
+	uint64_t word = (w < init_words) ? DiskDriver_word(disk, w) >> (start%64) : 0;
+	unsigned int bits = 64 - start%64;
+	
+	while(run < max){
+		if(word != 0){ //The run ends in this word
+			run += __builtin_ctzll(word);
+			break;
+		}
+		run += bits;
+		w++;
+		if(w >= disk->bitmap_words) break;
+		word = (w < init_words) ? DiskDriver_word(disk, w) : 0;
+		bits = 64;
+	}
+	
+	return (run < max) ? run : max;
+}
+
+
+int DiskDriver_scanBitmap(DiskDriver* disk, unsigned int start, 
+												unsigned int end_word){
+	
+	//The range is in one chunk: never initialized means all empty
+	if(start/DISK_CHUNK_BLOCKS >= __atomic_load_n(&disk->header->init_chunks, 
+															__ATOMIC_ACQUIRE)) 
+		return (start < disk->num_entries) ? (int)start : -1;
+	
+	//First word: blocks before start count as full
+	unsigned int w = start/64;
+	uint64_t empty = ~DiskDriver_word(disk, w) & (~0ULL << (start%64));
+	if(empty != 0) return w*64 + __builtin_ctzll(empty);
+	w++;
+	
+	//Skipping full words, 256 or 128 blocks at a time if possible
+	//(not on shared disks: vector loads of words being changed are races)
+#if defined(__AVX2__)
+	__m256i full = _mm256_set1_epi64x(-1);
+	while(disk->locks == NULL && w+4 <= end_word && _mm256_testc_si256(
+		_mm256_loadu_si256((__m256i*)(disk->bitmap+w)), full)) w += 4;
+#elif defined(__SSE2__)
+	__m128i full = _mm_set1_epi32(-1);
+	while(disk->locks == NULL && w+2 <= end_word && _mm_movemask_epi8(
+		_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*)(disk->bitmap+w)), full)) 
+															== 0xFFFF) w += 2;
+#endif
+	
+	//64 blocks per step. Padding bits are full, so no bound check is needed
+	//(on a shared disk a word may change meanwhile: the caller claims the
+	//block with DiskDriver_markFull(), which tells if it was too late)
+	while(w < end_word){
+		empty = ~DiskDriver_word(disk, w);
+		if(empty != 0) return w*64 + __builtin_ctzll(empty);
+		w++;
+	}
+	
+	return -1;
+}
+
+
+void DiskDriver_close(DiskDriver* disk){
+	
+	DiskDriver_unmount(disk);
+	exit(0); //Bye!
+	
+}
+
+
+void DiskDriver_unmount(DiskDriver* disk){
+	
+	//Updating bitmap
+	DiskDriver_journalClose(disk); //Logged blocks go to their place
+	DiskDriver_asyncClose(disk); //Stopping queued I/O
+	DiskDriver_unmapWindows(disk); //Unmapping blocks
+	if(disk->whole_map != NULL) 
+		munmap(disk->whole_map-disk->map_shift, disk->whole_map_size);
+	
+	//Blocks and bitmap reach the disk before it is marked clean
+	//(never with DISK_SYNC_NONE: next resume will count the bitmap)
+	if(disk->locks != NULL) DiskDriver_countFree(disk);
+	if(disk->sync_policy != DISK_SYNC_NONE && DiskDriver_sync(disk) == 0){
+		disk->header->free_blocks = disk->free_blocks;
+		disk->header->clean = 1;
+		msync(disk->disk_map, DISK_HEADER_SIZE, MS_SYNC);
+	}
+	
+	munmap(disk->disk_map, disk->first_block_offset); //Unmapping disk
+	DiskDriver_freeSummary(disk);
+	DiskDriver_lockClose(disk);
+	free(disk->reserved); //Reservations never reached the disk
+	disk->reserved = NULL;
+	disk->num_reserved = 0;
+	close(disk->fd);  //Closing disk file
+}
+
+
+int DiskDriver_resume(DiskDriver* disk, const char* filename){
+	return DiskDriver_resumeMode(disk, filename, 0);
+}
+
+
+int DiskDriver_resumeMode(DiskDriver* disk, const char* filename, int mode){
+	
+	int num_blocks;
+	int fd;
+	
+	fd = open(filename, O_RDWR);
+	if(fd == -1){
+		printf("Error opening file! \n");
+		return -1;
+		
+	}
+	disk->fd = fd;
+	DiskDriver_resetSync(disk);
+	DiskDriver_lockInit(disk, mode);
+	disk->reserved = NULL; //Nothing is reserved at open time
+	disk->num_reserved = disk->max_reserved = 0;
+	
+	//Retrieving header!
+	DiskHeader header;
+	if(pread(fd, &header, sizeof(DiskHeader), 0) != sizeof(DiskHeader)){
+		printf("Error reading disk header! \n");
+		return -1;
+	}
+	if(header.magic != DISK_MAGIC){
+		printf("Old disk format detected, converting bitmap...\n");
+		if(DiskDriver_migrate(fd) != 0) return -1;
+		pread(fd, &header, sizeof(DiskHeader), 0);
+	}
+	num_blocks = header.num_blocks;
+	if(header.version == 0){ //Made before the geometry was stored
+		header.block_size = DISK_LEGACY_BLOCK_SIZE;
+		header.page_size = PAGE_SIZE;
+	}
+	if(header.version < 3) header.clean = 0; //No counters stored
+	disk->unclean = header.clean == 0;
+	if(header.block_size < DISK_MIN_BLOCK_SIZE 
+			|| header.block_size > DISK_MAX_BLOCK_SIZE
+			|| (header.block_size & (header.block_size-1)) != 0){
+		printf("Invalid block size %u in the superblock!\n", header.block_size);
+		close(fd);
+		return -1;
+	}
+	
+	disk->num_entries = num_blocks;
+	disk->bitmap_words = (num_blocks+63)/64;
+	DiskDriver_setGeometry(disk, &header);
+	
+	int bitmap_size = header.first_block_offset;
+	off_t disk_size = bitmap_size + (off_t)num_blocks*disk->block_size;
+	
+	//The file is already as big as the disk, unless it was cut
+	struct stat st;
+	if(fstat(disk->fd, &st) == -1 || (st.st_size < disk_size 
+								&& ftruncate(disk->fd, disk_size) == -1)){  
+			printf("Error truncating file /n");
+			exit(-1);
+	}
+	
+	//Mapping my disk in process memory
+	char* disk_map = (char*)mmap(NULL, bitmap_size, 
+		PROT_READ|PROT_WRITE, MAP_SHARED, disk->fd, 0); //mmapping bitmap area on fd
+	disk->disk_map = disk_map;
+	disk->header = (DiskHeader*)disk_map;
+	disk->bitmap = (uint64_t*)(disk_map + DISK_HEADER_SIZE);
+	if(header.version < 4) //Every chunk was written by _init()
+		disk->header->init_chunks = (disk->bitmap_words+DISK_CHUNK_WORDS-1)
+														/DISK_CHUNK_WORDS;
+	if(header.version < 5) disk->header->fs_flags = 0;
+	if(header.version < 6) disk->header->journal_slots = 0;
+	
+	DiskDriver_resetWindows(disk);
+
+	disk->first_block_offset = bitmap_size;
+	DiskDriver_mapWhole(disk, mode);
+	DiskDriver_selectBackend(disk);
+	
+	//Calculating free space and summary: a clean disk already knows it,
+	//after a crash the whole bitmap has to be counted
+	if(header.clean == 1 && !(mode & DISK_SHARED)) DiskDriver_lazySummary(disk);
+	else DiskDriver_buildSummary(disk);
+	
+	//Committed groups that may not be in place yet are written again
+	if(DiskDriver_journalOpen(disk, 0, header.clean == 0) != 0){
+		printf("Error replaying the journal!\n");
+		return -1;
+	}
+	DiskDriver_markMounted(disk);
+	
+	printf("Resumed!%s\n", header.clean ? "" : " (not cleanly unmounted)");
+	return 0;
+	
+}
+
+
+char* DiskDriver_getBlock(DiskDriver* disk, unsigned int block_index){
+	
+	//printf("DBG block to point: %d\n", block_index);
+	
+	if(block_index<0 || block_index > disk->num_entries-1){ //Security check
+		printf("Invalid block index!\n");
+		return (char*)NULL; 
+	}
+	
+	//Whole block area mapped: no window to look for
+	if(disk->whole_map != NULL)
+		return &(disk->whole_map[(size_t)block_index*disk->block_size]);
+	
+	int mapped_blocks = disk->window_size/disk->block_size; //This has likely to be == 8
+	unsigned int first_block = (block_index/mapped_blocks)*mapped_blocks;
 	//It works because the fraction takes only integer part.
+	int offset, i;
+	
+	//Fast path: same window of the last call
+	if(disk->first_mapped_block == first_block){
+		disk->window_hits++;
+		offset = block_index - first_block;
+		return &(disk->block_map[offset*disk->block_size]);
+	}
+	
+	//Looking for the window among the mapped ones
+	int victim = -1;
+	for(i=0;i<DISK_WINDOWS;i++){
+		DiskWindow* w = &disk->windows[i];
+		if(w->map != NULL && w->first_block == first_block){
+			disk->window_hits++;
+			w->last_use = ++disk->window_clock;
+			disk->block_map = w->map;
+			disk->first_mapped_block = first_block;
+			
+			//Calculating relative block index into mmapped block portion
+			offset = block_index - first_block;
+			
+			//Moving to the first byte of that block and returning it
+			return &(w->map[offset*disk->block_size]); 
+		}
+		//Pinned windows can't be evicted (copies of other threads 
+		//are done once they see no pins)
+		if(__atomic_load_n(&w->pins, __ATOMIC_ACQUIRE) > 0) continue;
+		
+		//An unused slot always wins, otherwise the least recently used
+		if(victim == -1 || (disk->windows[victim].map != NULL 
+				&& (w->map == NULL 
+					|| w->last_use < disk->windows[victim].last_use)))
+			victim = i;
+	}
+	if(victim == -1){
+		printf("Every block window is pinned!\n");
+		return (char*)NULL;
+	}
+	
+	//Miss: replacing the victim window with the one containing "block_index"
+	disk->window_misses++;
+	DiskWindow* w = &disk->windows[victim];
+	if(w->map != NULL) //Avoids mem leaks
+		munmap(w->map-disk->map_shift, disk->window_size+disk->map_shift);
+	
+	//Mapping starts map_shift bytes early, at a page boundary
+	char* map = (char*)mmap(NULL, disk->window_size+disk->map_shift, 
+						PROT_READ|PROT_WRITE, MAP_SHARED, disk->fd, 
+				disk->first_block_offset - disk->map_shift
+				+ (off_t)(first_block/mapped_blocks)*disk->window_size);
+	if(map == MAP_FAILED){
+		printf("Error mapping block window!\n");
+		w->map = NULL;
+		disk->block_map = NULL;
+		disk->first_mapped_block = 0xFFFFFFFF;
+		return (char*)NULL;
+	}
+	
+	map += disk->map_shift;
+	w->map = map;
+	w->first_block = first_block;
+	w->last_use = ++disk->window_clock;
+	disk->block_map = map;
+	disk->first_mapped_block = first_block;
+	
+	offset = block_index - first_block;
+	return &(map[offset*disk->block_size]);
+}
+
+
+const void* DiskDriver_pinBlock(DiskDriver* disk, unsigned int block_num){
+	
+	if(block_num > disk->num_entries -1) return NULL; //Invalid block num
+	if(DiskDriver_bitmapGet(disk, block_num) == 0) return NULL; //Empty block
+	
+	//Latest image still in the journal (valid until the next write)
+	if(disk->journal != NULL && disk->journal->num_images > 0){
+		DiskDriver_lock(DISK_LOCK(disk, journal));
+		DiskJournalEntry* e = DiskDriver_journalFind(disk, block_num, 0);
+		char* image = (e != NULL && e->image >= 0) ? disk->journal->images 
+							+ (size_t)e->image*disk->block_size : NULL;
+		DiskDriver_unlock(DISK_LOCK(disk, journal));
+		if(image != NULL) return image;
+	}
+	if(disk->whole_map != NULL) return DiskDriver_getBlock(disk, block_num);
+	
+	pthread_mutex_t* lock = DISK_LOCK(disk, windows);
+	DiskDriver_lock(lock);
+	char* block = DiskDriver_getBlock(disk, block_num);
+	DiskWindow* w = (block != NULL) ? DiskDriver_windowOf(disk, block) : NULL;
+	if(w != NULL) w->pins++;
+	DiskDriver_unlock(lock);
+	return block;
+}
+
+
+void DiskDriver_unpinBlock(DiskDriver* disk, const void* block){
+	
+	const char* ptr = (const char*)block;
+	if(ptr == NULL || disk->whole_map != NULL) return; //Nothing to release
+	if(disk->journal != NULL && ptr >= disk->journal->images 
+			&& ptr < disk->journal->images 
+					+ (size_t)disk->journal->slots*disk->block_size) return;
+	
+	pthread_mutex_t* lock = DISK_LOCK(disk, windows);
+	DiskDriver_lock(lock);
+	DiskWindow* w = DiskDriver_windowOf(disk, ptr);
+	if(w != NULL && w->pins > 0) __atomic_fetch_sub(&w->pins, 1, __ATOMIC_RELEASE);
+	DiskDriver_unlock(lock);
+}
+
+
+void* DiskDriver_pinWrite(DiskDriver* disk, unsigned int block_num){
+	
+	if(block_num > disk->num_entries -1) return NULL; //Invalid block num
+	if(DiskDriver_journaled(disk, block_num)) return NULL;
+	
+	if(DiskDriver_bitmapGet(disk, block_num) == 0) 
+		DiskDriver_markFull(disk, block_num);
+	if(disk->whole_map != NULL) return DiskDriver_getBlock(disk, block_num);
+	
+	pthread_mutex_t* lock = DISK_LOCK(disk, windows);
+	DiskDriver_lock(lock);
+	char* block = DiskDriver_getBlock(disk, block_num);
+	DiskWindow* w = (block != NULL) ? DiskDriver_windowOf(disk, block) : NULL;
+	if(w != NULL) w->pins++;
+	DiskDriver_unlock(lock);
+	return block;
+}
+
+
+void DiskDriver_unpinWrite(DiskDriver* disk, void* block, 
+												unsigned int block_num){
+	
+	//Dirty only now: a flush in between would miss the new bytes
+	DiskDriver_dirtyBlocks(disk, block_num, 1);
+	DiskDriver_unpinBlock(disk, block);
+	__atomic_fetch_add(&disk->written, 1, __ATOMIC_RELAXED);
+	DiskDriver_syncTick(disk, 1);
+}
+
+
+DiskWindow* DiskDriver_windowOf(DiskDriver* disk, const char* ptr){
+	
+	int i;
+	for(i=0;i<DISK_WINDOWS;i++){
+		DiskWindow* w = &disk->windows[i];
+		if(w->map != NULL && ptr >= w->map && ptr < w->map+disk->window_size)
+			return w;
+	}
+	return NULL;
+}
+
+
+void DiskDriver_prefetch(DiskDriver* disk, unsigned int block_num, 
+												unsigned int count){
+	
+	if(block_num >= disk->num_entries || count == 0) return;
+	if(count > disk->num_entries - block_num) 
+		count = disk->num_entries - block_num;
+	__atomic_fetch_add(&disk->prefetched, count, __ATOMIC_RELAXED);
+	
+	off_t begin = (off_t)block_num*disk->block_size;
+	off_t len = (off_t)count*disk->block_size;
+	if(disk->whole_map != NULL){
+		//madvise() wants a page aligned address
+		off_t shift = (disk->map_shift + begin) % disk->page_size;
+		madvise(disk->whole_map + begin - shift, len + shift, MADV_WILLNEED);
+		return;
+	}
+	posix_fadvise(disk->fd, disk->first_block_offset + begin, len, 
+												POSIX_FADV_WILLNEED);
+}
+
+
+int DiskDriver_bitmapGet(DiskDriver* disk, unsigned int block_num){
+	if(block_num/DISK_CHUNK_BLOCKS >= __atomic_load_n(
+						&disk->header->init_chunks, __ATOMIC_ACQUIRE)) 
+		return 0; //Never initialized: empty
+	return (DiskDriver_word(disk, block_num/64) >> (block_num%64)) & 1;
+}
+
+
+uint64_t DiskDriver_word(DiskDriver* disk, unsigned int w){
+	return __atomic_load_n(&disk->bitmap[w], __ATOMIC_RELAXED);
+}
+
+
+void DiskDriver_bitmapSet(DiskDriver* disk, unsigned int block_num, int status){
+	if(block_num/DISK_CHUNK_BLOCKS >= __atomic_load_n(
+						&disk->header->init_chunks, __ATOMIC_ACQUIRE)) 
+		DiskDriver_initChunks(disk, block_num/DISK_CHUNK_BLOCKS);
+	
+	//(shared disks go through DiskDriver_markShared() instead)
+	uint64_t bit = 1ULL << (block_num%64);
+	uint64_t* word_ptr = &disk->bitmap[block_num/64];
+	if(status) *word_ptr |= bit;
+	else *word_ptr &= ~bit;
+	off_t word = DISK_HEADER_SIZE + (off_t)(block_num/64)*sizeof(uint64_t);
+	DiskDriver_dirty(disk, word, word + sizeof(uint64_t));
+}
+
+
+unsigned int DiskDriver_countFull(uint64_t* bitmap, unsigned int num_words){
+	
+	unsigned int i, res = 0;
+	for(i=0;i<num_words;i++) res += __builtin_popcountll(bitmap[i]);
+	return res;
+}
+
+
+int DiskDriver_migrate(int fd){
+	
+	int num_blocks;
+	if(pread(fd, &num_blocks, sizeof(int), 0) != sizeof(int) 
+												|| num_blocks <= 0){
+		printf("Not a disk!\n");
+		return -1;
+	}
+	
+	//Old layout: an int, a char per block, padding up to PAGE_SIZE
+	int bitmap_size = sizeof(int) + num_blocks*sizeof(char);
+	if(bitmap_size%PAGE_SIZE != 0) 
+		bitmap_size += PAGE_SIZE-(bitmap_size%PAGE_SIZE);
+	
+	char* old_map = (char*)mmap(NULL, bitmap_size, PROT_READ|PROT_WRITE, 
+												MAP_SHARED, fd, 0);
+	if(old_map == MAP_FAILED){
+		printf("Error mapping old bitmap\n");
+		return -1;
+	}
+	
+	//Packing the bitmap aside, the old one is still needed
+	unsigned int words = (num_blocks+63)/64;
+	uint64_t* bitmap = (uint64_t*)calloc(words, sizeof(uint64_t));
+	char* cursor = old_map + sizeof(int);
+	int i;
+	for(i=0;i<num_blocks;i++){
+		if(cursor[i] != 0 && cursor[i] != 1){ //Something went wrong
+			printf("The bitmap is damaged!\n");
+			free(bitmap);
+			munmap(old_map, bitmap_size);
+			return -1;
+		}
+		if(cursor[i] == 1) bitmap[i/64] |= 1ULL << (i%64);
+	}
+	if(num_blocks%64 != 0) bitmap[words-1] |= ~0ULL << (num_blocks%64);
+	
+	//New header and bitmap always fit in the old area: 
+	//keeping first_block_offset, blocks don't have to move
+	DiskHeader header;
+	memset(&header, 0, sizeof(DiskHeader));
+	header.magic = DISK_MAGIC;
+	header.num_blocks = num_blocks;
+	header.first_block_offset = bitmap_size;
+	header.version = DISK_VERSION;
+	header.block_size = DISK_LEGACY_BLOCK_SIZE;
+	header.page_size = PAGE_SIZE;
+	//Every chunk is in the bitmap just packed: none is left to lazy init
+	header.init_chunks = (words+DISK_CHUNK_WORDS-1)/DISK_CHUNK_WORDS;
+	header.free_blocks = words*64 - DiskDriver_countFull(bitmap, words);
+	
+	memset(old_map, 0, bitmap_size);
+	memcpy(old_map + DISK_HEADER_SIZE, bitmap, words*sizeof(uint64_t));
+	memcpy(old_map, &header, sizeof(DiskHeader));
+	msync(old_map, bitmap_size, MS_SYNC);
 	
-	return DiskDriver_getBlock(disk, block_index);
+	free(bitmap);
+	munmap(old_map, bitmap_size);
+	return 0;
+}
+
+
+int DiskDriver_markFull(DiskDriver* disk, unsigned int block_num){
+	
+	if(disk->locks != NULL) return DiskDriver_markShared(disk, block_num, 1);
+	unsigned int chunk = block_num/DISK_CHUNK_BLOCKS;
+	DiskDriver_bitmapSet(disk, block_num, 1);
+	disk->free_blocks--;
+	if(disk->chunk_free[chunk] == DISK_CHUNK_UNKNOWN) return 1; //Counted later
+	disk->chunk_free[chunk]--;
+	if(disk->chunk_free[chunk] == 0) //Chunk is now full
+		DiskDriver_summarySet(disk, chunk, 0);
+	return 1;
+}
+
+
+int DiskDriver_markEmpty(DiskDriver* disk, unsigned int block_num){
+	
+	if(disk->locks != NULL) return DiskDriver_markShared(disk, block_num, 0);
+	unsigned int chunk = block_num/DISK_CHUNK_BLOCKS;
+	DiskDriver_bitmapSet(disk, block_num, 0);
+	disk->free_blocks++;
+	DiskDriver_summarySet(disk, chunk, 1);
+	if(disk->chunk_free[chunk] == DISK_CHUNK_UNKNOWN) return 1; //Counted later
+	disk->chunk_free[chunk]++;
+	return 1;
+}
+
+
+int DiskDriver_markShared(DiskDriver* disk, unsigned int block_num, 
+															int status){
+	
+	unsigned int chunk = block_num/DISK_CHUNK_BLOCKS;
+	if(chunk >= __atomic_load_n(&disk->header->init_chunks, __ATOMIC_ACQUIRE)) 
+		DiskDriver_initChunks(disk, chunk);
+	
+	//The bit decides: only the thread that flips it goes on
+	uint64_t bit = 1ULL << (block_num%64);
+	uint64_t* word = &disk->bitmap[block_num/64];
+	uint64_t old = status ? __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST) 
+						: __atomic_fetch_and(word, ~bit, __ATOMIC_SEQ_CST);
+	if(((old & bit) != 0) == status) return 0; //Another thread was faster
+	off_t offset = DISK_HEADER_SIZE + (off_t)(block_num/64)*sizeof(uint64_t);
+	DiskDriver_dirty(disk, offset, offset + sizeof(uint64_t));
+	
+	//Counters: every chunk was counted at mount (no DISK_CHUNK_UNKNOWN). 
+	//A chunk filled while a block of it is freed gets its summary bit back
+	unsigned int* count = &disk->chunk_free[chunk];
+	if(!status){
+		if(__atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST) == 1)
+			DiskDriver_summarySet(disk, chunk, 1);
+	}
+	else if(__atomic_sub_fetch(count, 1, __ATOMIC_SEQ_CST) == 0){
+		DiskDriver_summarySet(disk, chunk, 0);
+		if(__atomic_load_n(count, __ATOMIC_SEQ_CST) != 0) 
+			DiskDriver_summarySet(disk, chunk, 1);
+	}
+	return 1;
+}
+
+
+void DiskDriver_summarySet(DiskDriver* disk, unsigned int chunk, int status){
+	
+	//A summary word holds the bits of 64 chunks. Ordered with chunk_free,
+	//see DiskDriver_markShared()
+	uint64_t bit = 1ULL << (chunk%64);
+	if(disk->locks != NULL){
+		if(status) __atomic_fetch_or(&disk->summary[chunk/64], bit, 
+														__ATOMIC_SEQ_CST);
+		else __atomic_fetch_and(&disk->summary[chunk/64], ~bit, 
+														__ATOMIC_SEQ_CST);
+	}
+	else if(status) disk->summary[chunk/64] |= bit;
+	else disk->summary[chunk/64] &= ~bit;
+}
+
+
+void DiskDriver_buildSummary(DiskDriver* disk){
+	
+	unsigned int i, words;
+	disk->num_chunks = (disk->bitmap_words+DISK_CHUNK_WORDS-1)/DISK_CHUNK_WORDS;
+	disk->chunk_free = (unsigned int*)malloc(disk->num_chunks*sizeof(int));
+	disk->summary = (uint64_t*)calloc((disk->num_chunks+63)/64, 
+														sizeof(uint64_t));
+	disk->free_blocks = 0;
+	
+	//Padding bits are full, so they are not counted as free
+	for(i=0;i<disk->num_chunks;i++){
+		words = disk->bitmap_words - i*DISK_CHUNK_WORDS;
+		if(words > DISK_CHUNK_WORDS) words = DISK_CHUNK_WORDS;
+		if(i >= disk->header->init_chunks) 
+			disk->chunk_free[i] = DiskDriver_chunkBlocks(disk, i);
+		else disk->chunk_free[i] = words*64 - DiskDriver_countFull(
+						disk->bitmap+i*DISK_CHUNK_WORDS, words);
+		if(disk->chunk_free[i] != 0) 
+			disk->summary[i/64] |= 1ULL << (i%64);
+		disk->free_blocks += disk->chunk_free[i];
+	}
 }
 
+
+void DiskDriver_lazySummary(DiskDriver* disk){
+	
+	unsigned int i;
+	disk->num_chunks = (disk->bitmap_words+DISK_CHUNK_WORDS-1)/DISK_CHUNK_WORDS;
+	disk->chunk_free = (unsigned int*)malloc(disk->num_chunks*sizeof(int));
+	disk->summary = (uint64_t*)calloc((disk->num_chunks+63)/64, 
+														sizeof(uint64_t));
+	disk->free_blocks = disk->header->free_blocks;
+	
+	//Every chunk may have empty blocks, until it is counted
+	for(i=0;i<disk->num_chunks;i++){
+		disk->chunk_free[i] = DISK_CHUNK_UNKNOWN;
+		disk->summary[i/64] |= 1ULL << (i%64);
+	}
+}
+
+
+unsigned int DiskDriver_chunkFree(DiskDriver* disk, unsigned int chunk){
+	
+	//Shared disks count every chunk at mount, so they never get past this
+	unsigned int res = __atomic_load_n(&disk->chunk_free[chunk], 
+														__ATOMIC_RELAXED);
+	if(res != DISK_CHUNK_UNKNOWN) return res;
+	if(chunk >= disk->header->init_chunks) //Never initialized: all empty
+		return disk->chunk_free[chunk] = DiskDriver_chunkBlocks(disk, chunk);
+	
+	unsigned int words = disk->bitmap_words - chunk*DISK_CHUNK_WORDS;
+	if(words > DISK_CHUNK_WORDS) words = DISK_CHUNK_WORDS;
+	disk->chunk_free[chunk] = words*64 - DiskDriver_countFull(
+							disk->bitmap+chunk*DISK_CHUNK_WORDS, words);
+	if(disk->chunk_free[chunk] == 0) DiskDriver_summarySet(disk, chunk, 0);
+	return disk->chunk_free[chunk];
+}
+
+
+void DiskDriver_markMounted(DiskDriver* disk){
+	
+	//Written through at once: a crash from now on is seen at next resume
+	disk->header->version = DISK_VERSION;
+	disk->header->clean = 0;
+	disk->header->generation++;
+	msync(disk->disk_map, DISK_HEADER_SIZE, MS_SYNC);
+}
+
+
+void DiskDriver_initChunks(DiskDriver* disk, unsigned int chunk){
+	
+	pthread_mutex_t* lock = DISK_LOCK(disk, chunks);
+	DiskDriver_lock(lock);
+	unsigned int first = disk->header->init_chunks;
+	if(chunk < first){ //Another thread did it
+		DiskDriver_unlock(lock);
+		return;
+	}
+	
+	//Zeroing the chunks, padding bits of the last word are full
+	unsigned int first_word = first*DISK_CHUNK_WORDS;
+	unsigned int end_word = (chunk+1)*DISK_CHUNK_WORDS;
+	if(end_word > disk->bitmap_words) end_word = disk->bitmap_words;
+	memset(disk->bitmap+first_word, 0, (end_word-first_word)*sizeof(uint64_t));
+	if(end_word == disk->bitmap_words && disk->num_entries%64 != 0) 
+		disk->bitmap[end_word-1] = ~0ULL << (disk->num_entries%64);
+	
+	//Zeroes reach the disk before the header says they are there:
+	//a chunk initialized twice would lose its full blocks
+	size_t page_size = DiskDriver_pageSize();
+	size_t begin = DISK_HEADER_SIZE + first_word*sizeof(uint64_t);
+	size_t end = DISK_HEADER_SIZE + end_word*sizeof(uint64_t);
+	begin -= begin%page_size;
+	msync(disk->disk_map+begin, end-begin, MS_SYNC);
+	
+	__atomic_store_n(&disk->header->init_chunks, chunk+1, __ATOMIC_RELEASE);
+	msync(disk->disk_map, DISK_HEADER_SIZE, MS_SYNC);
+	DiskDriver_unlock(lock);
+}
+
+
+unsigned int DiskDriver_chunkBlocks(DiskDriver* disk, unsigned int chunk){
+	
+	unsigned int blocks = disk->num_entries - chunk*DISK_CHUNK_BLOCKS;
+	return (blocks > DISK_CHUNK_BLOCKS) ? DISK_CHUNK_BLOCKS : blocks;
+}
+
+
+void DiskDriver_freeSummary(DiskDriver* disk){
+	
+	free(disk->chunk_free);
+	free(disk->summary);
+	disk->chunk_free = NULL;
+	disk->summary = NULL;
+}
+
+
+int DiskDriver_nextChunk(DiskDriver* disk, unsigned int chunk){
+	
+	if(chunk >= disk->num_chunks) return -1;
+	
+	unsigned int w = chunk/64;
+	uint64_t candidates = __atomic_load_n(&disk->summary[w], __ATOMIC_RELAXED) 
+													& (~0ULL << (chunk%64));
+	while(1){
+		if(candidates != 0) return w*64 + __builtin_ctzll(candidates);
+		w++;
+		if(w >= (disk->num_chunks+63)/64) return -1;
+		candidates = __atomic_load_n(&disk->summary[w], __ATOMIC_RELAXED);
+	}
+}
+
+
+void DiskDriver_resetWindows(DiskDriver* disk){
+	
+	int i;
+	for(i=0;i<DISK_WINDOWS;i++){
+		disk->windows[i].map = NULL; //These will be mapped upon use
+		disk->windows[i].first_block = 0xFFFFFFFF;
+		disk->windows[i].last_use = 0;
+		disk->windows[i].pins = 0;
+	}
+	disk->block_map = NULL;
+	disk->first_mapped_block = 0xFFFFFFFF; //Int doesn't support null value in C
+	disk->window_clock = 0;
+	disk->window_hits = 0;
+	disk->window_misses = 0;
+	disk->prefetched = 0;
+}
+
+
+void DiskDriver_unmapWindows(DiskDriver* disk){
+	
+	int i;
+	for(i=0;i<DISK_WINDOWS;i++){
+		if(disk->windows[i].map != NULL)
+			munmap(disk->windows[i].map-disk->map_shift, 
+								disk->window_size+disk->map_shift);
+	}
+	DiskDriver_resetWindows(disk);
+}
+
+
+void DiskDriver_mapWhole(DiskDriver* disk, int mode){
+	
+	disk->mode = mode;
+	disk->whole_map = NULL;
+	disk->whole_map_size = 0;
+	if(mode & (DISK_PIO|DISK_ASYNC)) disk->mode &= ~DISK_WHOLE_MAP;
+	if(!(disk->mode & DISK_WHOLE_MAP)) return;
+	
+	//Bigger disks are left to windows (and 32-bit address space)
+	unsigned long long size = (unsigned long long)disk->num_entries
+														*disk->block_size;
+	if(size > DISK_WHOLE_MAP_LIMIT || size > (size_t)-1){
+		printf("Disk too big to be mapped as a whole, using windows\n");
+		disk->mode &= ~DISK_WHOLE_MAP;
+		return;
+	}
+	
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if(mode & DISK_POPULATE) flags |= MAP_POPULATE;
+#endif
+	size += disk->map_shift; //Mapping from a page boundary
+	char* map = (char*)mmap(NULL, size, PROT_READ|PROT_WRITE, flags, 
+					disk->fd, disk->first_block_offset-disk->map_shift);
+	if(map == MAP_FAILED){
+		printf("Error mapping the whole disk, using windows\n");
+		disk->mode &= ~DISK_WHOLE_MAP;
+		return;
+	}
+	
+	//Hints are only hints: a failure here is not an error
+	if(mode & DISK_SEQUENTIAL) madvise(map, size, MADV_SEQUENTIAL);
+	if(mode & DISK_RANDOM) madvise(map, size, MADV_RANDOM);
+	
+	disk->whole_map = map + disk->map_shift;
+	disk->whole_map_size = size;
+}
+
+
+unsigned int DiskDriver_pageSize(void){
+	
+	long res = sysconf(_SC_PAGESIZE);
+	return (res > 0) ? (unsigned int)res : PAGE_SIZE;
+}
+
+
+void DiskDriver_setGeometry(DiskDriver* disk, DiskHeader* header){
+	
+	unsigned int page_size = DiskDriver_pageSize();
+	disk->block_size = header->block_size;
+	disk->page_size = page_size;
+	
+	//A window holds at least a block, and starts on a page boundary
+	disk->window_size = DISK_WINDOW_SIZE;
+	if(disk->window_size < disk->block_size) 
+		disk->window_size = disk->block_size;
+	if(disk->window_size < page_size) disk->window_size = page_size;
+	
+	//Disks made on hosts with smaller pages: block 0 is not page aligned
+	disk->map_shift = header->first_block_offset % page_size;
+}
+
+
+void DiskDriver_selectBackend(DiskDriver* disk){
+	
+	disk->async = NULL;
+	if(disk->mode & DISK_ASYNC){
+		if(DiskDriver_asyncInit(disk) == 0){
+			if(disk->async->ring_fd != -1) disk->backend = &RING_BACKEND;
+			else disk->backend = &POOL_BACKEND;
+			return;
+		}
+		printf("Queued I/O not available, using pread/pwrite\n");
+		disk->mode = (disk->mode & ~DISK_ASYNC) | DISK_PIO;
+	}
+	
+	if(disk->mode & DISK_PIO) disk->backend = &PIO_BACKEND;
+	else if(disk->whole_map != NULL) disk->backend = &WHOLE_MAP_BACKEND;
+	else disk->backend = &WINDOW_BACKEND;
+}
+
+
+int DiskDriver_windowRead(DiskDriver* disk, void* dest, unsigned int block_num){
+	
+	if(disk->locks != NULL) 
+		return DiskDriver_windowShared(disk, dest, NULL, block_num);
+	char* src = DiskDriver_getBlock(disk, block_num);
+	//printf("DBG src pointer: %p\n", src);
+	if(src==NULL){
+		printf("Can't read from invalid address\n");
+		return -1;
+	}
+	memcpy(dest, src, disk->block_size);
+	return 0;
+}
+
+
+int DiskDriver_windowWrite(DiskDriver* disk, const void* src, 
+												unsigned int block_num){
+	
+	if(disk->locks != NULL) 
+		return DiskDriver_windowShared(disk, NULL, src, block_num);
+	char* res = DiskDriver_getBlock(disk, block_num);
+	if(res==NULL) return -1;
+	memcpy(res, src, disk->block_size);
+	return 0;
+}
+
+
+int DiskDriver_windowShared(DiskDriver* disk, void* dest, const void* src, 
+												unsigned int block_num){
+	
+	//The window is found (or mapped) and pinned under the lock...
+	pthread_mutex_lock(&disk->locks->windows);
+	char* block = DiskDriver_getBlock(disk, block_num);
+	DiskWindow* w = (block != NULL) ? DiskDriver_windowOf(disk, block) : NULL;
+	if(w != NULL) w->pins++;
+	pthread_mutex_unlock(&disk->locks->windows);
+	if(w == NULL){
+		printf("Can't reach block %u\n", block_num);
+		return -1;
+	}
+	
+	//...but copied without it: other threads only wait for the lookup
+	if(dest != NULL) memcpy(dest, block, disk->block_size);
+	else memcpy(block, src, disk->block_size);
+	__atomic_fetch_sub(&w->pins, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+int DiskDriver_wholeRead(DiskDriver* disk, void* dest, unsigned int block_num){
+	
+	memcpy(dest, disk->whole_map+(size_t)block_num*disk->block_size, 
+														disk->block_size);
+	return 0;
+}
+
+
+int DiskDriver_wholeWrite(DiskDriver* disk, const void* src, 
+												unsigned int block_num){
+	
+	memcpy(disk->whole_map+(size_t)block_num*disk->block_size, src, 
+														disk->block_size);
+	return 0;
+}
+
+
+int DiskDriver_pioRead(DiskDriver* disk, void* dest, unsigned int block_num){
+	
+	off_t offset = disk->first_block_offset + (off_t)block_num*disk->block_size;
+	if(pread(disk->fd, dest, disk->block_size, offset) 
+										!= (ssize_t)disk->block_size){
+		printf("Error reading block %u\n", block_num);
+		return -1;
+	}
+	return 0;
+}
+
+
+int DiskDriver_pioWrite(DiskDriver* disk, const void* src, 
+												unsigned int block_num){
+	
+	off_t offset = disk->first_block_offset + (off_t)block_num*disk->block_size;
+	if(pwrite(disk->fd, src, disk->block_size, offset) 
+										!= (ssize_t)disk->block_size){
+		printf("Error writing block %u\n", block_num);
+		return -1;
+	}
+	return 0;
+}
+
+
+int DiskDriver_compareVec(const void* a, const void* b){
+	
+	unsigned int x = ((DiskIOVec*)a)->block_num;
+	unsigned int y = ((DiskIOVec*)b)->block_num;
+	return (x > y) - (x < y);
+}
+
+
+DiskIOVec* DiskDriver_makeVec(void** bufs, unsigned int* block_nums, 
+														int count){
+	
+	DiskIOVec* vec = (DiskIOVec*)malloc(count*sizeof(DiskIOVec));
+	int i;
+	for(i=0;i<count;i++){
+		vec[i].block_num = block_nums[i];
+		vec[i].buf = bufs[i];
+	}
+	qsort(vec, count, sizeof(DiskIOVec), DiskDriver_compareVec);
+	return vec;
+}
+
+
+int DiskDriver_mapReadBlocks(DiskDriver* disk, DiskIOVec* vec, int count){
+	return DiskDriver_mapBlocks(disk, vec, count, 0);
+}
+
+
+int DiskDriver_mapWriteBlocks(DiskDriver* disk, DiskIOVec* vec, int count){
+	return DiskDriver_mapBlocks(disk, vec, count, 1);
+}
+
+
+int DiskDriver_mapBlocks(DiskDriver* disk, DiskIOVec* vec, int count, 
+														int is_write){
+	
+	//Sorted blocks: the window of the first one is looked for (and pinned)
+	//once, then every next block in it is copied from the same mapping
+	pthread_mutex_t* lock = DISK_LOCK(disk, windows);
+	int i = 0, n;
+	while(i < count){
+		DiskDriver_lock(lock);
+		char* base = DiskDriver_getBlock(disk, vec[i].block_num);
+		DiskWindow* w = (base != NULL && disk->whole_map == NULL) ? 
+									DiskDriver_windowOf(disk, base) : NULL;
+		if(w != NULL) w->pins++;
+		DiskDriver_unlock(lock);
+		if(base == NULL){
+			printf("Can't reach block %u\n", vec[i].block_num);
+			return -1;
+		}
+		
+		//The whole block area is a single window
+		unsigned int first = vec[i].block_num, end = (w != NULL) ? 
+			w->first_block + disk->window_size/disk->block_size : disk->num_entries;
+		for(n=0;i+n < count && vec[i+n].block_num < end;n++){
+			char* block = base + (size_t)(vec[i+n].block_num-first)*disk->block_size;
+			if(is_write) memcpy(block, vec[i+n].buf, disk->block_size);
+			else memcpy(vec[i+n].buf, block, disk->block_size);
+		}
+		if(w != NULL) __atomic_fetch_sub(&w->pins, 1, __ATOMIC_RELEASE);
+		i += n;
+	}
+	return 0;
+}
+
+
+int DiskDriver_pioReadBlocks(DiskDriver* disk, DiskIOVec* vec, int count){
+	
+	//A single preadv() for every run of adjacent blocks
+	struct iovec iov[IOV_MAX];
+	int i = 0, n;
+	while(i < count){
+		n = 0;
+		do{
+			iov[n].iov_base = vec[i+n].buf;
+			iov[n].iov_len = disk->block_size;
+			n++;
+		} while(i+n < count && n < IOV_MAX 
+						&& vec[i+n].block_num == vec[i].block_num+n);
+		
+		off_t offset = disk->first_block_offset 
+								+ (off_t)vec[i].block_num*disk->block_size;
+		if(preadv(disk->fd, iov, n, offset) != (ssize_t)n*disk->block_size){
+			printf("Error reading blocks from %u\n", vec[i].block_num);
+			return -1;
+		}
+		i += n;
+	}
+	return 0;
+}
+
+
+int DiskDriver_pioWriteBlocks(DiskDriver* disk, DiskIOVec* vec, int count){
+	
+	//A single pwritev() for every run of adjacent blocks
+	struct iovec iov[IOV_MAX];
+	int i = 0, n;
+	while(i < count){
+		n = 0;
+		do{
+			iov[n].iov_base = vec[i+n].buf;
+			iov[n].iov_len = disk->block_size;
+			n++;
+		} while(i+n < count && n < IOV_MAX 
+						&& vec[i+n].block_num == vec[i].block_num+n);
+		
+		off_t offset = disk->first_block_offset 
+								+ (off_t)vec[i].block_num*disk->block_size;
+		if(pwritev(disk->fd, iov, n, offset) != (ssize_t)n*disk->block_size){
+			printf("Error writing blocks from %u\n", vec[i].block_num);
+			return -1;
+		}
+		i += n;
+	}
+	return 0;
+}
+
+
+int DiskDriver_asyncBlocks(DiskDriver* disk, DiskIOVec* vec, int count, 
+														int is_write){
+	
+	//Splitting sorted blocks in runs, a request for each of them
+	struct iovec* iov = (struct iovec*)malloc(count*sizeof(struct iovec));
+	DiskRun* runs = (DiskRun*)malloc(count*sizeof(DiskRun));
+	int i, num_runs = 0, res;
+	for(i=0;i<count;i++){
+		iov[i].iov_base = vec[i].buf;
+		iov[i].iov_len = disk->block_size;
+		if(num_runs > 0 && runs[num_runs-1].len < IOV_MAX 
+			&& vec[i].block_num == runs[num_runs-1].block_num 
+												+ runs[num_runs-1].len){
+			runs[num_runs-1].len++;
+			continue;
+		}
+		runs[num_runs].block_num = vec[i].block_num;
+		runs[num_runs].iov = &iov[i];
+		runs[num_runs].len = 1;
+		num_runs++;
+	}
+	
+	if(disk->async->ring_fd != -1) 
+		res = DiskDriver_ringSubmit(disk->async, runs, num_runs, is_write);
+	else res = DiskDriver_poolSubmit(disk->async, runs, num_runs, is_write);
+	if(res != 0) printf("Error %s queued blocks\n", 
+								is_write ? "writing" : "reading");
+	
+	free(runs);
+	free(iov);
+	return res;
+}
+
+
+int DiskDriver_asyncReadBlocks(DiskDriver* disk, DiskIOVec* vec, int count){
+	
+	//A single batch at a time in the queue
+	DiskDriver_lock(DISK_LOCK(disk, queue));
+	int res = DiskDriver_asyncBlocks(disk, vec, count, 0);
+	DiskDriver_unlock(DISK_LOCK(disk, queue));
+	return res;
+}
+
+
+int DiskDriver_asyncWriteBlocks(DiskDriver* disk, DiskIOVec* vec, int count){
+	
+	DiskDriver_lock(DISK_LOCK(disk, queue));
+	int res = DiskDriver_asyncBlocks(disk, vec, count, 1);
+	DiskDriver_unlock(DISK_LOCK(disk, queue));
+	return res;
+}
+
+
+int DiskDriver_asyncInit(DiskDriver* disk){
+	
+	DiskAsync* async = (DiskAsync*)calloc(1, sizeof(DiskAsync));
+	async->fd = disk->fd;
+	async->first_block_offset = disk->first_block_offset;
+	async->block_size = disk->block_size;
+	async->ring_fd = -1;
+	
+#ifdef DISK_HAVE_URING
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = -1;
+	if(!(disk->mode & DISK_THREADS)) 
+		fd = syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &params);
+	
+	if(fd >= 0){
+		//Mapping the two rings and the submission entries
+		async->sq_ring_size = params.sq_off.array 
+								+ params.sq_entries*sizeof(unsigned int);
+		async->cq_ring_size = params.cq_off.cqes 
+						+ params.cq_entries*sizeof(struct io_uring_cqe);
+		async->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+		
+		async->sq_ring = (char*)mmap(NULL, async->sq_ring_size, 
+				PROT_READ|PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+		async->cq_ring = (char*)mmap(NULL, async->cq_ring_size, 
+				PROT_READ|PROT_WRITE, MAP_SHARED, fd, IORING_OFF_CQ_RING);
+		async->sqes = mmap(NULL, async->sqes_size, 
+				PROT_READ|PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+		
+		if(async->sq_ring != MAP_FAILED && async->cq_ring != MAP_FAILED 
+										&& async->sqes != MAP_FAILED){
+			async->ring_fd = fd;
+			async->depth = params.sq_entries;
+			async->sq_head = (unsigned int*)(async->sq_ring+params.sq_off.head);
+			async->sq_tail = (unsigned int*)(async->sq_ring+params.sq_off.tail);
+			async->sq_mask = (unsigned int*)(async->sq_ring
+											+params.sq_off.ring_mask);
+			async->sq_array = (unsigned int*)(async->sq_ring
+											+params.sq_off.array);
+			async->cq_head = (unsigned int*)(async->cq_ring+params.cq_off.head);
+			async->cq_tail = (unsigned int*)(async->cq_ring+params.cq_off.tail);
+			async->cq_mask = (unsigned int*)(async->cq_ring
+											+params.cq_off.ring_mask);
+			async->cqes = async->cq_ring + params.cq_off.cqes;
+			disk->async = async;
+			return 0;
+		}
+		
+		//Something was not mapped, the pool will do
+		if(async->sq_ring != MAP_FAILED) 
+			munmap(async->sq_ring, async->sq_ring_size);
+		if(async->cq_ring != MAP_FAILED) 
+			munmap(async->cq_ring, async->cq_ring_size);
+		if(async->sqes != MAP_FAILED) munmap(async->sqes, async->sqes_size);
+		close(fd);
+	}
+#endif
+	
+	//No io_uring: starting the thread pool
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->work, NULL);
+	pthread_cond_init(&async->done, NULL);
+	int i;
+	for(i=0;i<DISK_IO_THREADS;i++){
+		if(pthread_create(&async->threads[i], NULL, 
+									DiskDriver_poolWorker, async) != 0) 
+			break;
+		async->num_threads++;
+	}
+	disk->async = async;
+	if(async->num_threads == 0){
+		DiskDriver_asyncClose(disk);
+		return -1;
+	}
+	return 0;
+}
+
+
+void DiskDriver_asyncClose(DiskDriver* disk){
+	
+	DiskAsync* async = disk->async;
+	if(async == NULL) return;
+	
+#ifdef DISK_HAVE_URING
+	if(async->ring_fd != -1){
+		munmap(async->sqes, async->sqes_size);
+		munmap(async->cq_ring, async->cq_ring_size);
+		munmap(async->sq_ring, async->sq_ring_size);
+		close(async->ring_fd);
+	}
+	else
+#endif
+	{
+		//Waking every thread up to let it go
+		pthread_mutex_lock(&async->lock);
+		async->stop = 1;
+		pthread_cond_broadcast(&async->work);
+		pthread_mutex_unlock(&async->lock);
+		
+		int i;
+		for(i=0;i<async->num_threads;i++) 
+			pthread_join(async->threads[i], NULL);
+		pthread_cond_destroy(&async->done);
+		pthread_cond_destroy(&async->work);
+		pthread_mutex_destroy(&async->lock);
+	}
+	
+	free(async);
+	disk->async = NULL;
+}
+
+
+int DiskDriver_ringSubmit(DiskAsync* async, DiskRun* runs, int count, 
+														int is_write){
+#ifdef DISK_HAVE_URING
+	struct io_uring_sqe* sqes = (struct io_uring_sqe*)async->sqes;
+	struct io_uring_cqe* cqes = (struct io_uring_cqe*)async->cqes;
+	int queued = 0, completed = 0, error = 0;
+	unsigned int tail, head, index, pending = 0; //Queued, not taken yet
+	
+	while(completed < count){
+		
+		//Filling the submission queue, up to depth requests in flight
+		tail = *async->sq_tail;
+		while(queued < count && queued-completed < async->depth){
+			index = tail & *async->sq_mask;
+			struct io_uring_sqe* sqe = &sqes[index];
+			memset(sqe, 0, sizeof(struct io_uring_sqe));
+			sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = async->fd;
+			sqe->off = async->first_block_offset 
+					+ (off_t)runs[queued].block_num*async->block_size;
+			sqe->addr = (unsigned long)runs[queued].iov;
+			sqe->len = runs[queued].len;
+			sqe->user_data = queued;
+			async->sq_array[index] = index;
+			tail++;
+			queued++;
+			pending++;
+		}
+		__atomic_store_n(async->sq_tail, tail, __ATOMIC_RELEASE);
+		
+		//Submitting them and waiting for at least a completion. The kernel
+		//may take fewer than pending: the rest stays in the ring, and goes
+		//with the next call
+		int res;
+		do{
+			res = syscall(__NR_io_uring_enter, async->ring_fd, pending, 
+								1, IORING_ENTER_GETEVENTS, NULL, 0);
+		} while(res < 0 && errno == EINTR);
+		if(res < 0 && (errno == EAGAIN || errno == EBUSY) 
+							&& queued-(int)pending > completed){
+			//No room for them now: waiting for the ones in flight first
+			do{
+				res = syscall(__NR_io_uring_enter, async->ring_fd, 0, 
+								1, IORING_ENTER_GETEVENTS, NULL, 0);
+			} while(res < 0 && errno == EINTR);
+		}
+		if(res < 0){
+			printf("io_uring error: %s\n", strerror(errno));
+			return -1;
+		}
+		pending -= ((unsigned int)res < pending) ? (unsigned int)res : pending;
+		
+		//Reaping every completion ready
+		head = *async->cq_head;
+		while(head != __atomic_load_n(async->cq_tail, __ATOMIC_ACQUIRE)){
+			struct io_uring_cqe* cqe = &cqes[head & *async->cq_mask];
+			if(cqe->res != runs[cqe->user_data].len*(int)async->block_size) 
+				error = 1;
+			head++;
+			completed++;
+		}
+		__atomic_store_n(async->cq_head, head, __ATOMIC_RELEASE);
+	}
+	
+	return error ? -1 : 0;
+#else
+	return -1; //Never used: the ring is never set up
+#endif
+}
+
+
+int DiskDriver_poolSubmit(DiskAsync* async, DiskRun* runs, int count, 
+														int is_write){
+	
+	//Posting the batch, then waiting for the last run to be done
+	pthread_mutex_lock(&async->lock);
+	async->runs = runs;
+	async->num_runs = count;
+	async->next_run = 0;
+	async->finished = 0;
+	async->error = 0;
+	async->is_write = is_write;
+	pthread_cond_broadcast(&async->work);
+	while(async->finished < count) 
+		pthread_cond_wait(&async->done, &async->lock);
+	int error = async->error;
+	async->num_runs = 0;
+	pthread_mutex_unlock(&async->lock);
+	
+	return error ? -1 : 0;
+}
+
+
+void* DiskDriver_poolWorker(void* arg){
+	
+	DiskAsync* async = (DiskAsync*)arg;
+	ssize_t res;
+	
+	pthread_mutex_lock(&async->lock);
+	while(1){
+		while(!async->stop && async->next_run >= async->num_runs) 
+			pthread_cond_wait(&async->work, &async->lock);
+		if(async->stop) break;
+		
+		//Taking the next run of the batch
+		DiskRun run = async->runs[async->next_run++];
+		int is_write = async->is_write;
+		pthread_mutex_unlock(&async->lock);
+		
+		off_t offset = async->first_block_offset 
+								+ (off_t)run.block_num*async->block_size;
+		if(is_write) res = pwritev(async->fd, run.iov, run.len, offset);
+		else res = preadv(async->fd, run.iov, run.len, offset);
+		
+		pthread_mutex_lock(&async->lock);
+		if(res != (ssize_t)run.len*async->block_size) async->error = 1;
+		async->finished++;
+		if(async->finished == async->num_runs) 
+			pthread_cond_signal(&async->done);
+	}
+	pthread_mutex_unlock(&async->lock);
+	
+	return NULL;
+}
+
+
+void DiskDriver_begin(DiskDriver* disk){
+	if(disk->journal == NULL) return;
+	DiskDriver_lock(DISK_LOCK(disk, journal));
+	disk->journal->depth++;
+	DiskDriver_unlock(DISK_LOCK(disk, journal));
+}
+
+
+void DiskDriver_end(DiskDriver* disk){
+	
+	DiskJournal* j = disk->journal;
+	if(j == NULL) return;
+	DiskDriver_lock(DISK_LOCK(disk, journal));
+	
+	//The outer operation is over: operations are committed in groups, 
+	//sharing a single flush, but a group doesn't wait for long
+	if(j->depth > 0 && --j->depth == 0){
+		unsigned long now = DiskDriver_msec();
+		if(j->ops++ == 0){ //The committer times the new group
+			j->started = now;
+			if(j->committer_on) pthread_cond_signal(&j->wake);
+		}
+		if(j->ops >= DISK_JOURNAL_GROUP 
+				|| now - j->started >= DiskDriver_journalDelay(disk)) 
+			DiskDriver_commitGroup(disk); //The lock is already held
+	}
+	DiskDriver_unlock(DISK_LOCK(disk, journal));
+}
+
+
+int DiskDriver_commit(DiskDriver* disk){
+	
+	if(disk->journal == NULL) return 0;
+	DiskDriver_lock(DISK_LOCK(disk, journal));
+	int res = DiskDriver_commitGroup(disk);
+	DiskDriver_unlock(DISK_LOCK(disk, journal));
+	return res;
+}
+
+
+unsigned long DiskDriver_journalDelay(DiskDriver* disk){
+	return (disk->sync_policy == DISK_SYNC_TIME) ? disk->sync_interval 
+												: DISK_JOURNAL_DELAY;
+}
+
+
+void* DiskDriver_committer(void* arg){
+	
+	DiskDriver* disk = (DiskDriver*)arg;
+	DiskJournal* j = disk->journal;
+	pthread_mutex_t* lock = &disk->locks->journal;
+	pthread_mutex_lock(lock);
+	while(j->committer_on){
+		unsigned long delay = DiskDriver_journalDelay(disk);
+		unsigned long now = DiskDriver_msec(), wait = delay;
+		int due = j->ops > 0 && now - j->started >= delay;
+		if(due && j->depth == 0){
+			DiskDriver_commitGroup(disk);
+			continue;
+		}
+		
+		//Until the group gets old, else a whole delay (or a new group)
+		if(j->ops > 0 && !due) wait = j->started + delay - now;
+		if(wait == 0) wait = 1;
+		struct timespec t;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		t.tv_sec += wait/1000;
+		t.tv_nsec += (wait%1000)*1000000;
+		if(t.tv_nsec >= 1000000000){
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&j->wake, lock, &t);
+	}
+	pthread_mutex_unlock(lock);
+	return NULL;
+}
+
+
+int DiskDriver_commitGroup(DiskDriver* disk){
+	
+	DiskJournal* j = disk->journal;
+	j->ops = 0;
+	if(j->num_entries == 0) return 0;
+	
+	unsigned int block_size = disk->block_size;
+	unsigned int per_desc = (block_size - sizeof(DiskJournalRecord))
+												/sizeof(unsigned int);
+	
+	//Descriptor entries: written blocks first, then freed ones
+	unsigned int* list = (unsigned int*)malloc(2*j->num_entries*sizeof(int));
+	unsigned int num = 0, written, d, i;
+	for(i=0;i<j->num_entries;i++){
+		if(j->entries[i].image >= 0) list[num++] = j->entries[i].block_num;
+	}
+	written = num;
+	for(i=0;i<j->num_entries;i++){
+		if(j->entries[i].freed) 
+			list[num++] = j->entries[i].block_num | DISK_JOURNAL_FREE;
+	}
+	unsigned int descs = (num+per_desc-1)/per_desc;
+	unsigned int count = descs + written + 1;
+	
+	//Not enough room: the groups before have to be in place first
+	if(j->used + count > j->slots && DiskDriver_journalCheckpoint(disk) != 0){
+		free(list);
+		return -1;
+	}
+	
+	//Building the group: descriptors, images, commit record
+	char* buf = (char*)calloc(count, block_size);
+	for(d=0;d<descs;d++){
+		DiskJournalRecord* r = (DiskJournalRecord*)(buf + d*block_size);
+		r->magic = DISK_JOURNAL_MAGIC;
+		r->type = DISK_JOURNAL_DESC;
+		r->seq = j->seq;
+		r->count = num;
+		unsigned int n = num - d*per_desc;
+		if(n > per_desc) n = per_desc;
+		memcpy(r+1, list + d*per_desc, n*sizeof(unsigned int));
+	}
+	void** bufs = (void**)malloc((written+1)*sizeof(void*));
+	for(i=0,d=0;i<j->num_entries;i++){
+		if(j->entries[i].image < 0) continue;
+		bufs[d] = buf + (descs+d)*block_size;
+		memcpy(bufs[d++], j->images + (size_t)j->entries[i].image*block_size, 
+															block_size);
+	}
+	DiskJournalRecord* c = (DiskJournalRecord*)(buf + (count-1)*block_size);
+	c->magic = DISK_JOURNAL_MAGIC;
+	c->type = DISK_JOURNAL_COMMIT;
+	c->seq = j->seq;
+	c->count = count-1;
+	c->checksum = DiskDriver_checksum(buf, (size_t)(count-1)*block_size);
+	
+	//The group is done once the commit record is on the disk
+	int res = 0;
+	if(DiskDriver_journalIO(disk, buf, (j->tail+j->used)%j->slots, count, 1) != 0 
+										|| fdatasync(disk->fd) != 0){
+		printf("Error writing the journal!\n");
+		res = -1;
+	}
+	else{
+		j->used += count;
+		j->seq++;
+		j->commits++;
+		
+		//Now blocks can go to their place, and freed ones become free
+		if(written > 0){
+			DiskIOVec* vec = DiskDriver_makeVec(bufs, list, written);
+			for(i=0;i<written;i++) 
+				DiskDriver_dirtyBlocks(disk, vec[i].block_num, 1);
+			res = disk->backend->writeBlocks(disk, vec, written);
+			free(vec);
+		}
+		for(i=0;i<j->num_entries;i++){
+			if(j->entries[i].freed 
+					&& DiskDriver_bitmapGet(disk, j->entries[i].block_num) == 1) 
+				DiskDriver_markEmpty(disk, j->entries[i].block_num);
+		}
+	}
+	
+	//A new group begins
+	j->num_entries = 0;
+	j->num_images = 0;
+	memset(j->table, 0xFF, j->table_size*sizeof(int));
+	free(bufs);
+	free(buf);
+	free(list);
+	return res;
+}
+
+
+int DiskDriver_journalOpen(DiskDriver* disk, int create, int replay){
+	
+	disk->journal = NULL;
+	if(disk->header->journal_slots == 0) return 0; //No journal
+	
+	DiskJournal* j = (DiskJournal*)calloc(1, sizeof(DiskJournal));
+	j->offset = disk->header->journal_offset;
+	j->slots = disk->header->journal_slots - 1;
+	j->max_entries = 64;
+	j->entries = (DiskJournalEntry*)malloc(j->max_entries*sizeof(DiskJournalEntry));
+	j->table_size = 2*j->max_entries;
+	j->table = (int*)malloc(j->table_size*sizeof(int));
+	memset(j->table, 0xFF, j->table_size*sizeof(int));
+	j->images = (char*)malloc((size_t)j->slots*disk->block_size);
+	disk->journal = j;
+	
+	DiskJournalHeader jh;
+	memset(&jh, 0, sizeof(DiskJournalHeader));
+	if(create){
+		//Sequence numbers never met in a journal left in the same file
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		jh.magic = DISK_JOURNAL_MAGIC;
+		jh.tail = 0;
+		jh.seq = ((uint64_t)now.tv_sec << 30) ^ (uint64_t)now.tv_nsec;
+		
+		char* empty = (char*)calloc(1, disk->block_size);
+		int res = DiskDriver_journalIO(disk, empty, 0, 1, 1);
+		free(empty);
+		if(res != 0 || pwrite(disk->fd, &jh, sizeof(DiskJournalHeader), 
+						j->offset) != sizeof(DiskJournalHeader)
+				|| fdatasync(disk->fd) != 0) return -1;
+	}
+	else if(pread(disk->fd, &jh, sizeof(DiskJournalHeader), j->offset) 
+									!= sizeof(DiskJournalHeader)
+			|| jh.magic != DISK_JOURNAL_MAGIC || jh.tail >= j->slots){
+		printf("Journal header is damaged!\n");
+		return -1;
+	}
+	j->tail = jh.tail;
+	j->seq = jh.seq;
+	if(replay && DiskDriver_journalReplay(disk) != 0) return -1;
+	
+	//Threads may all go idle with a group running: a thread of its own
+	//commits it in time
+	if(disk->locks != NULL){
+		pthread_condattr_t attr;
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&j->wake, &attr);
+		pthread_condattr_destroy(&attr);
+		j->committer_on = 1;
+		if(pthread_create(&j->committer, NULL, DiskDriver_committer, disk) != 0){
+			printf("Journal committer not started: idle groups wait\n");
+			j->committer_on = 0;
+			pthread_cond_destroy(&j->wake);
+		}
+	}
+	return 0;
+}
+
+
+void DiskDriver_journalClose(DiskDriver* disk){
+	
+	DiskJournal* j = disk->journal;
+	if(j == NULL) return;
+	
+	if(j->committer_on){ //Stopped before the last commit
+		DiskDriver_lock(DISK_LOCK(disk, journal));
+		j->committer_on = 0;
+		pthread_cond_signal(&j->wake);
+		DiskDriver_unlock(DISK_LOCK(disk, journal));
+		pthread_join(j->committer, NULL);
+		pthread_cond_destroy(&j->wake);
+	}
+	j->depth = 0;
+	DiskDriver_commit(disk);
+	DiskDriver_journalCheckpoint(disk); //Nothing to replay next time
+	
+	free(j->entries);
+	free(j->table);
+	free(j->images);
+	free(j);
+	disk->journal = NULL;
+}
+
+
+int DiskDriver_journaled(DiskDriver* disk, unsigned int block_num){
+	
+	DiskJournal* j = disk->journal;
+	if(j == NULL) return 0;
+	if(j->depth > 0) return 1; //Inside an operation
+	if(j->num_entries == 0) return 0;
+	
+	//Outside, only blocks already in the group (they would be overwritten)
+	DiskDriver_lock(DISK_LOCK(disk, journal));
+	int res = DiskDriver_journalFind(disk, block_num, 0) != NULL;
+	DiskDriver_unlock(DISK_LOCK(disk, journal));
+	return res;
+}
+
+
+DiskJournalEntry* DiskDriver_journalFind(DiskDriver* disk, 
+									unsigned int block_num, int create){
+	
+	DiskJournal* j = disk->journal;
+	unsigned int mask = j->table_size-1;
+	unsigned int h = (block_num*2654435761u) & mask;
+	while(j->table[h] != -1){
+		if(j->entries[j->table[h]].block_num == block_num) 
+			return &j->entries[j->table[h]];
+		h = (h+1) & mask;
+	}
+	if(!create) return NULL;
+	
+	//Making room: the table is rebuilt twice as big
+	if(j->num_entries == j->max_entries){
+		j->max_entries *= 2;
+		j->entries = (DiskJournalEntry*)realloc(j->entries, 
+								j->max_entries*sizeof(DiskJournalEntry));
+	}
+	if(2*(j->num_entries+1) > j->table_size){
+		int i;
+		j->table_size *= 2;
+		j->table = (int*)realloc(j->table, j->table_size*sizeof(int));
+		memset(j->table, 0xFF, j->table_size*sizeof(int));
+		mask = j->table_size-1;
+		for(i=0;i<j->num_entries;i++){
+			h = (j->entries[i].block_num*2654435761u) & mask;
+			while(j->table[h] != -1) h = (h+1) & mask;
+			j->table[h] = i;
+		}
+		h = (block_num*2654435761u) & mask;
+		while(j->table[h] != -1) h = (h+1) & mask;
+	}
+	
+	DiskJournalEntry* e = &j->entries[j->num_entries];
+	e->block_num = block_num;
+	e->image = -1;
+	e->freed = 0;
+	j->table[h] = j->num_entries++;
+	return e;
+}
+
+
+int DiskDriver_journalWrite(DiskDriver* disk, const void* src, 
+												unsigned int block_num){
+	
+	DiskJournal* j = disk->journal;
+	DiskDriver_lock(DISK_LOCK(disk, journal));
+	DiskJournalEntry* e = DiskDriver_journalFind(disk, block_num, 0);
+	if(e == NULL || e->image < 0){
+		//No room for one more image: the group so far is committed
+		if(DiskDriver_journalSlots(disk, 1, 1) > j->slots){
+			if(DiskDriver_commitGroup(disk) != 0){
+				DiskDriver_unlock(DISK_LOCK(disk, journal));
+				return -1;
+			}
+			if(DiskDriver_bitmapGet(disk, block_num) == 0) //Freed by it
+				DiskDriver_markFull(disk, block_num);
+		}
+		e = DiskDriver_journalFind(disk, block_num, 1);
+		e->image = j->num_images++;
+	}
+	
+	memcpy(j->images + (size_t)e->image*disk->block_size, src, 
+														disk->block_size);
+	e->freed = 0; //Written again after a free
+	DiskDriver_unlock(DISK_LOCK(disk, journal));
+	return 0;
+}
+
+
+void DiskDriver_journalFree(DiskDriver* disk, unsigned int block_num){
+	
+	DiskJournal* j = disk->journal;
+	DiskDriver_lock(DISK_LOCK(disk, journal));
+	DiskJournalEntry* e = DiskDriver_journalFind(disk, block_num, 0);
+	if(e == NULL){
+		if(DiskDriver_journalSlots(disk, 1, 0) > j->slots) 
+			DiskDriver_commitGroup(disk);
+		e = DiskDriver_journalFind(disk, block_num, 1);
+	}
+	e->freed = 1;
+	DiskDriver_unlock(DISK_LOCK(disk, journal));
+}
+
+
+unsigned int DiskDriver_journalSlots(DiskDriver* disk, int extra_entries, 
+													int extra_images){
+	
+	DiskJournal* j = disk->journal;
+	unsigned int per_desc = (disk->block_size - sizeof(DiskJournalRecord))
+												/sizeof(unsigned int);
+	
+	//A block can be both written and freed: two entries
+	unsigned int entries = 2*(j->num_entries + extra_entries);
+	return (entries+per_desc-1)/per_desc + j->num_images + extra_images + 1;
+}
+
+
+int DiskDriver_journalCheckpoint(DiskDriver* disk){
+	
+	DiskJournal* j = disk->journal;
+	
+	//Blocks and bitmap of the committed groups reach the disk first
+	if(DiskDriver_sync(disk) != 0) return -1;
+	
+	//Then the journal can forget them
+	DiskJournalHeader jh;
+	memset(&jh, 0, sizeof(DiskJournalHeader));
+	j->tail = (j->tail + j->used) % j->slots;
+	j->used = 0;
+	jh.magic = DISK_JOURNAL_MAGIC;
+	jh.tail = j->tail;
+	jh.seq = j->seq;
+	if(pwrite(disk->fd, &jh, sizeof(DiskJournalHeader), j->offset) 
+									!= sizeof(DiskJournalHeader)
+			|| fdatasync(disk->fd) != 0){
+		printf("Error writing the journal header!\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+int DiskDriver_journalIO(DiskDriver* disk, char* buf, unsigned int pos, 
+										unsigned int count, int is_write){
+	
+	DiskJournal* j = disk->journal;
+	while(count > 0){
+		//Up to the end of the journal, then from its beginning
+		unsigned int n = j->slots - pos;
+		if(n > count) n = count;
+		off_t offset = j->offset + (off_t)(1+pos)*disk->block_size;
+		size_t len = (size_t)n*disk->block_size;
+		ssize_t res = is_write ? pwrite(disk->fd, buf, len, offset) 
+								: pread(disk->fd, buf, len, offset);
+		if(res != (ssize_t)len) return -1;
+		buf += len;
+		count -= n;
+		pos = 0;
+	}
+	return 0;
+}
+
+
+int DiskDriver_journalReplay(DiskDriver* disk){
+	
+	DiskJournal* j = disk->journal;
+	unsigned int block_size = disk->block_size;
+	unsigned int per_desc = (block_size - sizeof(DiskJournalRecord))
+												/sizeof(unsigned int);
+	char* buf = (char*)malloc((size_t)j->slots*block_size);
+	unsigned int k, d;
+	
+	//Groups follow each other from tail, until one is not complete
+	while(j->used < j->slots){
+		unsigned int pos = (j->tail + j->used) % j->slots;
+		DiskJournalRecord* r = (DiskJournalRecord*)buf;
+		if(DiskDriver_journalIO(disk, buf, pos, 1, 0) != 0) break;
+		if(r->magic != DISK_JOURNAL_MAGIC || r->type != DISK_JOURNAL_DESC 
+								|| r->seq != j->seq || r->count == 0) break;
+		
+		//Every descriptor, to know how many images follow
+		unsigned int num = r->count;
+		unsigned int descs = (num+per_desc-1)/per_desc;
+		if(descs >= j->slots - j->used || (descs > 1 && DiskDriver_journalIO(
+				disk, buf+block_size, (pos+1)%j->slots, descs-1, 0) != 0)) break;
+		unsigned int written = 0, valid = 1;
+		for(d=1;d<descs;d++){
+			r = (DiskJournalRecord*)(buf + d*block_size);
+			if(r->magic != DISK_JOURNAL_MAGIC || r->type != DISK_JOURNAL_DESC 
+									|| r->seq != j->seq) valid = 0;
+		}
+		for(k=0;k<num && valid;k++){
+			unsigned int e = ((unsigned int*)((DiskJournalRecord*)(buf 
+							+ (k/per_desc)*block_size)+1))[k%per_desc];
+			if((e & ~DISK_JOURNAL_FREE) > (unsigned int)disk->num_entries-1) 
+				valid = 0;
+			if(!(e & DISK_JOURNAL_FREE)) written++;
+		}
+		unsigned int count = descs + written + 1;
+		if(!valid || count > j->slots - j->used) break;
+		
+		//Images and commit record, checked against each other
+		if(DiskDriver_journalIO(disk, buf + descs*block_size, 
+				(pos+descs)%j->slots, written+1, 0) != 0) break;
+		DiskJournalRecord* c = (DiskJournalRecord*)(buf + (count-1)*block_size);
+		if(c->magic != DISK_JOURNAL_MAGIC || c->type != DISK_JOURNAL_COMMIT 
+				|| c->seq != j->seq || c->count != count-1 || c->checksum 
+				!= DiskDriver_checksum(buf, (size_t)(count-1)*block_size)) break;
+		
+		//Committed: doing it again (writes, then frees)
+		unsigned int image = 0;
+		for(k=0;k<num;k++){
+			unsigned int e = ((unsigned int*)((DiskJournalRecord*)(buf 
+							+ (k/per_desc)*block_size)+1))[k%per_desc];
+			unsigned int block_num = e & ~DISK_JOURNAL_FREE;
+			if(e & DISK_JOURNAL_FREE){
+				if(DiskDriver_bitmapGet(disk, block_num) == 1) 
+					DiskDriver_markEmpty(disk, block_num);
+				continue;
+			}
+			if(DiskDriver_bitmapGet(disk, block_num) == 0) 
+				DiskDriver_markFull(disk, block_num);
+			DiskDriver_dirtyBlocks(disk, block_num, 1);
+			disk->backend->write(disk, buf + (descs+image++)*block_size, 
+																block_num);
+		}
+		j->used += count;
+		j->seq++;
+		j->replayed++;
+	}
+	free(buf);
+	
+	if(j->replayed == 0) return 0;
+	printf("Journal: %lu groups replayed\n", j->replayed);
+	return DiskDriver_journalCheckpoint(disk);
+}
+
+
+unsigned int DiskDriver_checksum(const char* data, size_t len){
+	
+	//FNV-1a, a 64-bit word at a time
+	uint64_t h = 0xcbf29ce484222325ULL, word;
+	size_t i;
+	for(i=0;i+8<=len;i+=8){
+		memcpy(&word, data+i, sizeof(uint64_t));
+		h = (h ^ word) * 0x100000001b3ULL;
+	}
+	return (unsigned int)(h ^ (h >> 32));
+}
+
+
+int DiskDriver_sync(DiskDriver* disk){
+	
+	//Shared disks only know whether something changed
+	int shared_dirty = disk->locks != NULL 
+			&& __atomic_exchange_n(&disk->dirty_any, 0, __ATOMIC_ACQ_REL);
+	if(disk->num_dirty == 0 && !shared_dirty) return 0;
+	
+	//Every range is queued for writeback before waiting for any of them,
+	//then each one is waited for: only the pages in them are written.
+	//The fdatasync() after them finds nothing left but the header page,
+	//and flushes the device cache once. Without sync_file_range() (or on
+	//a shared disk, which keeps no ranges) it writes the whole file
+	int i, res = 0;
+#if defined(__NR_sync_file_range) && defined(__LP64__)
+	for(i=0;i<disk->num_dirty;i++)
+		syscall(__NR_sync_file_range, disk->fd, disk->dirty[i].begin, 
+				disk->dirty[i].end - disk->dirty[i].begin, 2); //_WRITE
+	for(i=0;i<disk->num_dirty;i++){
+		if(syscall(__NR_sync_file_range, disk->fd, disk->dirty[i].begin, 
+				disk->dirty[i].end - disk->dirty[i].begin, 7) != 0){ 
+			printf("Error writing back the disk!\n"); //_WAIT_BEFORE|_WRITE|_WAIT_AFTER
+			res = -1;
+			break;
+		}
+	}
+#endif
+	if(fdatasync(disk->fd) != 0){
+		printf("Error syncing the disk!\n");
+		res = -1;
+	}
+	
+	__atomic_fetch_add(&disk->syncs, 1, __ATOMIC_RELAXED);
+	disk->synced_ranges += disk->num_dirty;
+	disk->num_dirty = 0;
+	disk->sync_ops = 0;
+	if(disk->sync_policy == DISK_SYNC_TIME) disk->sync_time = DiskDriver_msec();
+	return res;
+}
+
+
+void DiskDriver_setSync(DiskDriver* disk, int policy, unsigned int interval){
+	
+	disk->sync_policy = policy;
+	disk->sync_interval = interval;
+	disk->sync_ops = 0;
+	disk->sync_time = DiskDriver_msec();
+}
+
+
+void DiskDriver_resetSync(DiskDriver* disk){
+	
+	disk->num_dirty = 0;
+	disk->dirty_any = 0;
+	disk->sync_policy = DISK_SYNC_CLOSE;
+	disk->sync_interval = 0;
+	disk->sync_ops = 0;
+	disk->sync_time = 0;
+	disk->syncs = 0;
+	disk->synced_ranges = 0;
+	disk->written = 0;
+}
+
+
+void DiskDriver_dirty(DiskDriver* disk, off_t begin, off_t end){
+	
+	//Threads would wait for each other on the list: 
+	//a shared disk flushes the whole file instead
+	if(disk->locks != NULL){
+		if(!__atomic_load_n(&disk->dirty_any, __ATOMIC_RELAXED)) 
+			__atomic_store_n(&disk->dirty_any, 1, __ATOMIC_RELEASE);
+		return;
+	}
+	
+	begin -= begin % disk->page_size;
+	end += (disk->page_size - end % disk->page_size) % disk->page_size;
+	
+	//First range ending at or after begin (writes are mostly sequential:
+	//the last range is tried first)
+	DiskRange* r = disk->dirty;
+	int n = disk->num_dirty, lo = 0, hi = n, i;
+	if(n > 0 && r[n-1].begin <= begin) lo = (r[n-1].end >= begin) ? n-1 : n;
+	while(lo < hi){
+		int mid = (lo+hi)/2;
+		if(r[mid].end < begin) lo = mid+1;
+		else hi = mid;
+	}
+	if(lo < n && r[lo].begin <= begin && r[lo].end >= end) return; //Already in
+	
+	//Touching or overlapping ranges become one
+	if(lo < n && r[lo].begin <= end){
+		if(begin < r[lo].begin) r[lo].begin = begin;
+		if(end > r[lo].end) r[lo].end = end;
+		for(i=lo+1;i<n && r[i].begin <= r[lo].end;i++){
+			if(r[i].end > r[lo].end) r[lo].end = r[i].end;
+		}
+		memmove(r+lo+1, r+i, (n-i)*sizeof(DiskRange));
+		disk->num_dirty -= i-lo-1;
+		return;
+	}
+	
+	//No room: the two closest ranges are merged first
+	if(n == DISK_DIRTY_RANGES){
+		int best = 0;
+		for(i=1;i<n-1;i++){
+			if(r[i+1].begin - r[i].end < r[best+1].begin - r[best].end) 
+				best = i;
+		}
+		r[best].end = r[best+1].end;
+		memmove(r+best+1, r+best+2, (n-best-2)*sizeof(DiskRange));
+		n--;
+		if(lo > best) lo--;
+		if(lo < n && r[lo].begin <= end){ //The merged one may cover it now
+			disk->num_dirty = n;
+			DiskDriver_dirty(disk, begin, end);
+			return;
+		}
+	}
+	memmove(r+lo+1, r+lo, (n-lo)*sizeof(DiskRange));
+	r[lo].begin = begin;
+	r[lo].end = end;
+	disk->num_dirty = n+1;
+}
+
+
+void DiskDriver_dirtyBlocks(DiskDriver* disk, unsigned int block_num, 
+												unsigned int count){
+	
+	off_t begin = disk->first_block_offset + (off_t)block_num*disk->block_size;
+	DiskDriver_dirty(disk, begin, begin + (off_t)count*disk->block_size);
+}
+
+
+void DiskDriver_syncTick(DiskDriver* disk, unsigned int ops){
+	
+	unsigned int done = (disk->locks != NULL) ? 
+		__atomic_add_fetch(&disk->sync_ops, ops, __ATOMIC_RELAXED) 
+										: (disk->sync_ops += ops);
+	if(disk->sync_policy == DISK_SYNC_OPS){
+		if(done >= disk->sync_interval) DiskDriver_sync(disk);
+	}
+	else if(disk->sync_policy == DISK_SYNC_TIME){
+		if(DiskDriver_msec() - disk->sync_time >= disk->sync_interval) 
+			DiskDriver_sync(disk);
+	}
+	
+	//A journal group left alone since it got old commits now, outside
+	//operations (shared disks have the committer)
+	DiskJournal* j = disk->journal;
+	if(j != NULL && disk->locks == NULL && j->depth == 0 && j->ops > 0 
+			&& DiskDriver_msec() - j->started >= DiskDriver_journalDelay(disk))
+		DiskDriver_commitGroup(disk);
+}
+
+
+unsigned long DiskDriver_msec(void){
+	
+	struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+	return (unsigned long)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+
+void DiskDriver_lockInit(DiskDriver* disk, int mode){
+	
+	disk->locks = NULL;
+	if(!(mode & DISK_SHARED)) return;
+	
+	DiskLocks* locks = (DiskLocks*)malloc(sizeof(DiskLocks));
+	pthread_mutex_init(&locks->chunks, NULL);
+	pthread_mutex_init(&locks->windows, NULL);
+	pthread_mutex_init(&locks->journal, NULL);
+	pthread_mutex_init(&locks->queue, NULL);
+	pthread_mutex_init(&locks->reserved, NULL);
+	disk->locks = locks;
+}
+
+
+void DiskDriver_lockClose(DiskDriver* disk){
+	
+	DiskLocks* locks = disk->locks;
+	if(locks == NULL) return;
+	
+	pthread_mutex_destroy(&locks->chunks);
+	pthread_mutex_destroy(&locks->windows);
+	pthread_mutex_destroy(&locks->journal);
+	pthread_mutex_destroy(&locks->queue);
+	pthread_mutex_destroy(&locks->reserved);
+	free(locks);
+	disk->locks = NULL;
+}
+
+
+void DiskDriver_lock(pthread_mutex_t* lock){
+	if(lock != NULL) pthread_mutex_lock(lock);
+}
+
+
+void DiskDriver_unlock(pthread_mutex_t* lock){
+	if(lock != NULL) pthread_mutex_unlock(lock);
+}
@@ -1,5 +1,6 @@
 #include "disk_driver.h"
 #include <stdio.h>
+#include <time.h>
 
 
 //Testing bitmap and disk driver
@@ -9,7 +10,22 @@ void writeBlock_test(DiskDriver disk, int block_mumber);
 void freeBlock_test(DiskDriver disk, int block_number);
 void readBlock_test(DiskDriver disk, int block_number);
 void getFreeBlock_test(DiskDriver disk);
+void window_test(DiskDriver disk, int block_number);
+void wholeMap_test(int block_number);
+void backend_test(int block_number);
+void summary_test(int block_number);
+void pin_test(int block_number);
+void geometry_test(int block_number);
+void clean_test(int block_number);
+void lazy_test(void);
+void journal_test(int block_number);
+void sync_test(int block_number);
+void shared_test(void);
+void alloc_test(void);
+void extent_test(DiskDriver disk);
 void resume_test(DiskDriver disk, int block_number);
+void legacy_test(void);
+void summaryCheck(DiskDriver* disk);
 
 
 int main (){
@@ -39,6 +55,48 @@ int main (){
 	//getFreeBlock test
 	getFreeBlock_test(disk);
 	
+	//getFreeExtent test
+	extent_test(disk);
+	
+	//window cache test
+	window_test(disk, block_number);
+	
+	//whole mapping test (on a separate disk)
+	wholeMap_test(block_number);
+	
+	//same workload on every backend, timed
+	backend_test(block_number);
+	
+	//free block search on a nearly full disk
+	summary_test(block_number);
+	
+	//pinned blocks have to survive window eviction
+	pin_test(block_number);
+	
+	//other block sizes, and the superblock that remembers them
+	geometry_test(block_number);
+	
+	//resume after a clean unmount and after a crash
+	clean_test(block_number);
+	
+	//huge sparse disk, bitmap initialized on first touch
+	lazy_test();
+	
+	//metadata groups, committed and replayed after a crash
+	journal_test(block_number);
+	
+	//disk of the old format (a byte per block), converted by resume
+	legacy_test();
+	
+	//dirty ranges and flush policies
+	sync_test(block_number);
+	
+	//several threads on the same disk
+	shared_test();
+	
+	//concurrent allocation, 1 to 8 threads
+	alloc_test();
+	
 	//And now resume it!
 	resume_test(disk, block_number);
 	
@@ -51,6 +109,8 @@ int main (){
 void printDiskStatus(DiskDriver disk){
 	printf("\n");
 	printf("First Block Mapped = %ud\n", disk.first_mapped_block);
+	printf("Window hits = %lu, misses = %lu\n", disk.window_hits, 
+													disk.window_misses);
 	printf("File Descriptor = %d\n", disk.fd);
 	printf("Number of Free Blocks = %d\n", disk.free_blocks);
 	printf("First Block Offset \
@@ -114,6 +174,941 @@ void getFreeBlock_test(DiskDriver disk){
 }
 
 
+void extent_test(DiskDriver disk){
+	//Half of the blocks are free, one by one: no run of 2 blocks there
+	unsigned int len;
+	int start = DiskDriver_getFreeExtent(&disk, 0, 1, 8, &len);
+	printf("Extent: %d, lenght %u\n", start, len);
+	if(start == -1 || len != 1 || DiskDriver_bitmapGet(&disk, start) != 1){
+		printf("GetFreeExtent Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_freeExtent(&disk, start, len);
+	
+	//Making a hole of 7 blocks from block 100 (even blocks are free)
+	int i;
+	for(i=101;i<106;i++) DiskDriver_freeBlock(&disk, i);
+	start = DiskDriver_getFreeExtent(&disk, 50, 4, 16, &len);
+	printf("Extent: %d, lenght %u\n", start, len);
+	if(start != 100 || len != 7){
+		printf("GetFreeExtent Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_freeExtent(&disk, start, len);
+	
+	//A reserved run stays empty in the bitmap, but lookups go around it
+	start = DiskDriver_reserveExtent(&disk, 50, 4, 16, &len);
+	int block = DiskDriver_allocBlock(&disk, 100);
+	printf("Reserved: %d, lenght %u, allocated after it: %d\n", start, len, block);
+	if(start != 100 || len != 7 || DiskDriver_bitmapGet(&disk, 103) != 0
+			|| block != 108 || DiskDriver_getFreeExtent(&disk, 100, 1, 8, &len) 
+															!= 110){
+		printf("ReserveExtent Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_freeBlock(&disk, 108);
+	DiskDriver_freeBlock(&disk, 110);
+	
+	//Nothing released, nothing split
+	DiskDriver_releaseExtent(&disk, 103, 0);
+	if(disk.num_reserved != 1){
+		printf("ReleaseExtent Error!!\n");
+		exit(-1);
+	}
+	
+	//Released in pieces: the middle first, then the rest
+	DiskDriver_releaseExtent(&disk, 102, 3);
+	if(DiskDriver_getFreeBlock(&disk, 100) != 102 
+			|| DiskDriver_getFreeBlock(&disk, 105) != 108){
+		printf("ReleaseExtent Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_releaseExtent(&disk, 100, 7);
+	if(DiskDriver_getFreeBlock(&disk, 100) != 100 || disk.num_reserved != 0){
+		printf("ReleaseExtent Error!!\n");
+		exit(-1);
+	}
+	free(disk.reserved); //This copy of the disk is dropped
+}
+
+
+void window_test(DiskDriver disk, int block_number){
+	//Alternating two far blocks has to cost only the first two mmaps
+	char* dest = (char*)malloc(BLOCK_SIZE);
+	int i;
+	unsigned long misses = disk.window_misses;
+	for(i=0;i<1000;i++){
+		DiskDriver_readBlock(&disk, dest, 1);
+		DiskDriver_readBlock(&disk, dest, block_number-1);
+	}
+	misses = disk.window_misses - misses;
+	if(misses > 2){
+		printf("Window cache is thrashing! (%lu misses)\n", misses);
+		exit(-1);
+	}
+	free(dest);
+	printf("\nAfter window test:\n");
+	printDiskStatus(disk);
+}
+
+
+void wholeMap_test(int block_number){
+	DiskDriver whole;
+	char* src = malloc(sizeof(char)*BLOCK_SIZE);
+	char* dest = malloc(sizeof(char)*BLOCK_SIZE);
+	int i;
+	
+	if(DiskDriver_initMode(&whole, "test_fs_whole.hex", block_number, 
+								DISK_WHOLE_MAP|DISK_POPULATE) != 0){
+		printf("Whole map init Error!!\n");
+		exit(-1);
+	}
+	if(whole.whole_map == NULL){
+		printf("Disk was not mapped as a whole!\n");
+		exit(-1);
+	}
+	
+	for(i=0;i<block_number;i+=97){
+		memset(src, 'a' + i%26, BLOCK_SIZE);
+		DiskDriver_writeBlock(&whole, src, i);
+		DiskDriver_readBlock(&whole, dest, i);
+		if(memcmp(src, dest, BLOCK_SIZE) != 0){
+			printf("Whole map read back Error!!\n");
+			exit(-1);
+		}
+	}
+	
+	//Resuming the same file with windows has to see the same data
+	DiskDriver windowed;
+	if(DiskDriver_resume(&windowed, "test_fs_whole.hex") != 0){
+		printf("Whole map resume Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_readBlock(&windowed, dest, 97);
+	if(dest[0] != 'a' + 97%26){
+		printf("Whole map data not on disk!!\n");
+		exit(-1);
+	}
+	
+	printf("\nAfter whole map test:\n");
+	printDiskStatus(whole);
+	free(src);
+	free(dest);
+}
+
+
+void backend_test(int block_number){
+	int modes[5] = {0, DISK_WHOLE_MAP, DISK_PIO, DISK_ASYNC, 
+											DISK_ASYNC|DISK_THREADS};
+	char* src = malloc(sizeof(char)*BLOCK_SIZE);
+	char* dest = malloc(sizeof(char)*BLOCK_SIZE);
+	int i, j, k;
+	struct timespec begin, end;
+	
+	printf("\nBackend test:\n");
+	for(k=0;k<5;k++){
+		DiskDriver disk;
+		if(DiskDriver_initMode(&disk, "test_fs_backend.hex", block_number,
+											modes[k]) != 0){
+			printf("Backend init Error!!\n");
+			exit(-1);
+		}
+		
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for(j=0;j<block_number;j++){
+			for(i=0;i<BLOCK_SIZE;i++) src[i] = 'A' + (j+k)%26;
+			if(DiskDriver_writeBlock(&disk, src, j) != 0){
+				printf("Backend writeBlock Error!!\n");
+				exit(-1);
+			}
+		}
+		//Jumping between far blocks, the worst case for windows
+		for(j=0;j<block_number;j++){
+			int block = (j%2 == 0) ? j/2 : block_number-1-j/2;
+			if(DiskDriver_readBlock(&disk, dest, block) != 0 
+								|| dest[0] != 'A' + (block+k)%26){
+				printf("Backend readBlock Error!!\n");
+				exit(-1);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		
+		printf("%s: %.3f ms\n", disk.backend->name, 
+					(end.tv_sec-begin.tv_sec)*1000.0 
+						+ (end.tv_nsec-begin.tv_nsec)/1000000.0);
+		
+		//Vectored calls, on blocks out of order with some adjacent runs
+		unsigned int vec_blocks[8] = {12, 10, 11, 500, 13, 3, 501, 4};
+		char vec_data[8][BLOCK_SIZE];
+		void* vec_bufs[8];
+		for(j=0;j<8;j++){
+			memset(vec_data[j], 'a'+j, BLOCK_SIZE);
+			vec_bufs[j] = vec_data[j];
+		}
+		if(DiskDriver_writeBlocks(&disk, vec_bufs, vec_blocks, 8) != 0){
+			printf("Backend writeBlocks Error!!\n");
+			exit(-1);
+		}
+		memset(vec_data, 0, sizeof(vec_data));
+		unsigned long lookups = disk.window_hits + disk.window_misses;
+		if(DiskDriver_readBlocks(&disk, vec_bufs, vec_blocks, 8) != 0){
+			printf("Backend readBlocks Error!!\n");
+			exit(-1);
+		}
+		
+		//Windows are looked for once per window met, not once per block
+		lookups = disk.window_hits + disk.window_misses - lookups;
+		unsigned int windows = 0, per_window = disk.window_size/disk.block_size;
+		for(j=0;j<8;j++){
+			for(i=0;i<8 && (i == j || vec_blocks[i]/per_window 
+									!= vec_blocks[j]/per_window 
+									|| vec_blocks[i] > vec_blocks[j]);i++);
+			if(i == 8) windows++;
+		}
+		if(disk.backend == &WINDOW_BACKEND && lookups != windows){
+			printf("Backend readBlocks looked for %lu windows, not %u!!\n", 
+														lookups, windows);
+			exit(-1);
+		}
+		for(j=0;j<8;j++){
+			if(vec_data[j][0] != 'a'+j || vec_data[j][BLOCK_SIZE-1] != 'a'+j){
+				printf("Backend readBlocks returned wrong data!!\n");
+				exit(-1);
+			}
+		}
+		
+		DiskDriver_unmount(&disk);
+	}
+	
+	free(src);
+	free(dest);
+}
+
+
+void summary_test(int block_number){
+	DiskDriver disk;
+	char* src = calloc(BLOCK_SIZE, sizeof(char));
+	int i, last = block_number-7;
+	
+	if(DiskDriver_initMode(&disk, "test_fs_summary.hex", block_number, 
+										DISK_WHOLE_MAP) != 0){
+		printf("Summary init Error!!\n");
+		exit(-1);
+	}
+	for(i=0;i<block_number;i++) DiskDriver_writeBlock(&disk, src, i);
+	if(DiskDriver_getFreeBlock(&disk, 0) != -1 || disk.free_blocks != 0){
+		printf("Full disk has free blocks!!\n");
+		exit(-1);
+	}
+	
+	//Only one empty block, in the last chunk
+	DiskDriver_freeBlock(&disk, last);
+	summaryCheck(&disk);
+	if(DiskDriver_getFreeBlock(&disk, 0) != last 
+						|| DiskDriver_getFreeBlock(&disk, last+1) != -1){
+		printf("Summary search Error!!\n");
+		exit(-1);
+	}
+	
+	//Both sides of the first chunk boundary: each chunk finds its own,
+	//past them the search jumps to the last chunk
+	DiskDriver_freeBlock(&disk, DISK_CHUNK_BLOCKS-1);
+	DiskDriver_freeBlock(&disk, DISK_CHUNK_BLOCKS);
+	summaryCheck(&disk);
+	if(DiskDriver_getFreeBlock(&disk, 0) != DISK_CHUNK_BLOCKS-1 
+			|| DiskDriver_getFreeBlock(&disk, DISK_CHUNK_BLOCKS) 
+												!= DISK_CHUNK_BLOCKS
+			|| DiskDriver_getFreeBlock(&disk, DISK_CHUNK_BLOCKS+1) != last){
+		printf("Summary boundary Error!!\n");
+		exit(-1);
+	}
+	
+	//Filled again: the chunks are full in the summary once more
+	DiskDriver_writeBlock(&disk, src, DISK_CHUNK_BLOCKS-1);
+	DiskDriver_writeBlock(&disk, src, DISK_CHUNK_BLOCKS);
+	summaryCheck(&disk);
+	if(DiskDriver_getFreeBlock(&disk, 0) != last){
+		printf("Summary refill Error!!\n");
+		exit(-1);
+	}
+	
+	//Summary rebuilt by resume has to agree
+	DiskDriver resumed;
+	DiskDriver_resume(&resumed, "test_fs_summary.hex");
+	if(resumed.free_blocks != 1 
+				|| DiskDriver_getFreeBlock(&resumed, 0) != last){
+		printf("Summary resume Error!!\n");
+		exit(-1);
+	}
+	
+	printf("\nAfter summary test:\n");
+	printDiskStatus(resumed);
+	DiskDriver_unmount(&resumed);
+	DiskDriver_unmount(&disk);
+	free(src);
+}
+
+
+void summaryCheck(DiskDriver* disk){
+	
+	//Free count and summary bit of every chunk match its bitmap
+	unsigned int chunk, i, empty;
+	for(chunk=0;chunk<disk->num_chunks;chunk++){
+		empty = 0;
+		for(i=chunk*DISK_CHUNK_BLOCKS;i<(chunk+1)*DISK_CHUNK_BLOCKS 
+										&& i<(unsigned int)disk->num_entries;i++)
+			empty += DiskDriver_bitmapGet(disk, i) == 0;
+		int bit = (disk->summary[chunk/64] >> (chunk%64)) & 1;
+		if(DiskDriver_chunkFree(disk, chunk) != empty || bit != (empty > 0)){
+			printf("Summary of chunk %u Error!! (%u empty, bit %d)\n", 
+													chunk, empty, bit);
+			exit(-1);
+		}
+	}
+}
+
+
+void pin_test(int block_number){
+	DiskDriver disk;
+	char* src = malloc(sizeof(char)*BLOCK_SIZE);
+	const char* pinned[DISK_WINDOWS];
+	int i, j;
+	
+	if(DiskDriver_init(&disk, "test_fs_pin.hex", block_number) != 0){
+		printf("Pin init Error!!\n");
+		exit(-1);
+	}
+	int mapped_blocks = disk.window_size/disk.block_size;
+	//One written block per window, for the first windows
+	for(j=0;j<DISK_WINDOWS*4;j++){
+		memset(src, 'A' + j%26, BLOCK_SIZE);
+		DiskDriver_writeBlock(&disk, src, j*mapped_blocks);
+	}
+	
+	if(DiskDriver_pinBlock(&disk, block_number-1) != NULL){
+		printf("Pinned a free block!!\n");
+		exit(-1);
+	}
+	
+	//Pinning a window for every slot: no block outside can be reached
+	for(j=0;j<DISK_WINDOWS;j++){
+		pinned[j] = DiskDriver_pinBlock(&disk, j*mapped_blocks);
+		if(pinned[j] == NULL){
+			printf("PinBlock Error!!\n");
+			exit(-1);
+		}
+	}
+	if(DiskDriver_readBlock(&disk, src, DISK_WINDOWS*mapped_blocks) == 0){
+		printf("A pinned window was evicted!!\n");
+		exit(-1);
+	}
+	
+	//Releasing all but the first one, that has to stay valid
+	for(j=1;j<DISK_WINDOWS;j++) DiskDriver_unpinBlock(&disk, pinned[j]);
+	for(j=DISK_WINDOWS;j<DISK_WINDOWS*4;j++){
+		if(DiskDriver_readBlock(&disk, src, j*mapped_blocks) != 0){
+			printf("ReadBlock Error after unpin!!\n");
+			exit(-1);
+		}
+	}
+	for(i=0;i<BLOCK_SIZE;i++){
+		if(pinned[0][i] != 'A'){
+			printf("Pinned block changed!!\n");
+			exit(-1);
+		}
+	}
+	DiskDriver_unpinBlock(&disk, pinned[0]);
+	
+	printf("\nAfter pin test:\n");
+	printDiskStatus(disk);
+	DiskDriver_unmount(&disk);
+	free(src);
+}
+
+
+void geometry_test(int block_number){
+	unsigned int sizes[3] = {4096, 16384, 65536};
+	int modes[3] = {0, DISK_WHOLE_MAP, DISK_PIO};
+	int i, j, k, num_blocks = block_number/64;
+	
+	DiskDriver disk;
+	if(DiskDriver_initGeometry(&disk, "test_fs_geometry.hex", 
+											num_blocks, 1000, 0) != -1){
+		printf("Geometry accepted an invalid block size!!\n");
+		exit(-1);
+	}
+	if(DiskDriver_initGeometry(&disk, "test_fs_geometry.hex", 
+						(unsigned int)DISK_MAX_BLOCKS+1, 65536, 0) != -1){
+		printf("Geometry accepted too many blocks!!\n");
+		exit(-1);
+	}
+	
+	printf("\nGeometry test:\n");
+	for(i=0;i<3;i++){
+		char* src = malloc(sizes[i]);
+		char* dest = malloc(sizes[i]);
+		if(DiskDriver_initGeometry(&disk, "test_fs_geometry.hex", 
+							num_blocks, sizes[i], modes[i]) != 0){
+			printf("Geometry init Error!!\n");
+			exit(-1);
+		}
+		for(j=0;j<num_blocks;j+=3){
+			memset(src, 'a' + j%26, sizes[i]);
+			src[sizes[i]-1] = 'A' + j%26; //last byte of the block too
+			DiskDriver_writeBlock(&disk, src, j);
+		}
+		DiskDriver_unmount(&disk);
+		
+		//Every backend has to find the size in the superblock
+		for(k=0;k<3;k++){
+			if(DiskDriver_resumeMode(&disk, "test_fs_geometry.hex", 
+												modes[k]) != 0 
+								|| disk.block_size != sizes[i]){
+				printf("Geometry resume Error!!\n");
+				exit(-1);
+			}
+			for(j=0;j<num_blocks;j+=3){
+				if(DiskDriver_readBlock(&disk, dest, j) != 0 
+						|| dest[0] != 'a' + j%26 
+						|| dest[sizes[i]-1] != 'A' + j%26){
+					printf("Geometry read back Error!! (%u byte blocks, %s)\n",
+									sizes[i], disk.backend->name);
+					exit(-1);
+				}
+			}
+			DiskDriver_unmount(&disk);
+		}
+		printf("%u byte blocks: ok\n", sizes[i]);
+		free(src);
+		free(dest);
+	}
+}
+
+
+void clean_test(int block_number){
+	DiskDriver disk, crashed;
+	char* src = calloc(BLOCK_SIZE, sizeof(char));
+	int j;
+	
+	if(DiskDriver_init(&disk, "test_fs_clean.hex", block_number) != 0){
+		printf("Clean init Error!!\n");
+		exit(-1);
+	}
+	for(j=0;j<40000;j++) DiskDriver_writeBlock(&disk, src, j);
+	DiskDriver_freeBlock(&disk, 100);
+	unsigned int free_blocks = disk.free_blocks;
+	unsigned int generation = disk.header->generation;
+	DiskDriver_unmount(&disk);
+	
+	//Clean: counters come from the superblock, chunks are not counted
+	if(DiskDriver_resume(&disk, "test_fs_clean.hex") != 0 
+			|| disk.free_blocks != free_blocks 
+			|| disk.header->generation != generation+1
+			|| disk.chunk_free[0] != DISK_CHUNK_UNKNOWN){
+		printf("Clean resume Error!!\n");
+		exit(-1);
+	}
+	if(DiskDriver_getFreeBlock(&disk, 0) != 100 
+			|| DiskDriver_getFreeBlock(&disk, 101) != 40000){
+		printf("Clean resume getFreeBlock Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_writeBlock(&disk, src, 100);
+	free_blocks = disk.free_blocks;
+	
+	//Crash: the disk is never unmounted, next resume has to count
+	crashed = disk;
+	if(DiskDriver_resume(&disk, "test_fs_clean.hex") != 0 
+			|| disk.free_blocks != free_blocks
+			|| disk.free_blocks != block_number - 40000
+			|| disk.chunk_free[0] == DISK_CHUNK_UNKNOWN){
+		printf("Crashed resume Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	close(crashed.fd);
+	
+	printf("\nAfter clean test:\n");
+	printDiskStatus(disk);
+	free(src);
+}
+
+
+void lazy_test(void){
+	DiskDriver disk;
+	char* src = calloc(BLOCK_SIZE, sizeof(char));
+	char* dest = calloc(BLOCK_SIZE, sizeof(char));
+	int block_number = 1 << 28; //128 GiB with 512 byte blocks
+	struct timespec begin, end;
+	
+	printf("\n\nTesting lazy format\n\n");
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	if(DiskDriver_initMode(&disk, "test_fs_lazy.hex", block_number, DISK_LAZY) != 0){
+		printf("Lazy init Error!!\n");
+		exit(-1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("Formatted %d blocks in %.3f ms\n", block_number, 
+		(end.tv_sec-begin.tv_sec)*1e3 + (end.tv_nsec-begin.tv_nsec)/1e6);
+	if(disk.header->init_chunks != 0 || disk.free_blocks != block_number){
+		printf("Lazy init status Error!!\n");
+		exit(-1);
+	}
+	
+	//Only the chunks that were touched are initialized
+	unsigned int len;
+	memset(src, 'L', BLOCK_SIZE);
+	DiskDriver_writeBlock(&disk, src, 5);
+	DiskDriver_writeBlock(&disk, src, 2*DISK_CHUNK_BLOCKS + 7);
+	if(disk.header->init_chunks != 3 
+			|| DiskDriver_getFreeBlock(&disk, 5) != 6
+			|| DiskDriver_getFreeBlock(&disk, 2*DISK_CHUNK_BLOCKS + 7) 
+											!= 2*DISK_CHUNK_BLOCKS + 8
+			|| DiskDriver_getFreeBlock(&disk, 5*DISK_CHUNK_BLOCKS) 
+											!= 5*DISK_CHUNK_BLOCKS
+			|| DiskDriver_getFreeExtent(&disk, 3*DISK_CHUNK_BLOCKS, 1, 100, &len) 
+											!= 3*DISK_CHUNK_BLOCKS
+			|| len != 100 || disk.header->init_chunks != 4){
+		printf("Lazy allocation Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	
+	//Resume keeps the uninitialized chunks as they are
+	if(DiskDriver_resume(&disk, "test_fs_lazy.hex") != 0 
+			|| disk.free_blocks != block_number - 102
+			|| disk.header->init_chunks != 4 
+			|| DiskDriver_readBlock(&disk, dest, 2*DISK_CHUNK_BLOCKS + 7) != 0
+			|| memcmp(src, dest, BLOCK_SIZE) != 0){
+		printf("Lazy resume Error!!\n");
+		exit(-1);
+	}
+	
+	//A run never goes past the last block, padding or not
+	if(DiskDriver_getFreeExtent(&disk, block_number-10, 1, 100, &len) 
+											!= block_number-10 || len != 10
+			|| DiskDriver_getFreeBlock(&disk, block_number-10) != -1){
+		printf("Lazy extent Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	unlink("test_fs_lazy.hex");
+	
+	free(src);
+	free(dest);
+}
+
+
+void journal_test(int block_number){
+	DiskDriver disk, crashed;
+	char* src = calloc(BLOCK_SIZE, sizeof(char));
+	char* dest = calloc(BLOCK_SIZE, sizeof(char));
+	off_t home;
+	int j;
+	
+	printf("\n\nTesting metadata journal\n\n");
+	if(DiskDriver_initMode(&disk, "test_fs_journal.hex", block_number, 
+											DISK_JOURNAL) != 0){
+		printf("Journal init Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_writeBlock(&disk, src, 300);
+	DiskDriver_commit(&disk);
+	
+	//A group reaches the journal first, then its home
+	memset(src, 'J', BLOCK_SIZE);
+	DiskDriver_begin(&disk);
+	DiskDriver_writeBlock(&disk, src, 200);
+	DiskDriver_freeBlock(&disk, 300);
+	DiskDriver_end(&disk);
+	if(DiskDriver_readBlock(&disk, dest, 200) != 0 
+			|| memcmp(src, dest, BLOCK_SIZE) != 0
+			|| DiskDriver_getFreeBlock(&disk, 300) == 300){
+		printf("Journal pending group Error!!\n");
+		exit(-1);
+	}
+	home = disk.first_block_offset + (off_t)200*BLOCK_SIZE;
+	if(DiskDriver_commit(&disk) != 0 
+			|| pread(disk.fd, dest, BLOCK_SIZE, home) != BLOCK_SIZE
+			|| memcmp(src, dest, BLOCK_SIZE) != 0
+			|| DiskDriver_getFreeBlock(&disk, 300) != 300){
+		printf("Journal commit Error!!\n");
+		exit(-1);
+	}
+	
+	//Crash with a damaged home block and a group that never committed:
+	//the committed group is replayed, the other one never reaches home
+	//(its block may stay marked full, the bitmap is not journaled: 
+	//SimpleFS_resume() rebuilds it)
+	memset(dest, 'X', BLOCK_SIZE);
+	pwrite(disk.fd, dest, BLOCK_SIZE, home);
+	DiskDriver_begin(&disk);
+	DiskDriver_writeBlock(&disk, dest, 201);
+	DiskDriver_end(&disk);
+	crashed = disk;
+	if(DiskDriver_resume(&disk, "test_fs_journal.hex") != 0 
+			|| disk.journal->replayed == 0
+			|| DiskDriver_readBlock(&disk, dest, 200) != 0
+			|| memcmp(src, dest, BLOCK_SIZE) != 0
+			|| pread(disk.fd, dest, BLOCK_SIZE, home + BLOCK_SIZE) != BLOCK_SIZE
+			|| dest[0] == 'X'
+			|| DiskDriver_getFreeBlock(&disk, 300) != 300){
+		printf("Journal replay Error!!\n");
+		exit(-1);
+	}
+	close(crashed.fd);
+	
+	//Small operations are committed in groups
+	for(j=0;j<DISK_JOURNAL_GROUP;j++){
+		DiskDriver_begin(&disk);
+		DiskDriver_writeBlock(&disk, src, 1000+j);
+		DiskDriver_end(&disk);
+	}
+	if(disk.journal->commits != 1){
+		printf("Journal group commit Error!!\n");
+		exit(-1);
+	}
+	
+	//A group that waited longer than the flush interval commits at once
+	DiskDriver_setSync(&disk, DISK_SYNC_TIME, 10);
+	DiskDriver_begin(&disk);
+	DiskDriver_writeBlock(&disk, src, 1100);
+	DiskDriver_end(&disk);
+	usleep(20000);
+	DiskDriver_begin(&disk);
+	DiskDriver_writeBlock(&disk, src, 1101);
+	DiskDriver_end(&disk);
+	if(disk.journal->commits != 2 || disk.journal->num_entries != 0){
+		printf("Journal group delay Error!!\n");
+		exit(-1);
+	}
+	
+	//A group left alone commits at the next write outside operations
+	DiskDriver_begin(&disk);
+	DiskDriver_writeBlock(&disk, src, 1102);
+	DiskDriver_end(&disk);
+	usleep(20000);
+	DiskDriver_writeBlock(&disk, src, 1200);
+	if(disk.journal->commits != 3 || disk.journal->num_entries != 0){
+		printf("Journal idle group Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	unlink("test_fs_journal.hex");
+	
+	//On a shared disk the group is committed under the lock already held
+	if(DiskDriver_initMode(&disk, "test_fs_journal.hex", block_number, 
+									DISK_JOURNAL|DISK_SHARED) != 0){
+		printf("Journal shared init Error!!\n");
+		exit(-1);
+	}
+	for(j=0;j<DISK_JOURNAL_GROUP;j++){
+		DiskDriver_begin(&disk);
+		DiskDriver_writeBlock(&disk, src, 1000+j);
+		DiskDriver_end(&disk);
+	}
+	if(disk.journal->commits != 1){
+		printf("Journal shared group Error!!\n");
+		exit(-1);
+	}
+	
+	//With nothing else coming, the committer commits it by itself
+	DiskDriver_setSync(&disk, DISK_SYNC_TIME, 10);
+	DiskDriver_begin(&disk);
+	DiskDriver_writeBlock(&disk, src, 1100);
+	DiskDriver_end(&disk);
+	unsigned long commits = 1;
+	for(j=0;j<100 && commits != 2;j++){
+		usleep(10000);
+		DiskDriver_lock(DISK_LOCK(&disk, journal));
+		commits = disk.journal->commits;
+		DiskDriver_unlock(DISK_LOCK(&disk, journal));
+	}
+	if(commits != 2){
+		printf("Journal committer Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	unlink("test_fs_journal.hex");
+	
+	free(src);
+	free(dest);
+}
+
+
+void legacy_test(void){
+	DiskDriver disk;
+	int num_blocks = 1000, used = 10, i, pass; //Not a multiple of 64
+	char* block = malloc(DISK_LEGACY_BLOCK_SIZE);
+	
+	printf("\n\nTesting conversion of old disks\n\n");
+	
+	//Old layout: the number of blocks, a byte per block up to a page 
+	//boundary, then the blocks
+	int bitmap_size = sizeof(int) + num_blocks;
+	bitmap_size += PAGE_SIZE - bitmap_size%PAGE_SIZE;
+	char* old = calloc(bitmap_size, sizeof(char));
+	memcpy(old, &num_blocks, sizeof(int));
+	memset(old + sizeof(int), 1, used);
+	int fd = open("test_fs_legacy.hex", O_CREAT|O_RDWR|O_TRUNC, 0666);
+	pwrite(fd, old, bitmap_size, 0);
+	for(i=0;i<num_blocks;i++){
+		memset(block, (i < used) ? 'L'+i : 0, DISK_LEGACY_BLOCK_SIZE);
+		pwrite(fd, block, DISK_LEGACY_BLOCK_SIZE, 
+						bitmap_size + (off_t)i*DISK_LEGACY_BLOCK_SIZE);
+	}
+	close(fd);
+	
+	//Converted by the first resume, then resumed as it is: the data is there
+	for(pass=0;pass<2;pass++){
+		if(DiskDriver_resume(&disk, "test_fs_legacy.hex") != 0 
+				|| disk.free_blocks != (unsigned int)(num_blocks - used)
+				|| DiskDriver_getFreeBlock(&disk, 0) != used){
+			printf("Legacy resume Error!! (pass %d)\n", pass);
+			exit(-1);
+		}
+		for(i=0;i<used;i++){
+			if(DiskDriver_readBlock(&disk, block, i) != 0 || block[0] != 'L'+i 
+					|| block[DISK_LEGACY_BLOCK_SIZE-1] != 'L'+i){
+				printf("Legacy read Error!! (pass %d, block %d)\n", pass, i);
+				exit(-1);
+			}
+		}
+		DiskDriver_unmount(&disk);
+	}
+	
+	//The old bitmap again, with a byte that is neither 0 nor 1: refused
+	old[sizeof(int) + 3] = 7;
+	fd = open("test_fs_legacy.hex", O_RDWR);
+	pwrite(fd, old, bitmap_size, 0);
+	close(fd);
+	if(DiskDriver_resume(&disk, "test_fs_legacy.hex") != -1){
+		printf("Legacy damaged Error!!\n");
+		exit(-1);
+	}
+	unlink("test_fs_legacy.hex");
+	free(old);
+	free(block);
+}
+
+
+void sync_test(int block_number){
+	DiskDriver disk;
+	char* src = calloc(BLOCK_SIZE, sizeof(char));
+	struct timespec begin, end;
+	int policies[3] = {DISK_SYNC_CLOSE, DISK_SYNC_OPS, DISK_SYNC_TIME};
+	unsigned int intervals[3] = {0, 1000, 10};
+	const char* names[3] = {"at close", "every 1000 blocks", "every 10 ms"};
+	int i, j;
+	
+	printf("\n\nTesting flush policies\n\n");
+	if(DiskDriver_initMode(&disk, "test_fs_sync.hex", block_number, 
+											DISK_LAZY) != 0){
+		printf("Sync init Error!!\n");
+		exit(-1);
+	}
+	
+	//Adjacent blocks share a range, the bitmap page has its own
+	for(j=10;j<20;j++) DiskDriver_writeBlock(&disk, src, j);
+	DiskDriver_writeBlock(&disk, src, 1000);
+	if(disk.num_dirty != 3 || DiskDriver_sync(&disk) != 0 
+			|| disk.num_dirty != 0 || disk.syncs != 1){
+		printf("Sync ranges Error!!\n");
+		exit(-1);
+	}
+	
+	//Too many ranges: the closest ones are merged
+	for(j=0;j<4*DISK_DIRTY_RANGES;j++) 
+		DiskDriver_writeBlock(&disk, src, 2000 + j*64 + (j%3)*512);
+	if(disk.num_dirty > DISK_DIRTY_RANGES){
+		printf("Sync merge Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_sync(&disk);
+	
+	//The driver flushes by itself every interval blocks
+	DiskDriver_setSync(&disk, DISK_SYNC_OPS, 8);
+	for(j=0;j<8;j++) DiskDriver_writeBlock(&disk, src, 100+j);
+	if(disk.syncs != 3 || disk.num_dirty != 0){
+		printf("Sync policy Error!!\n");
+		exit(-1);
+	}
+	
+	//Same workload, flushed at different rates
+	for(i=0;i<3;i++){
+		DiskDriver_setSync(&disk, policies[i], intervals[i]);
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for(j=0;j<20000;j++) DiskDriver_writeBlock(&disk, src, 10000+j);
+		DiskDriver_sync(&disk);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		printf("Flush %-18s %8.3f ms\n", names[i], 
+			(end.tv_sec-begin.tv_sec)*1e3 + (end.tv_nsec-begin.tv_nsec)/1e6);
+	}
+	
+	//Without flushes the disk is never marked clean
+	DiskDriver_setSync(&disk, DISK_SYNC_NONE, 0);
+	DiskDriver_unmount(&disk);
+	if(DiskDriver_resume(&disk, "test_fs_sync.hex") != 0 
+			|| disk.chunk_free[0] == DISK_CHUNK_UNKNOWN){
+		printf("Sync none Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	unlink("test_fs_sync.hex");
+	free(src);
+}
+
+
+typedef struct {
+	DiskDriver* disk;
+	int first, count; // blocks of the thread
+	int errors;
+} SharedWork;
+
+void* shared_worker(void* arg){
+	SharedWork* work = (SharedWork*)arg;
+	char* src = calloc(BLOCK_SIZE, sizeof(char));
+	char* dest = calloc(BLOCK_SIZE, sizeof(char));
+	int round, j;
+	
+	for(round=0;round<4;round++){
+		for(j=0;j<work->count;j++){
+			memset(src, (work->first+j+round) & 0xFF, BLOCK_SIZE);
+			DiskDriver_writeBlock(work->disk, src, work->first+j);
+		}
+		for(j=0;j<work->count;j++){
+			memset(src, (work->first+j+round) & 0xFF, BLOCK_SIZE);
+			const char* pinned = DiskDriver_pinBlock(work->disk, work->first+j);
+			if(DiskDriver_readBlock(work->disk, dest, work->first+j) != 0 
+					|| memcmp(src, dest, BLOCK_SIZE) != 0
+					|| pinned == NULL || pinned[BLOCK_SIZE-1] != src[0]) 
+				work->errors++;
+			DiskDriver_unpinBlock(work->disk, pinned);
+		}
+		for(j=0;j<work->count;j+=2) 
+			DiskDriver_freeBlock(work->disk, work->first+j);
+	}
+	free(src);
+	free(dest);
+	return NULL;
+}
+
+
+void shared_test(void){
+	DiskDriver disk;
+	int modes[2] = {DISK_LAZY|DISK_SHARED, DISK_LAZY|DISK_SHARED|DISK_WHOLE_MAP};
+	int block_number = 300000, threads = 8, count = 4000;
+	pthread_t tid[threads];
+	SharedWork work[threads];
+	int m, t;
+	
+	printf("\n\nTesting shared disk\n\n");
+	for(m=0;m<2;m++){
+		if(DiskDriver_initMode(&disk, "test_fs_shared.hex", block_number, 
+												modes[m]) != 0){
+			printf("Shared init Error!!\n");
+			exit(-1);
+		}
+		
+		//Threads share chunks, windows and lazy initialization
+		for(t=0;t<threads;t++){
+			work[t].disk = &disk;
+			work[t].first = t*(count+1000) + (t%2)*DISK_CHUNK_BLOCKS;
+			work[t].count = count;
+			work[t].errors = 0;
+			pthread_create(&tid[t], NULL, shared_worker, &work[t]);
+		}
+		for(t=0;t<threads;t++){
+			pthread_join(tid[t], NULL);
+			if(work[t].errors != 0){
+				printf("Shared block Error!! (%s, thread %d)\n", 
+										disk.backend->name, t);
+				exit(-1);
+			}
+		}
+		if(DiskDriver_countFree(&disk) != block_number - threads*count/2){
+			printf("Shared free blocks Error!! (%s)\n", disk.backend->name);
+			exit(-1);
+		}
+		printf("%d threads on %s: %lu window hits, %lu misses\n", threads, 
+				disk.backend->name, disk.window_hits, disk.window_misses);
+		DiskDriver_unmount(&disk);
+	}
+	unlink("test_fs_shared.hex");
+}
+
+
+typedef struct {
+	DiskDriver* disk;
+	int count;
+	int* blocks; // got by the thread
+} AllocWork;
+
+void* alloc_worker(void* arg){
+	AllocWork* work = (AllocWork*)arg;
+	int i;
+	for(i=0;i<work->count;i++) 
+		work->blocks[i] = DiskDriver_allocBlock(work->disk, DISK_NO_HINT);
+	return NULL;
+}
+
+
+void alloc_test(void){
+	DiskDriver disk;
+	int block_number = 300000, total = 160000, max_threads = 8;
+	pthread_t tid[max_threads];
+	AllocWork work[max_threads];
+	struct timespec begin, end;
+	double ms, first = 0;
+	int threads, t, i;
+	char* taken = malloc(block_number);
+	int* blocks = malloc(total*sizeof(int));
+	
+	printf("\n\nTesting concurrent allocation\n\n");
+	for(threads=1;threads<=max_threads;threads*=2){
+		if(DiskDriver_initMode(&disk, "test_fs_alloc.hex", block_number, 
+									DISK_LAZY|DISK_SHARED) != 0){
+			printf("Alloc init Error!!\n");
+			exit(-1);
+		}
+		
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		for(t=0;t<threads;t++){
+			work[t].disk = &disk;
+			work[t].count = total/threads;
+			work[t].blocks = blocks + t*(total/threads);
+			pthread_create(&tid[t], NULL, alloc_worker, &work[t]);
+		}
+		for(t=0;t<threads;t++) pthread_join(tid[t], NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		
+		//Every block given once, and counted as full
+		memset(taken, 0, block_number);
+		for(i=0;i<total;i++){
+			if(blocks[i] < 0 || taken[blocks[i]] 
+					|| DiskDriver_bitmapGet(&disk, blocks[i]) != 1){
+				printf("Alloc duplicate Error!! (%d threads)\n", threads);
+				exit(-1);
+			}
+			taken[blocks[i]] = 1;
+		}
+		if(DiskDriver_countFree(&disk) != block_number - total){
+			printf("Alloc free blocks Error!! (%d threads)\n", threads);
+			exit(-1);
+		}
+		
+		ms = (end.tv_sec-begin.tv_sec)*1e3 + (end.tv_nsec-begin.tv_nsec)/1e6;
+		if(threads == 1) first = ms;
+		printf("%d threads: %8.3f ms, %6.2f Mblocks/s, speedup %.2f\n", 
+						threads, ms, total/ms/1e3, first/ms);
+		DiskDriver_unmount(&disk);
+	}
+	unlink("test_fs_alloc.hex");
+	free(taken);
+	free(blocks);
+}
+
+
 void resume_test(DiskDriver disk, int block_number){
 	printf("\n\nTesting disk resumation\n\n");
 	
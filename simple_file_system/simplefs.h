@@ -5,23 +5,61 @@
 
 /*these are structures stored on disk*/
 
+// block pointers and sizes stored on disk. Build with -DSFS_WIDE for the
+// 64-bit format: files can be bigger than 2 GiB, and pointers reach 
+// any block the driver can address. The format is stored in the 
+// superblock (fs_flags), and SimpleFS_resume() refuses the other one
+#ifdef SFS_WIDE
+typedef int64_t sfs_block_t;
+typedef int64_t sfs_size_t;
+#define SFS_FLAGS SFS_FLAG_WIDE
+#define SFS_POINTER_SIZE 8 // sizeof(sfs_block_t), for the preprocessor
+#else
+typedef int sfs_block_t;
+typedef int sfs_size_t;
+#define SFS_FLAGS 0
+#define SFS_POINTER_SIZE 4
+#endif
+#define SFS_FLAG_WIDE 0x1 // fs_flags: 64-bit pointers and sizes
+#define SFS_FLAG_INDEXED 0x2 // fs_flags: files have a block map in their fcb
+#define SFS_FLAG_TAIL 0x4 // fs_flags: fcbs keep the tail (last_block, last_fill)
+#define SFS_NO_BLOCK ((sfs_block_t)-1) // end of a chain, empty dir entry
+
+// Biggest block a disk can have for this build: the structures below are
+// that big in memory, and a block of the disk is the first block_size 
+// bytes of them (chosen by SimpleFS_formatFlags(), kept in the superblock).
+// Every count that depends on it is in the SimpleFS (see SimpleFS_layout())
+#ifndef SFS_MAX_BLOCK_SIZE
+#if BLOCK_SIZE > 4096
+#define SFS_MAX_BLOCK_SIZE BLOCK_SIZE
+#else
+#define SFS_MAX_BLOCK_SIZE 4096
+#endif
+#endif
+#if SFS_MAX_BLOCK_SIZE < BLOCK_SIZE || SFS_MAX_BLOCK_SIZE > DISK_MAX_BLOCK_SIZE \
+						|| (SFS_MAX_BLOCK_SIZE & (SFS_MAX_BLOCK_SIZE-1)) != 0
+#error "SFS_MAX_BLOCK_SIZE has to be a power of 2 from BLOCK_SIZE to 65536"
+#endif
+
 // header, occupies the first portion of each block in the disk
 // represents a chained list of blocks
 typedef struct {
-  int previous_block; // chained list (previous block)
-  int next_block;     // chained list (next_block)
-  int block_in_file; // position in the file, if 0 we have a file control block
+  sfs_block_t previous_block; // chained list (previous block)
+  sfs_block_t next_block;     // chained list (next_block)
+  sfs_block_t block_in_file; // position in the file, if 0 we have a file control block
 } BlockHeader;
 
 
 // this is in the first block of a chain, after the header
 typedef struct {
-  int directory_block; // first block of the parent directory
-  int block_in_disk;   // repeated position of the block on the disk
+  sfs_block_t directory_block; // first block of the parent directory
+  sfs_block_t block_in_disk;   // repeated position of the block on the disk
   char name[128];
-  int  size_in_bytes;
-  int size_in_blocks;
+  sfs_size_t size_in_bytes;
+  sfs_size_t size_in_blocks;
   int is_dir;          // 0 for file, 1 for dir
+  sfs_block_t last_block; // tail of a file: its last block (the fcb if none)...
+  int last_fill;          // ...and the bytes of the file in it
 } FileControlBlock;
 
 // this is the first physical block of a file
@@ -33,14 +71,14 @@ typedef struct {
 typedef struct {
   BlockHeader header;
   FileControlBlock fcb;
-  char data[BLOCK_SIZE-sizeof(FileControlBlock) 
+  char data[SFS_MAX_BLOCK_SIZE-sizeof(FileControlBlock) 
 			- sizeof(BlockHeader)];
 } FirstFileBlock;
 
 // this is one of the next physical blocks of a file
 typedef struct {
   BlockHeader header;
-  char  data[BLOCK_SIZE-sizeof(BlockHeader)];
+  char  data[SFS_MAX_BLOCK_SIZE-sizeof(BlockHeader)];
 } FileBlock;
 
 // this is the first physical block of a directory
@@ -48,18 +86,43 @@ typedef struct {
   BlockHeader header;
   FileControlBlock fcb;
   int num_entries;
-  int file_blocks[ ((BLOCK_SIZE
+  sfs_block_t file_blocks[ ((SFS_MAX_BLOCK_SIZE
 		   -sizeof(BlockHeader)
 		   -sizeof(FileControlBlock)
-		    -sizeof(int))/sizeof(int))];
+		    -sizeof(sfs_block_t))/sizeof(sfs_block_t))];
 } FirstDirectoryBlock;
 
 // this is remainder block of a directory
 typedef struct {
   BlockHeader header;
-  int file_blocks[ ((BLOCK_SIZE
-			-sizeof(BlockHeader))/sizeof(int))];
+  sfs_block_t file_blocks[ ((SFS_MAX_BLOCK_SIZE
+			-sizeof(BlockHeader))/sizeof(sfs_block_t))];
 } DirectoryBlock;
+
+// indexed layout (SFS_FLAG_INDEXED, chosen by SimpleFS_formatFlags()):
+// the data of a FirstFileBlock holds the map of the file instead of its
+// first bytes: map_direct pointers to the first data blocks, then the
+// roots of map_levels trees of index blocks, 1, 2, ... map_levels levels 
+// deep (SFS_NO_BLOCK if none). Data blocks keep their headers.
+// With P = block_size/SFS_POINTER_SIZE pointers per index block, the map
+// names map_direct + P + P^2 + ... + P^map_levels blocks: the levels are
+// as many as needed to cover a whole disk (DISK_MAX_BLOCKS), i.e. 5 with
+// 512 byte blocks (6 with -DSFS_WIDE), 4 with 4 KiB blocks
+#define SFS_LEVELS(ptrs) (((ptrs) >= 2048) ? 3 : ((ptrs) >= 256) ? 4 \
+									: ((ptrs) >= 128) ? 5 : 6)
+#define SFS_MAX_MAP_LEVELS SFS_LEVELS(DISK_MIN_BLOCK_SIZE/SFS_POINTER_SIZE)
+#define SFS_MAX_MAP_PTRS (SFS_MAX_BLOCK_SIZE/sizeof(sfs_block_t))
+
+// the same counts for BLOCK_SIZE blocks (the default of SimpleFS_format())
+#define SFS_MAP_LEVELS SFS_LEVELS(BLOCK_SIZE/SFS_POINTER_SIZE)
+#define SFS_MAP_PTRS (BLOCK_SIZE/sizeof(sfs_block_t))
+#define SFS_MAP_DIRECT ((BLOCK_SIZE-sizeof(FileControlBlock) \
+			-sizeof(BlockHeader))/sizeof(sfs_block_t) - SFS_MAP_LEVELS)
+
+// an index block: data blocks, or index blocks one level down
+typedef struct {
+  sfs_block_t blocks[SFS_MAX_MAP_PTRS];
+} IndexBlock;
 /******************* stuff on disk END *******************/
 
 
@@ -81,6 +144,15 @@ typedef struct {
   DiskDriver* disk;
   unsigned int current_directory_block;	  // index of the dir block currently accessed
   char diskname[128];
+  
+  //layout of the disk, from its block size (see SimpleFS_layout())
+  int f_file_block_offset;  // bytes of data in a FirstFileBlock...
+  int file_block_offset;    // ...and in a FileBlock
+  int f_dir_block_offset;   // entries in a FirstDirectoryBlock...
+  int dir_block_offset;     // ...and in a DirectoryBlock
+  int map_ptrs;             // indexed files: pointers in an IndexBlock,
+  int map_direct;           // data blocks named by the fcb itself,
+  int map_levels;           // and trees of index blocks after them
 } SimpleFS;
 
 // this is a file handle, used to refer to open files
@@ -88,10 +160,12 @@ typedef struct {
   SimpleFS* sfs;                 // pointer to memory file system structure
   unsigned int fcb;              // index of the first block of the file(read it)
   unsigned int parent_dir;  	 // index of the directory where the file is stored
-  
-  //fields below were deprecated due to no use in this implementation.
-  //unsigned int current_block;   
-  //unsigned int pos_in_file;       
+  unsigned int readahead;        // blocks read ahead by the last read, 0 if none
+  unsigned int pool_start;       // first block reserved for the next writes
+  unsigned int pool_len;         // reserved blocks left, released by SimpleFS_close()
+  sfs_size_t pos_in_file;        // cursor of SimpleFS_read()/_write()/_seek()
+  unsigned int current_index;    // data block met last (block_in_file-1)...
+  unsigned int current_block;    // ...and where it is, 0xFFFFFFFF if none yet
 } FileHandle;
 
 typedef struct {
@@ -105,6 +179,25 @@ typedef struct {
   //unsigned int pos_in_block;    
 } DirectoryHandle;
 
+// index block loaded by a FileWalk, written back if dirty
+typedef struct {
+  unsigned int block;  // 0xFFFFFFFF if none
+  int dirty;
+  IndexBlock data;
+} MapCache;
+
+// a walk through the data blocks of a file, from the first on: the next
+// block of the chain, or the index blocks of the map met last
+typedef struct {
+  SimpleFS* sfs;
+  FirstFileBlock* ffb;   // fcb of the file (the map of an indexed file)
+  unsigned int index;    // next data block (block_in_file-1)
+  sfs_block_t next;      // chained files: where it is, SFS_NO_BLOCK at the end
+  sfs_block_t prev;      // the block before it (the fcb for the first one)
+  int guess;             // chained files: see SimpleFS_readChain()
+  MapCache cache[SFS_MAX_MAP_LEVELS]; // indexed files: one per level, 0 points to data
+} FileWalk;
+
 
 /*** Design modifications:
  * I want every function in this library to return a status int.
@@ -120,16 +213,38 @@ typedef struct {
  * ***/
  
  
-//These global constants are really useful to shorten code 
+//These global constants are really useful to shorten code.
+//They are the layout of BLOCK_SIZE blocks (the default of SimpleFS_format()):
+//the FS itself goes by the counts of its disk, in the SimpleFS
 const int F_FILE_BLOCK_OFFSET = BLOCK_SIZE-sizeof(FileControlBlock) 
 			- sizeof(BlockHeader);
 const int FILE_BLOCK_OFFSET = BLOCK_SIZE-sizeof(BlockHeader);
 const int F_DIR_BLOCK_OFFSET = (BLOCK_SIZE
 		   -sizeof(BlockHeader)
 		   -sizeof(FileControlBlock)
-		    -sizeof(int))/sizeof(int) ;
+		    -sizeof(sfs_block_t))/sizeof(sfs_block_t) ;
 const int DIR_BLOCK_OFFSET = (BLOCK_SIZE
-			-sizeof(BlockHeader))/sizeof(int);
+			-sizeof(BlockHeader))/sizeof(sfs_block_t);
+
+//Bytes the fcbs of disks made before SFS_FLAG_TAIL lacked (last_block, 
+//last_fill and the padding): what came after them began that much earlier
+#define SFS_TAIL_SHIFT (sizeof(FileControlBlock) \
+			- offsetof(FileControlBlock, last_block))
+
+//Max number of blocks moved by a single vectored disk call
+#define SFS_BATCH 64
+
+//Max number of blocks read ahead (DiskDriver_prefetch()) of a sequential 
+//read. The depth begins at SFS_BATCH and doubles while the chain is adjacent
+#ifndef SFS_READAHEAD
+#define SFS_READAHEAD 2048
+#endif
+
+//Min number of blocks a growing file reserves at once (its handle's pool):
+//next writes take them without looking at the bitmap, one after another
+#ifndef SFS_POOL
+#define SFS_POOL 64
+#endif
 			
 // initializes a file system on an already made disk
 // returns for side effect a handle to the top level directory 
@@ -139,9 +254,39 @@ void SimpleFS_init(SimpleFS* fs, DirectoryHandle* dest_handle);
 // creates the inital structures, the top level directory
 // has name "/" and its control block is in the first position
 // it also clears the bitmap of occupied blocks on the disk
-// and set to the top level directory
+// (lazily: DISK_LAZY, so even huge disks take no time)
+// and set to the top level directory.
+// The disk gets a journal (DISK_JOURNAL): the dir and fcb blocks of
+// creations and removals are replayed after a crash, so a dir never
+// points to a half-written fcb. The bitmap is not journaled: 
+// SimpleFS_resume() rebuilds it from the tree after a crash.
+// Blocks are BLOCK_SIZE bytes (see SimpleFS_formatFlags() for others)
 int SimpleFS_format(SimpleFS* fs, const char* diskname, int num_blocks);
 
+// same as SimpleFS_format(), but the disk is opened with the DISK_* flags
+// in mode (i.e. DISK_ASYNC, to queue the blocks of reads and writes)
+int SimpleFS_formatMode(SimpleFS* fs, const char* diskname, 
+										int num_blocks, int mode);
+
+// same as SimpleFS_formatMode(), with blocks of block_size bytes (a power
+// of 2 from DISK_MIN_BLOCK_SIZE to SFS_MAX_BLOCK_SIZE) and the layout of 
+// files in fs_flags: SFS_FLAG_INDEXED gives every file a block map (direct
+// blocks, then trees of index blocks up to map_levels deep), so any block
+// is found in a few reads instead of walking the chain. Both are kept by
+// the disk. Bigger blocks waste less space on headers and make chains shorter
+int SimpleFS_formatFlags(SimpleFS* fs, const char* diskname, int num_blocks,
+				unsigned int block_size, int mode, unsigned int fs_flags);
+
+// opens an already formatted disk with the DISK_* flags in mode.
+// Its block size comes from the superblock: a disk with blocks bigger than
+// SFS_MAX_BLOCK_SIZE is closed and -1 returned.
+// A disk made before fcbs kept their tail (no SFS_FLAG_TAIL) is upgraded
+// first, every fcb and dir rewritten (see upgradeDir()): the disk is 
+// closed and -1 returned only if that fails, leaving it half rewritten.
+// A journaled disk not cleanly unmounted gets its bitmap rebuilt from 
+// the tree (SimpleFS_recover()), so a crash leaks no block
+int SimpleFS_resume(SimpleFS* fs, const char* diskname, int mode);
+
 // creates an empty file in the directory d
 // returns -1 on error (file existing)
 // returns -2 on error (no free blocks)
@@ -158,24 +303,49 @@ int SimpleFS_readDir(char* names, DirectoryHandle* d);
 int SimpleFS_openFile(DirectoryHandle* d, const char* filename, 
 											FileHandle* dest_handle);
 
-// closes a file handle (destroyes it)
-//int SimpleFS_close(FileHandle* f);
-//No more needed!
+// closes a file handle: blocks it reserved for writes and didn't use
+// are given back (handles are copied freely, close the one written with).
+// Reservations are kept in memory only, so a handle never closed leaks 
+// nothing on the disk: they end at unmount anyway
+// returns 0 on success, -1 on error
+int SimpleFS_close(FileHandle* f);
 
 // writes in the file, at current position for size bytes stored in data
-// overwriting and allocating new space if necessary
+// overwriting and allocating new space if necessary, then moves the 
+// position after them (SimpleFS_pwrite() at pos_in_file). New blocks come from
+// the pool of the handle, refilled with runs of at least SFS_POOL blocks
+// right after the end of the file: writers on different files don't 
+// look for free blocks in the same place, and each file stays adjacent
 // returns the number of bytes written
 int SimpleFS_write(FileHandle* f, void* src_data, int size);
 
-// reads in the file, at current position size bytes stored in data
-// returns the number of bytes read
+// reads in the file, at current position size bytes stored in data,
+// then moves the position after them (SimpleFS_pread() at pos_in_file)
+// returns the number of bytes read (less at the end of the file).
+// While the chain goes on in adjacent blocks, the next ones are read
+// ahead in the background, deeper and deeper (up to SFS_READAHEAD)
 int SimpleFS_read(FileHandle* f, void* dst_data, int size);
 
-// returns the number of bytes read (moving the current pointer to pos)
+// same as SimpleFS_write() and SimpleFS_read(), at byte pos of the file,
+// leaving the current position alone. pos can be the end of the file
+// (appending), not past it. The handle remembers the data block met last
+// (current_index, current_block): in a chained file the next access
+// walks on from there if it is not before it, instead of from the fcb
+// returns the number of bytes written/read, -1 on error
+int SimpleFS_pwrite(FileHandle* f, void* src_data, int size, sfs_size_t pos);
+int SimpleFS_pread(FileHandle* f, void* dst_data, int size, sfs_size_t pos);
+
+// writes size bytes of src_data at the end of the file, and moves the
+// current position after them. The fcb knows the last block of the file
+// (last_block, last_fill): it goes straight there, whatever the length
+// of the chain, and only the tail and the new blocks are written
+// returns the number of bytes written, -1 on error
+int SimpleFS_append(FileHandle* f, void* src_data, int size);
+
+// moves the current position to pos
 // returns pos on success
 // -1 on error (file too short)
-//int SimpleFS_seek(FileHandle* f, int pos); 
-//Unuseful in this implementation
+sfs_size_t SimpleFS_seek(FileHandle* f, sfs_size_t pos);
 
 // seeks for a directory in d. If dirname is equal to ".." it goes one level up
 // 0 on success, negative value on error
@@ -195,17 +365,143 @@ int SimpleFS_mkDir(DirectoryHandle* d, char* dirname);
 int SimpleFS_remove(void* handle);
 
 /*** Auxiliary Funcions ***/
+//Fills in the counts of the layout of fs (f_file_block_offset... map_levels)
+//from the block size of its disk, by _formatFlags() and _resume()
+void SimpleFS_layout(SimpleFS* fs);
+
 //It calculates free space, reading the bitmap iteratively with DiskDriver_getFreeBlock()
 int SimpleFS_checkFreeSpace(SimpleFS* fs);
 
+//Bodies of SimpleFS_createFile() and SimpleFS_remove(), which wrap them 
+//in a single journaled operation (DiskDriver_begin()/_end()).
+//createFile() puts the fcb in the first free block from goal: files go
+//right after their dir, new dirs in a group of their own
+int createFile(DirectoryHandle* d, const char* filename, 
+							FileHandle* dest_handle, unsigned int goal);
+int remHandle(void* handle);
+
 //This function is part of the remove funcition.
 //It frees every block that is in a file.
 int remFile(SimpleFS*, int file_index);
 
+//This function is part of the remove funcition.
+//It frees an index block of height levels and what it points to.
+int remIndex(SimpleFS* fs, sfs_block_t block, int height);
+
+//These are part of SimpleFS_resume(), for a disk made before SFS_FLAG_TAIL.
+//upgradeDir() rewrites the dcb of dir_index in the layout of today, the 
+//entries that don't fit in it anymore moved to the remainders, then
+//every file and dir in it. upgradeFile() moves the bytes of a chained file 
+//SFS_TAIL_SHIFT on in every block (a block more if the last is full), or
+//builds the map of an indexed one again, and fills in its tail.
+//Not journaled: a crash in the middle leaves the disk half rewritten.
+//returns 0 on success, -1 on error
+int upgradeDir(SimpleFS* fs, int dir_index);
+int upgradeFile(SimpleFS* fs, int file_index);
+
+//This function is part of upgradeFile().
+//It appends the data blocks below the old index block (height levels)
+//to blocks (n so far, at most max), then frees it.
+int upgradeIndex(SimpleFS* fs, sfs_block_t block, int height, 
+							unsigned int* blocks, int* n, int max);
+
+//This is part of SimpleFS_resume(), for a journaled disk not cleanly
+//unmounted. The bitmap is not journaled: blocks taken by a group lost in
+//the crash stay marked full, blocks written back before their bitmap
+//words may look empty. The bitmap is rebuilt from the tree the journal
+//kept: every block reached from the top dir is marked in used (and full
+//if it looked empty), then every other full block is freed. A chained
+//file keeps the blocks its fcb counts, a chain going on is cut there.
+//returns the number of blocks freed, -1 if the tree is damaged (nothing
+//is freed then)
+int SimpleFS_recover(SimpleFS* fs);
+
+//These functions are part of SimpleFS_recover(). recoverMark() marks
+//block in used, -1 if it is not on the disk or was met already. 
+//recoverEntry() marks a dir entry and goes into it, the others go 
+//through what is in a dir, a file and an index block of height levels
+int recoverMark(SimpleFS* fs, sfs_block_t block, uint64_t* used);
+int recoverEntry(SimpleFS* fs, sfs_block_t block, uint64_t* used);
+int recoverDir(SimpleFS* fs, sfs_block_t dir_index, uint64_t* used);
+int recoverFile(SimpleFS* fs, sfs_block_t file_index, uint64_t* used);
+int recoverIndex(SimpleFS* fs, sfs_block_t block, int height, uint64_t* used);
+
+//This function is part of the remove funcition.
+//The last dir remainder was freed: block prev (the dcb, or the remainder
+//before it) becomes the end of the chain. A dcb is only updated in upper
+int detachRem(SimpleFS* fs, FirstDirectoryBlock* upper, int prev);
+
 //This function is part of the remove funcition.
 //It frees every file or sub-dir in its array and then deletes dir itself.
 int remDir(SimpleFS* fs, int dir_index);
 
+//This function is part of the remove funcition.
+//It removes count files or dirs of a dir array, reading their fcbs at once.
+int remEntries(SimpleFS* fs, sfs_block_t* entries, int count);
+
+//Reads up to max (<= SFS_BATCH) blocks of a chain, from block first on.
+//Blocks are guessed to be adjacent on disk and read with a single
+//DiskDriver_readBlocks(), then the guess is checked with their headers.
+//guess is the number of blocks to try, updated for the next call.
+//returns the number of blocks of the chain read in dest (and 
+//their indexes in block_nums), -1 on error
+int SimpleFS_readChain(SimpleFS* fs, int first, FileBlock* dest, 
+				unsigned int* block_nums, int max, int* guess);
+
+//1 if files have a block map (SFS_FLAG_INDEXED), and the bytes of a file
+//kept in its fcb block (none in that case)
+int SimpleFS_indexed(SimpleFS* fs);
+int SimpleFS_head(SimpleFS* fs);
+
+//Walks through the data blocks of the file of ffb: _walkRead() reads up
+//to max (<= SFS_BATCH) of them in dest, returns how many (0 at the end
+//of the file, -1 on error). _walkAppend() makes block_num the next one
+//(in the map, the chain is linked by the headers). _walkClose() writes 
+//back the index blocks changed. The map itself is in ffb
+void SimpleFS_walkBegin(FileWalk* w, SimpleFS* fs, FirstFileBlock* ffb);
+int SimpleFS_walkRead(FileWalk* w, FileBlock* dest, 
+						unsigned int* block_nums, int max);
+int SimpleFS_walkAppend(FileWalk* w, unsigned int block_num);
+int SimpleFS_walkClose(FileWalk* w);
+
+//Moves the walk one data block on, without reading it (the map, or the
+//pinned header of the block in the chain). returns the block, -1 at the
+//end of the file
+int SimpleFS_walkNext(FileWalk* w);
+
+//Moves the walk to data block index (it may be the end of the file).
+//Chained files are followed through the headers of the blocks (pinned, 
+//not copied), from data block from_index in from_block if it is not 
+//past index (0xFFFFFFFF if unknown), or from the tail of the fcb 
+//(last_block) if it is closer. returns -1 if the file is shorter
+int SimpleFS_walkSeek(FileWalk* w, unsigned int index, 
+						unsigned int from_index, unsigned int from_block);
+
+//Makes next the block after block_num in its chain (next_block)
+//returns 0 on success, -1 on error
+int SimpleFS_link(SimpleFS* fs, unsigned int block_num, unsigned int next);
+
+//Takes count new blocks for the file of f (in order, in blocks) from
+//its pool, refilling it when empty with a run right after the last block
+//taken (goal for the first), as long as the rest and at least SFS_POOL.
+//returns 0 on success, -1 if the disk is full (nothing stays taken)
+int SimpleFS_reserve(FileHandle* f, unsigned int goal, unsigned int* blocks,
+																int count);
+
+//Pointer to the entry of data block index in the map, loading the index
+//blocks on the way (and making the missing ones if create).
+//NULL past the biggest file, or if an index block is missing or unreadable
+sfs_block_t* SimpleFS_mapSlot(FileWalk* w, unsigned int index, int create);
+
+//Loads index block block_num in the cache of level (fresh: a new one,
+//every entry SFS_NO_BLOCK), writing back the one it replaces
+int SimpleFS_mapLoad(FileWalk* w, int level, unsigned int block_num, 
+														int fresh);
+
+//Copies the name in the fcb of block file_index in dest (128 bytes).
+//The fcb is pinned (DiskDriver_pinBlock()) instead of read
+int SimpleFS_readName(SimpleFS* fs, int file_index, char* dest);
+
 /*** Function implementation ***/
 void SimpleFS_init(SimpleFS* fs, DirectoryHandle* dest_handle){
 	
@@ -217,33 +513,57 @@ void SimpleFS_init(SimpleFS* fs, DirectoryHandle* dest_handle){
 
 
 int SimpleFS_format(SimpleFS* fs, const char* diskname, int num_blocks){
+	return SimpleFS_formatMode(fs, diskname, num_blocks, DISK_LAZY|DISK_JOURNAL);
+}
+
+
+int SimpleFS_formatMode(SimpleFS* fs, const char* diskname, 
+										int num_blocks, int mode){
+	return SimpleFS_formatFlags(fs, diskname, num_blocks, BLOCK_SIZE, mode, 0);
+}
+
+
+int SimpleFS_formatFlags(SimpleFS* fs, const char* diskname, int num_blocks,
+				unsigned int block_size, int mode, unsigned int fs_flags){
+	
+	if(block_size > SFS_MAX_BLOCK_SIZE){
+		printf("Blocks can be up to %d bytes (-DSFS_MAX_BLOCK_SIZE=%u)\n", 
+										SFS_MAX_BLOCK_SIZE, block_size);
+		return -1;
+	}
 	
 	//Creates disk file and initializes bitmap
-	int res = DiskDriver_init(fs->disk, diskname, num_blocks);
+	int res = DiskDriver_initGeometry(fs->disk, diskname, num_blocks, 
+														block_size, mode);
 	if (res!=0) {
 		printf("Error in formatting!\n");
 		return -1;
 	}
 	
+	SimpleFS_layout(fs);
 	fs->current_directory_block = 0; //set on top dir
 	strncpy(fs->diskname, diskname, sizeof(char)*128);
+	fs->disk->header->fs_flags = SFS_FLAGS | SFS_FLAG_TAIL 
+									| (fs_flags & SFS_FLAG_INDEXED);
 	
 	BlockHeader top_header;
 	FileControlBlock top_fcb;
 	FirstDirectoryBlock top_dir;
 	
 	//Building BlockHeader
-	top_header.previous_block = 0xFFFFFFFF;
-	top_header.next_block = 0xFFFFFFFF;
+	top_header.previous_block = SFS_NO_BLOCK;
+	top_header.next_block = SFS_NO_BLOCK;
 	top_header.block_in_file = 0;
 	
 	//Building FileControlBlock
-	top_fcb.directory_block = 0xFFFFFFFF; //Because top dir has no parent
+	top_fcb.directory_block = SFS_NO_BLOCK; //Because top dir has no parent
 	top_fcb.block_in_disk = 0; //Fixed index for this implementation
 	strncpy(top_fcb.name, "/", 128*sizeof(char));
 	top_fcb.size_in_bytes = 0; //I assume that a dir has no size
 	top_fcb.size_in_blocks = 1; //Will be updated if remainder blocks are added
 	top_fcb.is_dir = 1;
+	top_fcb.last_block = 0;
+	top_fcb.last_fill = 0;
 	
 	//Building FirstDirectoryBlock
 	top_dir.header = top_header;
@@ -251,7 +571,7 @@ int SimpleFS_format(SimpleFS* fs, const char* diskname, int num_blocks){
 	top_dir.num_entries = 0;
 	
 	int i;
-	for(i=0;i<F_DIR_BLOCK_OFFSET;i++) top_dir.file_blocks[i] = 0xFFFFFFFF;
+	for(i=0;i<fs->f_dir_block_offset;i++) top_dir.file_blocks[i] = SFS_NO_BLOCK;
 	
 	//Writing down to file!!!
 	res = DiskDriver_writeBlock(fs->disk, &top_dir, 0);
@@ -263,8 +583,471 @@ int SimpleFS_format(SimpleFS* fs, const char* diskname, int num_blocks){
 }
 
 
+int SimpleFS_resume(SimpleFS* fs, const char* diskname, int mode){
+	
+	if(DiskDriver_resumeMode(fs->disk, diskname, mode) != 0) return -1;
+	
+	if(fs->disk->block_size > SFS_MAX_BLOCK_SIZE){
+		printf("Disk has %u byte blocks, but this FS is built for blocks up\
+ to %d bytes (-DSFS_MAX_BLOCK_SIZE=%u)\n", fs->disk->block_size, 
+							SFS_MAX_BLOCK_SIZE, fs->disk->block_size);
+		DiskDriver_unmount(fs->disk);
+		return -1;
+	}
+	if((fs->disk->header->fs_flags & ~(SFS_FLAG_INDEXED|SFS_FLAG_TAIL)) 
+														!= SFS_FLAGS){
+		printf("Disk has %s block pointers, but this FS is built for %s\
+ ones (-DSFS_WIDE)\n", (fs->disk->header->fs_flags & SFS_FLAG_WIDE) ? 
+			"64-bit" : "32-bit", (SFS_FLAGS & SFS_FLAG_WIDE) ? "64-bit" : "32-bit");
+		DiskDriver_unmount(fs->disk);
+		return -1;
+	}
+	SimpleFS_layout(fs);
+	
+	//Made before fcbs kept the tail of their file: the tree is rewritten
+	//from the top dir, and the flag set only once it is all done
+	if(!(fs->disk->header->fs_flags & SFS_FLAG_TAIL)){
+		if(upgradeDir(fs, 0) != 0){
+			printf("Disk was made before fcbs kept the tail of their file,\
+ and can't be upgraded\n");
+			DiskDriver_unmount(fs->disk);
+			return -1;
+		}
+		fs->disk->header->fs_flags |= SFS_FLAG_TAIL;
+	}
+	
+	//After a crash, the bitmap is rebuilt from the tree the journal kept
+	if(fs->disk->unclean && fs->disk->journal != NULL){
+		int freed = SimpleFS_recover(fs);
+		if(freed < 0) printf("Bitmap not rebuilt: blocks lost in the crash\
+ may stay marked full\n");
+		else if(freed > 0) printf("%d blocks lost in the crash freed\n", freed);
+	}
+	
+	fs->current_directory_block = 0; //set on top dir
+	strncpy(fs->diskname, diskname, sizeof(char)*128);
+	return 0;
+}
+
+
+int upgradeDir(SimpleFS* fs, int dir_index){
+	
+	DiskDriver* disk = fs->disk;
+	sfs_block_t old[SFS_MAX_BLOCK_SIZE/sizeof(sfs_block_t)];
+	FirstDirectoryBlock dcb;
+	DirectoryBlock rem;
+	int i, n, res = 0;
+	if(DiskDriver_readBlock(disk, old, dir_index) != 0){
+		printf("Error reading dir to upgrade\n");
+		return -1;
+	}
+	
+	//The old dcb: the fcb without its tail, then num_entries and entries
+	memcpy(&dcb, old, offsetof(FirstDirectoryBlock, fcb) 
+						+ offsetof(FileControlBlock, last_block));
+	memcpy(&dcb.num_entries, (char*)old + offsetof(FirstDirectoryBlock, 
+						num_entries) - SFS_TAIL_SHIFT, sizeof(int));
+	int count = dcb.num_entries;
+	int fit = fs->f_dir_block_offset + SFS_TAIL_SHIFT/sizeof(sfs_block_t);
+	sfs_block_t* entries = (sfs_block_t*)malloc((count+1)*sizeof(sfs_block_t));
+	n = (count < fit) ? count : fit;
+	memcpy(entries, (char*)old + offsetof(FirstDirectoryBlock, file_blocks) 
+								- SFS_TAIL_SHIFT, n*sizeof(sfs_block_t));
+	
+	//Remainders have the same layout: they only take the ones after
+	int block = dcb.header.next_block;
+	while(n < count && block != SFS_NO_BLOCK){
+		if(DiskDriver_readBlock(disk, &rem, block) != 0){
+			printf("Error reading dir remainder to upgrade\n");
+			free(entries);
+			return -1;
+		}
+		for(i=0;i<fs->dir_block_offset && n < count;i++) 
+			entries[n++] = rem.file_blocks[i];
+		block = rem.header.next_block;
+	}
+	if(n < count){
+		printf("Invalid num_entries, Directory is damaged!\n");
+		free(entries);
+		return -1;
+	}
+	
+	//The dcb keeps the first ones, the remainders the next ones in order.
+	//The entries taken out of the dcb may need a remainder more
+	for(i=0;i<fs->f_dir_block_offset;i++) 
+		dcb.file_blocks[i] = (i < count) ? entries[i] : SFS_NO_BLOCK;
+	dcb.fcb.last_block = dir_index;
+	dcb.fcb.last_fill = 0;
+	n = fs->f_dir_block_offset;
+	int prev = dir_index, prev_in_file = 0;
+	block = dcb.header.next_block;
+	while(n < count){
+		if(block == SFS_NO_BLOCK){
+			block = DiskDriver_allocBlock(disk, dir_index);
+			if(block < 0){
+				printf ("No free block for dir rem\n");
+				res = -1;
+				break;
+			}
+			if(prev == dir_index) dcb.header.next_block = block;
+			else if(SimpleFS_link(fs, prev, block) != 0){
+				res = -1;
+				break;
+			}
+			rem.header.previous_block = prev;
+			rem.header.next_block = SFS_NO_BLOCK;
+			rem.header.block_in_file = prev_in_file+1;
+			dcb.fcb.size_in_blocks++;
+		}
+		else if(DiskDriver_readBlock(disk, &rem, block) != 0){
+			printf("Error reading dir remainder to upgrade\n");
+			res = -1;
+			break;
+		}
+		for(i=0;i<fs->dir_block_offset;i++) 
+			rem.file_blocks[i] = (n < count) ? entries[n++] : SFS_NO_BLOCK;
+		if(DiskDriver_writeBlock(disk, &rem, block) != 0){
+			printf("Can't write dir rem\n");
+			res = -1;
+			break;
+		}
+		prev = block;
+		prev_in_file = rem.header.block_in_file;
+		block = rem.header.next_block;
+	}
+	if(res == 0 && DiskDriver_writeBlock(disk, &dcb, dir_index) != 0){
+		printf("Error updating dir\n");
+		res = -1;
+	}
+	
+	//Then what is in it, still in the old layout (is_dir is where it was)
+	for(i=0;i<count && res == 0;i++){
+		const FirstFileBlock* ffb = DiskDriver_pinBlock(disk, entries[i]);
+		if(ffb == NULL){
+			printf("Error reading file block\n");
+			res = -1;
+			break;
+		}
+		int is_dir = ffb->fcb.is_dir;
+		DiskDriver_unpinBlock(disk, ffb);
+		res = is_dir ? upgradeDir(fs, entries[i]) 
+						: upgradeFile(fs, entries[i]);
+	}
+	free(entries);
+	return res;
+}
+
+
+int upgradeFile(SimpleFS* fs, int file_index){
+	
+	DiskDriver* disk = fs->disk;
+	sfs_block_t old[SFS_MAX_BLOCK_SIZE/sizeof(sfs_block_t)];
+	FirstFileBlock ffb;
+	int i, res = 0;
+	if(DiskDriver_readBlock(disk, old, file_index) != 0){
+		printf("Error reading file to upgrade\n");
+		return -1;
+	}
+	memcpy(&ffb, old, offsetof(FirstFileBlock, fcb) 
+						+ offsetof(FileControlBlock, last_block));
+	char* old_data = (char*)old + offsetof(FirstFileBlock, data) - SFS_TAIL_SHIFT;
+	sfs_size_t size = ffb.fcb.size_in_bytes;
+	
+	if(SimpleFS_indexed(fs)){
+		//Data blocks in order: the old direct ones, then the trees
+		sfs_block_t* old_map = (sfs_block_t*)old_data;
+		int direct = fs->map_direct + SFS_TAIL_SHIFT/sizeof(sfs_block_t);
+		int n = 0, max = ffb.fcb.size_in_blocks-1;
+		unsigned int* blocks = (unsigned int*)malloc((max+1)*sizeof(unsigned int));
+		for(i=0;i<direct && n < max && old_map[i] != SFS_NO_BLOCK;i++) 
+			blocks[n++] = old_map[i];
+		for(i=0;i<fs->map_levels && res == 0;i++){
+			if(old_map[direct+i] != SFS_NO_BLOCK) 
+				res = upgradeIndex(fs, old_map[direct+i], i+1, blocks, &n, max);
+		}
+		
+		//The same blocks in a map of today (new index blocks near the fcb)
+		memset(ffb.data, 0xFF, fs->f_file_block_offset);
+		FileWalk walk;
+		SimpleFS_walkBegin(&walk, fs, &ffb);
+		for(i=0;i<n && res == 0;i++){
+			if(SimpleFS_walkAppend(&walk, blocks[i]) != 0){
+				printf("No room for file block in the map\n");
+				res = -1;
+			}
+		}
+		if(SimpleFS_walkClose(&walk) != 0) res = -1;
+		ffb.fcb.last_block = (n > 0) ? blocks[n-1] : (unsigned int)file_index;
+		ffb.fcb.last_fill = (n > 0) ? size - (n-1)*fs->file_block_offset : 0;
+		free(blocks);
+	}
+	else{
+		//The fcb keeps fewer bytes: the ones left out are carried to the 
+		//first data block, the last ones of each block to the next
+		char carry[SFS_TAIL_SHIFT], next_carry[SFS_TAIL_SHIFT];
+		memcpy(ffb.data, old_data, fs->f_file_block_offset);
+		memcpy(carry, old_data+fs->f_file_block_offset, SFS_TAIL_SHIFT);
+		ffb.fcb.last_block = file_index;
+		ffb.fcb.last_fill = (size < fs->f_file_block_offset) ? 
+												size : fs->f_file_block_offset;
+		
+		FileBlock block;
+		sfs_size_t done = fs->f_file_block_offset;
+		int prev = file_index, block_num = ffb.header.next_block, in_file = 0;
+		while(done < size){
+			if(block_num == SFS_NO_BLOCK){ //The last one was full
+				block_num = DiskDriver_allocBlock(disk, prev);
+				if(block_num < 0){
+					printf("No free block to allocate new file blocks\n");
+					res = -1;
+					break;
+				}
+				if(prev == file_index) ffb.header.next_block = block_num;
+				else if(SimpleFS_link(fs, prev, block_num) != 0){
+					res = -1;
+					break;
+				}
+				block.header.previous_block = prev;
+				block.header.next_block = SFS_NO_BLOCK;
+				block.header.block_in_file = in_file+1;
+				ffb.fcb.size_in_blocks++;
+				memset(block.data, 0, fs->file_block_offset);
+			}
+			else if(DiskDriver_readBlock(disk, &block, block_num) != 0){
+				printf("Error reading file block to upgrade\n");
+				res = -1;
+				break;
+			}
+			memcpy(next_carry, block.data+fs->file_block_offset-SFS_TAIL_SHIFT, 
+															SFS_TAIL_SHIFT);
+			memmove(block.data+SFS_TAIL_SHIFT, block.data, 
+										fs->file_block_offset-SFS_TAIL_SHIFT);
+			memcpy(block.data, carry, SFS_TAIL_SHIFT);
+			memcpy(carry, next_carry, SFS_TAIL_SHIFT);
+			if(DiskDriver_writeBlock(disk, &block, block_num) != 0){
+				printf("Error writing file block to upgrade\n");
+				res = -1;
+				break;
+			}
+			ffb.fcb.last_block = block_num;
+			ffb.fcb.last_fill = (size-done < fs->file_block_offset) ? 
+										size-done : fs->file_block_offset;
+			done += fs->file_block_offset;
+			in_file++;
+			prev = block_num;
+			block_num = block.header.next_block;
+		}
+	}
+	
+	if(res == 0 && DiskDriver_writeBlock(disk, &ffb, file_index) != 0){
+		printf("Error updating fcb\n");
+		res = -1;
+	}
+	return res;
+}
+
+
+int upgradeIndex(SimpleFS* fs, sfs_block_t block, int height, 
+							unsigned int* blocks, int* n, int max){
+	
+	IndexBlock index;
+	int i;
+	if(DiskDriver_readBlock(fs->disk, &index, block) != 0){
+		printf("Error reading index block to upgrade\n");
+		return -1;
+	}
+	
+	//Entries are taken in order: the first empty one ends them
+	for(i=0;i<fs->map_ptrs && index.blocks[i] != SFS_NO_BLOCK;i++){
+		if(height > 1){
+			if(upgradeIndex(fs, index.blocks[i], height-1, blocks, n, max) != 0) 
+				return -1;
+		}
+		else if(*n < max) blocks[(*n)++] = index.blocks[i];
+		else{
+			printf("Index block past the end of the file\n");
+			return -1;
+		}
+	}
+	return DiskDriver_freeBlock(fs->disk, block);
+}
+
+
+int SimpleFS_recover(SimpleFS* fs){
+	
+	DiskDriver* disk = fs->disk;
+	uint64_t* used = (uint64_t*)calloc(disk->bitmap_words, sizeof(uint64_t));
+	int res = (recoverMark(fs, 0, used) == 0) ? recoverDir(fs, 0, used) : -1;
+	
+	//Full blocks the tree doesn't reach (chunks never initialized are empty)
+	unsigned int w, words = disk->header->init_chunks*DISK_CHUNK_WORDS;
+	int freed = 0;
+	if(words > disk->bitmap_words) words = disk->bitmap_words;
+	for(w=0;w<words && res == 0;w++){
+		uint64_t lost = DiskDriver_word(disk, w) & ~used[w];
+		while(lost != 0 && res == 0){
+			unsigned int block = w*64 + __builtin_ctzll(lost);
+			lost &= lost-1;
+			if(block >= disk->num_entries) break; //Padding of the last word
+			if(DiskDriver_freeBlock(disk, block) != 0) res = -1;
+			else freed++;
+		}
+	}
+	free(used);
+	return (res == 0) ? freed : -1;
+}
+
+
+int recoverMark(SimpleFS* fs, sfs_block_t block, uint64_t* used){
+	
+	DiskDriver* disk = fs->disk;
+	if(block < 0 || block >= disk->num_entries 
+						|| ((used[block/64] >> (block%64)) & 1)){
+		printf("Block %lld is out of the disk or met twice: the tree is\
+ damaged\n", (long long)block);
+		return -1;
+	}
+	used[block/64] |= 1ULL << (block%64);
+	if(DiskDriver_bitmapGet(disk, block) == 0) DiskDriver_markFull(disk, block);
+	return 0;
+}
+
+
+int recoverEntry(SimpleFS* fs, sfs_block_t block, uint64_t* used){
+	
+	if(recoverMark(fs, block, used) != 0) return -1;
+	const FirstFileBlock* ffb = DiskDriver_pinBlock(fs->disk, block);
+	if(ffb == NULL){
+		printf("Error reading file block\n");
+		return -1;
+	}
+	int is_dir = ffb->fcb.is_dir;
+	DiskDriver_unpinBlock(fs->disk, ffb);
+	return is_dir ? recoverDir(fs, block, used) : recoverFile(fs, block, used);
+}
+
+
+int recoverDir(SimpleFS* fs, sfs_block_t dir_index, uint64_t* used){
+	
+	FirstDirectoryBlock dcb;
+	DirectoryBlock rem;
+	if(DiskDriver_readBlock(fs->disk, &dcb, dir_index) != 0){
+		printf("Error reading dir to recover\n");
+		return -1;
+	}
+	
+	//Every remainder of the chain is kept, even one left empty
+	int i, done = 0, res = 0;
+	for(i=0;i<fs->f_dir_block_offset && done < dcb.num_entries && res == 0;i++){
+		res = recoverEntry(fs, dcb.file_blocks[i], used);
+		done++;
+	}
+	sfs_block_t next = dcb.header.next_block;
+	while(res == 0 && next != SFS_NO_BLOCK){
+		if(recoverMark(fs, next, used) != 0 
+				|| DiskDriver_readBlock(fs->disk, &rem, next) != 0){
+			printf("Error reading directory remainder block\n");
+			return -1;
+		}
+		for(i=0;i<fs->dir_block_offset && done < dcb.num_entries && res == 0;i++){
+			res = recoverEntry(fs, rem.file_blocks[i], used);
+			done++;
+		}
+		next = rem.header.next_block;
+	}
+	if(res == 0 && done < dcb.num_entries){
+		printf("Invalid num_entries, Directory is damaged!\n");
+		res = -1;
+	}
+	return res;
+}
+
+
+int recoverFile(SimpleFS* fs, sfs_block_t file_index, uint64_t* used){
+	
+	DiskDriver* disk = fs->disk;
+	FirstFileBlock ffb;
+	int i;
+	if(DiskDriver_readBlock(disk, &ffb, file_index) != 0){
+		printf("Error reading file to recover\n");
+		return -1;
+	}
+	
+	//The map says where every block is
+	if(SimpleFS_indexed(fs)){
+		sfs_block_t* direct = (sfs_block_t*)ffb.data;
+		sfs_block_t* indirect = direct + fs->map_direct;
+		for(i=0;i<fs->map_direct && direct[i] != SFS_NO_BLOCK;i++){
+			if(recoverMark(fs, direct[i], used) != 0) return -1;
+		}
+		for(i=0;i<fs->map_levels;i++){
+			if(indirect[i] != SFS_NO_BLOCK 
+					&& recoverIndex(fs, indirect[i], i+1, used) != 0) 
+				return -1;
+		}
+		return 0;
+	}
+	
+	//The chain, as long as the fcb says
+	sfs_block_t prev = file_index, next = ffb.header.next_block;
+	sfs_size_t left = ffb.fcb.size_in_blocks-1;
+	while(next != SFS_NO_BLOCK && left > 0){
+		if(recoverMark(fs, next, used) != 0) return -1;
+		const BlockHeader* header = DiskDriver_pinBlock(disk, next);
+		if(header == NULL){
+			printf("Error reading file block to recover\n");
+			return -1;
+		}
+		prev = next;
+		next = header->next_block;
+		DiskDriver_unpinBlock(disk, header);
+		left--;
+	}
+	
+	//Blocks linked by a write whose fcb never got there are cut off
+	if(next != SFS_NO_BLOCK){
+		FileBlock block;
+		if(DiskDriver_readBlock(disk, &block, prev) != 0) return -1;
+		block.header.next_block = SFS_NO_BLOCK;
+		if(DiskDriver_writeBlock(disk, &block, prev) != 0) return -1;
+	}
+	return 0;
+}
+
+
+int recoverIndex(SimpleFS* fs, sfs_block_t block, int height, uint64_t* used){
+	
+	IndexBlock index;
+	int i;
+	if(recoverMark(fs, block, used) != 0 
+			|| DiskDriver_readBlock(fs->disk, &index, block) != 0){
+		printf("Error reading index block to recover\n");
+		return -1;
+	}
+	for(i=0;i<fs->map_ptrs && index.blocks[i] != SFS_NO_BLOCK;i++){
+		if(height > 1){
+			if(recoverIndex(fs, index.blocks[i], height-1, used) != 0) 
+				return -1;
+		}
+		else if(recoverMark(fs, index.blocks[i], used) != 0) return -1;
+	}
+	return 0;
+}
+
+
 int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 											FileHandle* dest_handle){
+	
+	//Fcb and dir blocks are committed together (if the disk has a journal)
+	DiskDriver_begin(d->sfs->disk);
+	int res = createFile(d, filename, dest_handle, d->dcb);
+	DiskDriver_end(d->sfs->disk);
+	return res;
+}
+
+
+int createFile(DirectoryHandle* d, const char* filename,
+							FileHandle* dest_handle, unsigned int goal){
 	int i, remainder_index, is_full, file_index, prev_remainder;
 	
 	//Fetching first dir block
@@ -289,24 +1072,18 @@ int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 		}
 	}
 	
-	//Reserving index for file
-	file_index = DiskDriver_getFreeBlock(d->sfs->disk, 0);
+	//Reserving index for file: full in the bitmap until the file is written
+	file_index = DiskDriver_allocBlock(d->sfs->disk, goal);
 	if(file_index<0){
 		printf("No free space available!\n");
 		return -2;
 	}
 	
-	//Temporary block occupation. This will be freed upon real file write
-	if(DiskDriver_writeBlock(d->sfs->disk, &pwd_dcb, file_index)!=0) {
-		printf("Error reserving file block\n");
-		return -3;
-	}
-	
 	//Checking for remainders
 	//First remainder
 	remainder_index = pwd_dcb.header.next_block;
 	
-	if(remainder_index!=0xFFFFFFFF){ //we have a remainder
+	if(remainder_index!=SFS_NO_BLOCK){ //we have a remainder
 		//For the first remainder, fetching has to be done manually
 		DirectoryBlock pwd_rem;
 		if(DiskDriver_readBlock(d->sfs->disk, &pwd_rem,
@@ -318,7 +1095,7 @@ int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 		remainder_index = pwd_rem.header.next_block;
 		
 		//For further remainders, fetching is done automatically
-		while(remainder_index!=0xFFFFFFFF){
+		while(remainder_index!=SFS_NO_BLOCK){
 			if(DiskDriver_readBlock(d->sfs->disk, &pwd_rem, 
 												remainder_index) != 0 ){
 				printf("Error reading first dir block\n");
@@ -329,8 +1106,8 @@ int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 		}
 		is_full = 1;
 		//Checking if remainder is full
-		for(i=0;i<DIR_BLOCK_OFFSET;i++){
-			if(pwd_rem.file_blocks[i]==0xFFFFFFFF){
+		for(i=0;i<d->sfs->dir_block_offset;i++){
+			if(pwd_rem.file_blocks[i]==SFS_NO_BLOCK){
 				is_full = 0;
 				break;
 			}
@@ -349,16 +1126,16 @@ int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 			DirectoryBlock new_rem;
 			
 			new_rem.header.previous_block = prev_remainder;
-			new_rem.header.next_block = 0xFFFFFFFF;
+			new_rem.header.next_block = SFS_NO_BLOCK;
 			new_rem.header.block_in_file = pwd_rem.header.block_in_file+1;
 			new_rem.file_blocks[0] = file_index;
 			
-			for(i=1;i<DIR_BLOCK_OFFSET;i++){ //Initializing file array
-				new_rem.file_blocks[i] = 0xFFFFFFFF;
+			for(i=1;i<d->sfs->dir_block_offset;i++){ //Initializing file array
+				new_rem.file_blocks[i] = SFS_NO_BLOCK;
 			}
 			
 			//Writing down this rem dir block
-			remainder_index = DiskDriver_getFreeBlock(d->sfs->disk, 0);
+			remainder_index = DiskDriver_allocBlock(d->sfs->disk, d->dcb);
 			if(remainder_index<0){
 				printf ("No free block for dir rem\n");
 				return -2;
@@ -385,8 +1162,8 @@ int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 				
 		is_full = 1;
 		//Checking if dcb is full
-		for(i=0;i<F_DIR_BLOCK_OFFSET;i++){
-			if(pwd_dcb.file_blocks[i]==0xFFFFFFFF){
+		for(i=0;i<d->sfs->f_dir_block_offset;i++){
+			if(pwd_dcb.file_blocks[i]==SFS_NO_BLOCK){
 				is_full = 0;
 				break;
 			}
@@ -406,16 +1183,16 @@ int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 			DirectoryBlock new_rem;
 				
 			new_rem.header.previous_block = d->dcb;
-			new_rem.header.next_block = 0xFFFFFFFF;
+			new_rem.header.next_block = SFS_NO_BLOCK;
 			new_rem.header.block_in_file = 1;
 			new_rem.file_blocks[0] = file_index;
 				
-			for(i=1;i<DIR_BLOCK_OFFSET;i++){ //Initializing file array
-				new_rem.file_blocks[i] = 0xFFFFFFFF;
+			for(i=1;i<d->sfs->dir_block_offset;i++){ //Initializing file array
+				new_rem.file_blocks[i] = SFS_NO_BLOCK;
 			}
 				
 			//Writing down this rem dir block
-			remainder_index = DiskDriver_getFreeBlock(d->sfs->disk, 0);
+			remainder_index = DiskDriver_allocBlock(d->sfs->disk, d->dcb);
 			if(remainder_index<0){
 				printf ("No free block for dir rem\n");
 				return -2;
@@ -440,8 +1217,8 @@ int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 	
 	//Creating FirstFileBlock
 	FirstFileBlock ffb;
-	ffb.header.previous_block = 0xFFFFFFFF; //First block
-	ffb.header.next_block = 0xFFFFFFFF; //Not allocated yet - last block
+	ffb.header.previous_block = SFS_NO_BLOCK; //First block
+	ffb.header.next_block = SFS_NO_BLOCK; //Not allocated yet - last block
 	ffb.header.block_in_file = 0; //First block
 	ffb.fcb.directory_block = pwd_dcb.fcb.block_in_disk; //Parent dir
 	ffb.fcb.block_in_disk = file_index;
@@ -449,17 +1226,14 @@ int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 	ffb.fcb.size_in_bytes = 0; //File is size 
 	ffb.fcb.size_in_blocks = 1; //Only first block
 	ffb.fcb.is_dir = 0; //No, it's a file.
+	ffb.fcb.last_block = file_index; //Empty, the tail is the fcb
+	ffb.fcb.last_fill = 0;
 	
-	for(i=0;i<F_FILE_BLOCK_OFFSET;i++){
-		ffb.data[i] = 0; //Initializing data field
-	}
-	
-	//Freeing file_index block and writing down file
-	if(DiskDriver_freeBlock(d->sfs->disk, file_index)!=0){
-		printf("Error freeing file block\n");
-		return -3;
-	}
+	//Initializing data field, or an empty map (all SFS_NO_BLOCK)
+	memset(ffb.data, SimpleFS_indexed(d->sfs) ? 0xFF : 0, 
+											d->sfs->f_file_block_offset);
 	
+	//Writing down file in the reserved block
 	if(DiskDriver_writeBlock(d->sfs->disk, &ffb, file_index)!=0){
 		printf("Error writing down block\n");
 		return -3;
@@ -469,101 +1243,80 @@ int SimpleFS_createFile(DirectoryHandle* d, const char* filename,
 	dest_handle->sfs = d->sfs;
 	dest_handle->fcb = ffb.fcb.block_in_disk;
 	dest_handle->parent_dir = ffb.fcb.directory_block;
+	dest_handle->readahead = 0;
+	dest_handle->pool_start = 0;
+	dest_handle->pool_len = 0;
+	dest_handle->pos_in_file = 0;
+	dest_handle->current_block = 0xFFFFFFFF;
 	
 	return 0;
 }
 int SimpleFS_readDir(char* names, DirectoryHandle* d){	
 	
-	FirstDirectoryBlock pwd_dcb;
+	//Dir blocks are only looked at: they are pinned, not copied
+	DiskDriver* disk = d->sfs->disk;
+	const FirstDirectoryBlock* pwd_dcb = DiskDriver_pinBlock(disk, d->dcb);
 	
-	if(DiskDriver_readBlock(d->sfs->disk, &pwd_dcb, d->dcb) != 0) {
+	if(pwd_dcb == NULL) {
 		printf("Error reading first dir block\n");
 		return -1;
 	}
 
 	//Exploring dir
-	int i, j=0 , remaining_files = pwd_dcb.num_entries;
-	FirstFileBlock temp_ffb;
+	int i, j=0 , remaining_files = pwd_dcb->num_entries;
+	int next_block = pwd_dcb->header.next_block;
 	
-	for(i=0;i<F_DIR_BLOCK_OFFSET;i++){		
+	for(i=0;i<d->sfs->f_dir_block_offset;i++){		
 		if (remaining_files==0) break;
 			
 		//Reading ffb of every file to obtain name from fcb
-		if(DiskDriver_readBlock(d->sfs->disk, &temp_ffb, pwd_dcb.file_blocks[i])!=0) {
+		//I'm assuming char names[pwd_dcb.num_entries][128]
+		if(SimpleFS_readName(d->sfs, pwd_dcb->file_blocks[i], 
+										names+(j*128*sizeof(char)))!=0) {
 			printf("Error reading file block\n");
+			DiskDriver_unpinBlock(disk, pwd_dcb);
 			return -1;
 		}
-		
-		strncpy(names+(j*128*sizeof(char)),temp_ffb.fcb.name,
-			128*sizeof(char)); //I'm assuming char names[pwd_dcb.num_entries][128]
 		j++;
 		
 		remaining_files--;
-		
 	}
-	if (remaining_files==0) return 0; //if no remainder
-	//else...
+	DiskDriver_unpinBlock(disk, pwd_dcb);
 	
-	if(pwd_dcb.header.next_block==0xFFFFFFFF){
+	const DirectoryBlock* pwd_rem;
+	while(remaining_files!=0){ //Scan every remainder
+		
+		if(next_block==SFS_NO_BLOCK){
 			printf("Invalid num_entries, Directory is damaged!\n");
 			return -1;
 		}
-	//Read first directory remainder
-		DirectoryBlock pwd_rem;
 		
-		if(DiskDriver_readBlock(d->sfs->disk, &pwd_rem, 
-								pwd_dcb.header.next_block) != 0) {
-			printf("Error reading first directory remainder block\n");
+		pwd_rem = DiskDriver_pinBlock(disk, next_block);
+		if(pwd_rem == NULL) {
+			printf("Error reading directory remainder block\n");
 			return -1;
-		}	
-	
-	while(pwd_rem.header.next_block!=0xFFFFFFFF){ //Scan every remainder	
+		}
 		
-		for(i=0;i<DIR_BLOCK_OFFSET;i++){
-			if(pwd_rem.file_blocks[i]==0xFFFFFFFF){
+		for(i=0;i<d->sfs->dir_block_offset && remaining_files!=0;i++){
+			//Only the last remainder can be partially empty
+			if(pwd_rem->file_blocks[i]==SFS_NO_BLOCK){
 				printf("Invalid num_entries, Directory is damaged!\n");
+				DiskDriver_unpinBlock(disk, pwd_rem);
 				return -1;
 			}
 
-			if(DiskDriver_readBlock(d->sfs->disk, &temp_ffb, 
-										pwd_rem.file_blocks[i]) != 0) {
+			if(SimpleFS_readName(d->sfs, pwd_rem->file_blocks[i], 
+										names+(j*128*sizeof(char))) != 0) {
 				printf("Error reading directory remainder block\n");
+				DiskDriver_unpinBlock(disk, pwd_rem);
 				return -1;
 			}
-			
-			strncpy(names+(j*128*sizeof(char)),temp_ffb.fcb.name,
-				128*sizeof(char)); //I'm assuming char names[pwd_dcb.num_entries][128]
 			j++;
 			remaining_files--;						
 		}
 		
-		if(DiskDriver_readBlock(d->sfs->disk, &pwd_rem, 
-									pwd_rem.header.next_block) != 0) {
-			printf("Error reading directory remainder block\n");
-			return -1;
-		}	
-	}
-	
-	//Last remainder
-	i = 0; 
-	int block_index = pwd_rem.file_blocks[i];
-	while(block_index!=0xFFFFFFFF && remaining_files != 0){
-			
-		//Next fcb. No Check here: if 0xFFFFFFFF, simply while will exit
-		DiskDriver_readBlock(d->sfs->disk, &temp_ffb, 
-												pwd_rem.file_blocks[i]);
-		block_index = pwd_rem.file_blocks[i];
-		
-		strncpy(names+(j*128*sizeof(char)),temp_ffb.fcb.name,
-			128*sizeof(char)); //I'm assuming char names[pwd_dcb.num_entries][128]
-		i++;
-		j++;
-		remaining_files--;
-	}
-	
-	if(remaining_files!=0){
-		printf("Invalid num_entries, Directory is damaged!\n");
-		return -1;
+		next_block = pwd_rem->header.next_block;
+		DiskDriver_unpinBlock(disk, pwd_rem);
 	}
 	
 	return 0;
@@ -573,22 +1326,25 @@ int SimpleFS_readDir(char* names, DirectoryHandle* d){
 int SimpleFS_openFile(DirectoryHandle* d, const char* filename, 
 											FileHandle* dest_handle){
 	
-	FirstDirectoryBlock pwd_dcb;
+	DiskDriver* disk = d->sfs->disk;
+	const FirstDirectoryBlock* pwd_dcb = DiskDriver_pinBlock(disk, d->dcb);
 	
-	if(DiskDriver_readBlock(d->sfs->disk, &pwd_dcb, d->dcb) != 0) {
+	if(pwd_dcb == NULL) {
 		printf("Error reading first dir block\n");
 		return -1;
 	}
-	char names[pwd_dcb.num_entries][128]; //Allocating name matrix
+	char names[pwd_dcb->num_entries][128]; //Allocating name matrix
 	//we have num_entries sub-vectors by 128 bytes
 	
-	if(SimpleFS_readDir(names[0], d)==-1) return -1;
+	if(SimpleFS_readDir(names[0], d)==-1){
+		DiskDriver_unpinBlock(disk, pwd_dcb);
+		return -1;
+	}
 	
 	//now retrieving FirstFileBlock index
 	int array_num = -1; //This value will record the position in the array of the filename itself. From that, it's easy to retrieve the fileindex
 	int i;
-	FirstDirectoryBlock test_dir;
-	for(i=0;i<pwd_dcb.num_entries;i++){
+	for(i=0;i<pwd_dcb->num_entries;i++){
 		if(strncmp(names[i],filename, 128*sizeof(char)) == 0){
 			//array_num = pwd_dcb.file_blocks[i];
 			array_num = 0;
@@ -602,47 +1358,65 @@ int SimpleFS_openFile(DirectoryHandle* d, const char* filename,
 		dest_handle->sfs = d->sfs;
 		dest_handle->fcb = 0xFFFFFFFF;
 		dest_handle->parent_dir = 0xFFFFFFFF;
+		dest_handle->readahead = 0;
+		dest_handle->pool_start = 0;
+		dest_handle->pool_len = 0;
+		dest_handle->pos_in_file = 0;
+		dest_handle->current_block = 0xFFFFFFFF;
 		
+		DiskDriver_unpinBlock(disk, pwd_dcb);
 		return -1;
 	}
 		
 	//if filename is in the first directory block
-	if(i<F_DIR_BLOCK_OFFSET){
+	if(i<d->sfs->f_dir_block_offset){
 		
-		array_num = pwd_dcb.file_blocks[i];
+		array_num = pwd_dcb->file_blocks[i];
 		
 		dest_handle->sfs = d->sfs;
 		dest_handle->fcb = array_num; 
-		dest_handle->parent_dir = pwd_dcb.fcb.block_in_disk;
+		dest_handle->parent_dir = pwd_dcb->fcb.block_in_disk;
+		dest_handle->readahead = 0;
+		dest_handle->pool_start = 0;
+		dest_handle->pool_len = 0;
+		dest_handle->pos_in_file = 0;
+		dest_handle->current_block = 0xFFFFFFFF;
 		
+		DiskDriver_unpinBlock(disk, pwd_dcb);
 		return 0;
 		
 	}
 	//else picking that reminder block
 	
-	int array_len = i - F_DIR_BLOCK_OFFSET; //excluding first dir block
-	int offset = array_len % DIR_BLOCK_OFFSET; //this is the offset to obtain the file in that block
-	int rem_dir_num = array_len/DIR_BLOCK_OFFSET; //this is the remainder block in the LL that contains the file
+	int array_len = i - d->sfs->f_dir_block_offset; //excluding first dir block
+	int offset = array_len % d->sfs->dir_block_offset; //this is the offset to obtain the file in that block
+	int rem_dir_num = array_len/d->sfs->dir_block_offset; //this is the remainder block in the LL that contains the file
 	
-	//putting reminder block in stack 
-	DirectoryBlock pwd_rem;
-		
-	//passing explicitly from FirstDirectoryBlock to DirectoryBlock
-	if(DiskDriver_readBlock(d->sfs->disk, &pwd_rem, 
-										pwd_dcb.header.next_block) != 0)
-		return -1;
+	//following the remainders through pinned blocks 
+	int rem_index = pwd_dcb->header.next_block;
+	DiskDriver_unpinBlock(disk, pwd_dcb);
+	
+	const DirectoryBlock* pwd_rem = DiskDriver_pinBlock(disk, rem_index);
+	if(pwd_rem == NULL) return -1;
 		
 	for(i=0;i<rem_dir_num;i++){
-		if(DiskDriver_readBlock(d->sfs->disk, &pwd_rem, 
-										pwd_rem.header.next_block) != 0)
-			return -1;
+		rem_index = pwd_rem->header.next_block;
+		DiskDriver_unpinBlock(disk, pwd_rem);
+		pwd_rem = DiskDriver_pinBlock(disk, rem_index);
+		if(pwd_rem == NULL) return -1;
 	}
 	
 	//now returning handle
 	dest_handle->sfs = d->sfs;
-	dest_handle->fcb = pwd_rem.file_blocks[offset];
+	dest_handle->fcb = pwd_rem->file_blocks[offset];
 	dest_handle->parent_dir = d->dcb;
+	dest_handle->readahead = 0;
+	dest_handle->pool_start = 0;
+	dest_handle->pool_len = 0;
+	dest_handle->pos_in_file = 0;
+	dest_handle->current_block = 0xFFFFFFFF;
 	
+	DiskDriver_unpinBlock(disk, pwd_rem);
 	return 0;
 	
 }
@@ -650,37 +1424,45 @@ int SimpleFS_openFile(DirectoryHandle* d, const char* filename,
 
 int SimpleFS_write(FileHandle* f, void* src_data, int size){
 	
+	int res = SimpleFS_pwrite(f, src_data, size, f->pos_in_file);
+	if(res > 0) f->pos_in_file += res;
+	return res;
+}
+
+
+int SimpleFS_pwrite(FileHandle* f, void* src_data, int size, sfs_size_t pos){
+	
 	int written_size = 0; //For return purposes
+	DiskDriver* disk = f->sfs->disk;
+	int block_data = f->sfs->file_block_offset; //Bytes of data in a block
 
 	FirstFileBlock ffb; 
-	int current_block = f->fcb;
 	
-	if(DiskDriver_readBlock(f->sfs->disk, &ffb, current_block)!=0) {
+	if(DiskDriver_readBlock(disk, &ffb, f->fcb)!=0) {
 		printf("Error reading First File Block\n");
 		return -1;
 	}
+	if(pos < 0 || pos > ffb.fcb.size_in_bytes){
+		printf("Can't write past the end of the file\n");
+		return -1;
+	}
 	
-	//Writing/Overwriting FirstFileBlock in stack and then writing back
-	if(size>F_FILE_BLOCK_OFFSET){
-		//Writing first part, then continue
-		memcpy(ffb.data, src_data, F_FILE_BLOCK_OFFSET);
-		written_size += F_FILE_BLOCK_OFFSET;
-		
-		//Writing back Block to File
-		if(DiskDriver_writeBlock(f->sfs->disk, &ffb, current_block) != 0){
-			printf("Error writing First File Block\n");
-			return -1;
-		}
+	//Writing/Overwriting FirstFileBlock in stack, written back at the end
+	//(it holds the first head bytes, none if it holds the map)
+	int head = SimpleFS_head(f->sfs);
+	if(pos < head){
+		written_size = (size < head-pos) ? size : head-pos;
+		memcpy(ffb.data+pos, src_data, written_size);
 	}
-	else{
-		memcpy(ffb.data, src_data, size);
-		written_size += size;
-		if(ffb.fcb.size_in_bytes<written_size){
-			ffb.fcb.size_in_bytes = written_size;
+	if(written_size == size){
+		if(ffb.fcb.size_in_bytes<=pos+written_size){ //No data blocks yet
+			ffb.fcb.size_in_bytes = pos+written_size;
+			ffb.fcb.last_block = f->fcb;
+			ffb.fcb.last_fill = pos+written_size;
 		}
 		
 		//Writing back Block to File
-		if(DiskDriver_writeBlock(f->sfs->disk, &ffb, current_block) != 0){
+		if(DiskDriver_writeBlock(disk, &ffb, f->fcb) != 0){
 			printf("Error writing First File Block\n");
 			return -1;
 		}
@@ -688,182 +1470,376 @@ int SimpleFS_write(FileHandle* f, void* src_data, int size){
 	}
 	
 	//If we aren't done writing the whole array yet...
-	FileBlock fb1,fb2; //Preparing new block to allocate
-	size -= F_FILE_BLOCK_OFFSET; //Calculating remainder size
 	char* src_cursor = (char*)src_data;
-	//src_cursor += F_FILE_BLOCK_OFFSET; //Calculating new pointer
-	
-	int i, next_block_index, actual_block_index, first_time=1;
-	
-	//For the first time:
-	next_block_index = ffb.header.next_block;
-	if(ffb.header.next_block!=0xFFFFFFFF){ //If next block
-		//Fetching next block
-		if(DiskDriver_readBlock(f->sfs->disk, &fb2, 
-												next_block_index) != 0){
-			printf("Error reading first next block\n");
-			return -1;
-		}
-		actual_block_index = next_block_index;
+	int i, n = 0, ready = 0, error = 0, to_copy;
+	
+	//The data block of pos, and where in it
+	sfs_size_t from = pos + written_size - head;
+	unsigned int index = from/block_data;
+	int offset = from%block_data;
+	
+	FileWalk walk; //Blocks of the file, through the chain or the map
+	SimpleFS_walkBegin(&walk, f->sfs, &ffb);
+	if(SimpleFS_walkSeek(&walk, index, f->current_index, 
+											f->current_block) != 0){
+		printf("Error reaching file block to write\n");
+		return -1;
 	}
-	else { //If no next block
-		//I'm taking ffb as fb1 for first while iteration
-		if(DiskDriver_readBlock(f->sfs->disk, &fb1, f->fcb)!=0){
-			printf("Error copying first block for loop\n");
+	unsigned int data_blocks = ffb.fcb.size_in_blocks-1;
+	int actual_block_index = walk.prev; //Last block of the chain written
+	int block_in_file = index;
+	
+	//The blocks the file grows by are all reserved before the first is 
+	//built, from the pool of the handle: every header is written once, 
+	//with its next block already in it
+	sfs_size_t end = pos + size - head;
+	int fresh_num = (end+block_data-1)/block_data - (int)data_blocks;
+	int fresh_used = 0;
+	unsigned int* fresh = NULL;
+	if(fresh_num > 0){
+		fresh = (unsigned int*)malloc(fresh_num*sizeof(unsigned int));
+		if(SimpleFS_reserve(f, actual_block_index+1, fresh, fresh_num) != 0){
+			printf("No free block to allocate new file blocks\n");
+			free(fresh);
 			return -1;
 		}
-		actual_block_index = f->fcb;
+		
+		//The write begins right at the end: linking the old last block
+		if(index == data_blocks){
+			if(actual_block_index == f->fcb) ffb.header.next_block = fresh[0];
+			else if(SimpleFS_link(f->sfs, actual_block_index, fresh[0]) != 0) 
+				error = 1;
+		}
 	}
-	
-	while(size!=0){
-		if(next_block_index == 0xFFFFFFFF){ //We have to allocate a new file block
-			
-			//Retrieving new index to allocate
-			next_block_index = DiskDriver_getFreeBlock(f->sfs->disk, 0);
-			if(next_block_index<0){
-				printf("No free block to allocate new file block\n");
-				return -1;
-			}
-			
-			//Building new block to allocate
-			fb2.header.previous_block = actual_block_index;
-			fb2.header.next_block = 0xFFFFFFFF;
-			fb2.header.block_in_file = fb1.header.block_in_file + 1;
-			for(i=0;i<FILE_BLOCK_OFFSET;i++){
-				fb2.data[i] = 0;
-			}
-			
-			//Writing down new block
-			if(DiskDriver_writeBlock(f->sfs->disk, &fb2, 
-												next_block_index) != 0 ){ 
-				printf("Error writing down new file block");
-				return -1;
-			}			
-			
-			//Updating previous header and fcb info
-			fb1.header.next_block = next_block_index;
-			ffb.fcb.size_in_blocks ++;
-			if(ffb.fcb.size_in_bytes<written_size) 
-				ffb.fcb.size_in_bytes = written_size;
-				
-			if(first_time == 1){ //Fixes a bug that doesn't update ffb header
-				first_time = 0;
-				ffb.header.next_block = next_block_index;
-			}
-			if(DiskDriver_writeBlock(f->sfs->disk, &fb1, 
-											actual_block_index) != 0){ 
-				printf("Error writing down new file block\n");
-				return -1;
+	else fresh_num = 0;
+	
+	//On a mapped disk the bytes go straight into the blocks, pinned one 
+	//at a time. Otherwise (or if a block can't be pinned) blocks are 
+	//staged here and written SFS_BATCH at a time, the ones to overwrite
+	//read SFS_BATCH at a time
+	int direct = !(disk->mode & (DISK_PIO|DISK_ASYNC));
+	FileBlock* batch = (FileBlock*)malloc(SFS_BATCH*sizeof(FileBlock));
+	unsigned int batch_index[SFS_BATCH];
+	void* bufs[SFS_BATCH];
+	for(i=0;i<SFS_BATCH;i++) bufs[i] = &batch[i];
+	
+	while(error == 0 && written_size < size){
+		
+		if(n == SFS_BATCH){ //Batch is full, writing it down
+			if(DiskDriver_writeBlocks(disk, bufs, batch_index, n) != 0){
+				printf("Error writing down file blocks\n");
+				error = 1;
+				break;
 			}
-			if(DiskDriver_writeBlock(f->sfs->disk, &ffb, f->fcb) != 0){ 
-				printf("Error updating fcb\n");
-				return -1;
-			}			
-			
-			//actual_block_index = next_block_index;
+			n = 0;
 		}
-		else{ //We need to fill that file block
-			actual_block_index = next_block_index;
-			
-			if(size>FILE_BLOCK_OFFSET){ //Partial copy
-				memcpy(fb2.data, src_cursor+written_size,
-													FILE_BLOCK_OFFSET);
-				written_size += FILE_BLOCK_OFFSET;
-				size -= FILE_BLOCK_OFFSET;				
+		
+		//Next block: one of the file, or a new one
+		int is_new = walk.index >= data_blocks && ready == 0;
+		int block_num;
+		FileBlock* dst = NULL;
+		if(is_new){
+			block_num = fresh[fresh_used++];
+			if(SimpleFS_walkAppend(&walk, block_num) != 0){
+				printf("No room for new file block in the map\n");
+				error = 1;
+				break;
 			}
-			else{ //Finishing up copy
-				memcpy(fb2.data, src_cursor+written_size, size);
-				written_size += size;
-				size = 0;			
+		}
+		else if(!direct && ready == 0){ //Staging the next ones at once
+			int needed = (size-written_size+offset+block_data-1)
+												/block_data;
+			if(needed > SFS_BATCH-n) needed = SFS_BATCH-n;
+			ready = SimpleFS_walkRead(&walk, batch+n, batch_index+n, needed);
+			if(ready <= 0){
+				printf("Error reading next file block\n");
+				error = 1;
+				break;
 			}
-				
-			//Writing file block down
-			if(DiskDriver_writeBlock(f->sfs->disk, &fb2, 
-											actual_block_index) != 0 ){ 
-				printf("Error writing down data to file block\n");
-				return -1;
+		}
+		if(ready > 0){ //Already staged
+			block_num = batch_index[n];
+			dst = &batch[n++];
+			ready--;
+		}
+		else if(!is_new){
+			block_num = SimpleFS_walkNext(&walk);
+			if(block_num < 0){
+				printf("Error reaching next file block\n");
+				error = 1;
+				break;
 			}
-				
-			//Swapping between fcb1 and fcb2
-			fb1 = fb2;
-			next_block_index = fb1.header.next_block;
-			
-			//Preparing next fb2 block
-			if(next_block_index != 0xFFFFFFFF){
-				if(DiskDriver_readBlock(f->sfs->disk, &fb2, 
-												next_block_index) != 0 ){
-					printf("Error reading next file block\n");
-					return -1;
-				}
+		}
+		
+		//In place, or staged (a block of the file is read first)
+		int pinned = 0;
+		if(dst == NULL && direct){
+			dst = (FileBlock*)DiskDriver_pinWrite(disk, block_num);
+			pinned = dst != NULL;
+		}
+		if(dst == NULL){
+			dst = &batch[n];
+			batch_index[n++] = block_num;
+			if(!is_new && DiskDriver_readBlock(disk, dst, block_num) != 0){
+				printf("Error reading next file block\n");
+				error = 1;
+				break;
 			}
 		}
+		
+		//Only the header fields that change are written
+		if(is_new){
+			dst->header.previous_block = actual_block_index;
+			dst->header.next_block = (fresh_used < fresh_num) ? 
+									fresh[fresh_used] : SFS_NO_BLOCK;
+			dst->header.block_in_file = block_in_file + 1;
+			ffb.fcb.size_in_blocks ++;
+		}
+		else if(block_in_file+1 == data_blocks && fresh_num > 0) 
+			dst->header.next_block = fresh[0]; //The old last block
+		
+		//The bytes, and zeros after them only in a new block not filled
+		to_copy = size-written_size;
+		if(to_copy > block_data-offset) 
+			to_copy = block_data-offset;
+		memcpy(dst->data+offset, src_cursor+written_size, to_copy);
+		if(is_new && offset+to_copy < block_data) 
+			memset(dst->data+offset+to_copy, 0, 
+								block_data-offset-to_copy);
+		written_size += to_copy;
+		offset = 0;
+		if(pinned) DiskDriver_unpinWrite(disk, dst, block_num);
+		
+		actual_block_index = block_num;
+		block_in_file++;
 	}
 	
-	if(ffb.fcb.size_in_bytes<written_size){ 
-		ffb.fcb.size_in_bytes = written_size;
-		if(DiskDriver_writeBlock(f->sfs->disk, &ffb, f->fcb)!=0){ 
-			printf("Error updating fcb\n");
-			return -1;
-		}
+	//Writing down what is still staged, and the index blocks changed
+	if(error == 0 && DiskDriver_writeBlocks(disk, bufs, batch_index, n) != 0){
+		printf("Error writing down file blocks\n");
+		error = 1;
+	}
+	if(SimpleFS_walkClose(&walk) != 0) error = 1;
+	free(batch);
+	
+	//New blocks leave the reservation (the written ones are full in the
+	//bitmap now): the ones a failed write didn't use go back to the pool
+	//if they are right before it
+	while(fresh_num > fresh_used 
+			&& (f->pool_len == 0 || fresh[fresh_num-1]+1 == f->pool_start)){
+		f->pool_start = fresh[--fresh_num];
+		f->pool_len++;
+	}
+	int run;
+	for(i=0;i<fresh_num;i+=run){
+		for(run=1;i+run<fresh_num && fresh[i+run] == fresh[i]+run;run++);
+		DiskDriver_releaseExtent(disk, fresh[i], run);
+	}
+	free(fresh);
+	if(error != 0) return -1;
+	
+	//Next access goes on from the last block written
+	if(block_in_file > 0){
+		f->current_index = block_in_file-1;
+		f->current_block = actual_block_index;
+	}
+	
+	//The write reached the end of the file: its last block is the tail
+	if(ffb.fcb.size_in_bytes<=pos+written_size){
+		ffb.fcb.size_in_bytes = pos+written_size;
+		ffb.fcb.last_block = actual_block_index;
+		ffb.fcb.last_fill = pos+written_size-head 
+						- (block_in_file-1)*block_data;
+	}
+	if(DiskDriver_writeBlock(disk, &ffb, f->fcb)!=0){ 
+		printf("Error updating fcb\n");
+		return -1;
 	}
 	return written_size;
 }
 
 
+int SimpleFS_close(FileHandle* f){
+	
+	//Reserved blocks were never written: only the driver knows them
+	DiskDriver_releaseExtent(f->sfs->disk, f->pool_start, f->pool_len);
+	f->pool_len = 0;
+	int res = 0;
+	
+	//What the file did is made durable with it, unless it is closed by
+	//a bigger operation (like its removal) that commits as a whole
+	DiskJournal* j = f->sfs->disk->journal;
+	if(j != NULL && j->depth == 0 && DiskDriver_commit(f->sfs->disk) != 0) 
+		res = -1;
+	return res;
+}
+
+
+int SimpleFS_reserve(FileHandle* f, unsigned int goal, unsigned int* blocks,
+																int count){
+	
+	int i;
+	for(i=0;i<count;i++){
+		if(f->pool_len == 0){
+			unsigned int needed = (count-i < SFS_POOL) ? SFS_POOL : count-i;
+			int res = DiskDriver_reserveExtent(f->sfs->disk, 
+					(i > 0) ? blocks[i-1]+1 : goal, 1, needed, &f->pool_len);
+			if(res < 0) break;
+			f->pool_start = res;
+		}
+		blocks[i] = f->pool_start++;
+		f->pool_len--;
+	}
+	if(i == count) return 0;
+	
+	//Giving back what was taken
+	while(i-- > 0) DiskDriver_releaseExtent(f->sfs->disk, blocks[i], 1);
+	return -1;
+}
+
+
 int SimpleFS_read(FileHandle* f, void* dst_data, int size){
 	
-	FileBlock ffb; //same as SimpleFS_write
-	FirstFileBlock* ffb_pointer = (FirstFileBlock*)&ffb;
+	int res = SimpleFS_pread(f, dst_data, size, f->pos_in_file);
+	if(res > 0) f->pos_in_file += res;
+	return res;
+}
+
+
+int SimpleFS_pread(FileHandle* f, void* dst_data, int size, sfs_size_t pos){
+	
+	FirstFileBlock ffb;
+	int block_data = f->sfs->file_block_offset; //Bytes of data in a block
 	int read_bytes = 0;
 	
-	char* data_pointer = ffb_pointer->data; //For the FirstFileBlock
-	if(DiskDriver_readBlock(f->sfs->disk, ffb_pointer, f->fcb) != 0){
+	if(DiskDriver_readBlock(f->sfs->disk, &ffb, f->fcb) != 0){
 		printf("Error reading First Block\n");
-		return read_bytes;
+		return -1;
 	}
-	
-	if(size<=F_FILE_BLOCK_OFFSET){
-		memcpy(dst_data, data_pointer, size);
-		read_bytes = size;
-		return read_bytes;
+	if(pos < 0){
+		printf("Can't read before the start of the file\n");
+		return -1;
 	}
 	
-	else{
-		memcpy(dst_data, data_pointer, F_FILE_BLOCK_OFFSET);
-		read_bytes = F_FILE_BLOCK_OFFSET;
+	//Not past the end of the file
+	if(pos >= ffb.fcb.size_in_bytes) return 0;
+	if(size > ffb.fcb.size_in_bytes-pos) size = ffb.fcb.size_in_bytes-pos;
+	
+	int head = SimpleFS_head(f->sfs);
+	if(pos < head){
+		read_bytes = (size < head-pos) ? size : head-pos;
+		memcpy(dst_data, ffb.data+pos, read_bytes);
 	}
+	if(read_bytes == size) return read_bytes;
 	//If there are more blocks...
 	
-	FileBlock fb; //This is the next block
-	int rem_data = size-read_bytes; //It counts remaining bytes to read
-		
-	while(1){
+	//The data block of pos, and where in it
+	sfs_size_t from = pos + read_bytes - head;
+	unsigned int index = from/block_data;
+	int offset = from%block_data;
+	
+	FileWalk walk;
+	SimpleFS_walkBegin(&walk, f->sfs, &ffb);
+	if(SimpleFS_walkSeek(&walk, index, f->current_index, 
+											f->current_block) != 0){
+		printf("Error reaching file block to read\n");
+		return -1;
+	}
+	
+	//Next blocks are read SFS_BATCH at a time
+	FileBlock* batch = (FileBlock*)malloc(SFS_BATCH*sizeof(FileBlock));
+	unsigned int batch_index[SFS_BATCH];
+	int i, got, to_copy;
+	
+	//Readahead: depth goes on from the last read of the handle
+	unsigned int depth = f->readahead;
+	if(depth < SFS_BATCH) depth = SFS_BATCH;
+	unsigned int ra_end = 0; //First block not read ahead yet
+	
+	while(read_bytes < size){
 		
-		//If the previous was the last block
-		if(ffb.header.next_block==0xFFFFFFFF){
+		//Loading next blocks in memory
+		int needed = (size-read_bytes+offset+block_data-1)
+												/block_data;
+		if(needed > SFS_BATCH) needed = SFS_BATCH;
+		got = SimpleFS_walkRead(&walk, batch, batch_index, needed);
+		if(got == 0){ //If the previous was the last block
 			printf("File is shorter than size");
-			return read_bytes;
+			break;
 		}
-		//Loading next block in memory
-		if(DiskDriver_readBlock(f->sfs->disk, &fb, 
-											ffb.header.next_block) != 0){
+		if(got < 0){
 			printf("Error reading First Block\n");
-			return read_bytes;
+			break;
 		}
-		//Reading it
-		if(rem_data<=FILE_BLOCK_OFFSET){
-			memcpy(dst_data+(size-rem_data), fb.data, rem_data);
-			read_bytes += rem_data;
-			return read_bytes;
+		
+		//The chain goes on in the next block: the ones after it are likely
+		//next, deeper and deeper. Otherwise the depth starts over
+		int left = (size-read_bytes+offset+block_data-1)
+												/block_data - got;
+		unsigned int last = batch_index[got-1];
+		sfs_block_t next = batch[got-1].header.next_block;
+		if(next != SFS_NO_BLOCK && next != last+1) depth = SFS_BATCH;
+		else if(next != SFS_NO_BLOCK && left > 0){
+			unsigned int from = (ra_end > last+1) ? ra_end : last+1;
+			unsigned int to = last+1 + ((depth < (unsigned int)left) ? depth : left);
+			if(to > from) DiskDriver_prefetch(f->sfs->disk, from, to-from);
+			if(to > ra_end) ra_end = to;
+			if(2*depth <= SFS_READAHEAD) depth *= 2;
 		}
-		else{
-			memcpy(dst_data+(size-rem_data), fb.data, FILE_BLOCK_OFFSET);
-			read_bytes += FILE_BLOCK_OFFSET;
-			rem_data = size-read_bytes;
+		
+		//Reading them
+		for(i=0;i<got;i++){
+			to_copy = size-read_bytes;
+			if(to_copy > block_data-offset) 
+				to_copy = block_data-offset;
+			memcpy((char*)dst_data+read_bytes, batch[i].data+offset, to_copy);
+			read_bytes += to_copy;
+			offset = 0;
 		}
-		//Son becomes father of his next
-		ffb = fb;
+		
+		//Next access goes on from the last block read
+		f->current_index = walk.index-1;
+		f->current_block = last;
+	}
+	
+	f->readahead = depth;
+	free(batch);
+	return read_bytes;
+}
+
+
+int SimpleFS_append(FileHandle* f, void* src_data, int size){
+	
+	const FirstFileBlock* ffb = DiskDriver_pinBlock(f->sfs->disk, f->fcb);
+	if(ffb == NULL){
+		printf("Error reading First Block\n");
+		return -1;
 	}
+	sfs_size_t end = ffb->fcb.size_in_bytes;
+	DiskDriver_unpinBlock(f->sfs->disk, ffb);
+	
+	int res = SimpleFS_pwrite(f, src_data, size, end);
+	if(res > 0) f->pos_in_file = end + res;
+	return res;
+}
+
+
+sfs_size_t SimpleFS_seek(FileHandle* f, sfs_size_t pos){
+	
+	const FirstFileBlock* ffb = DiskDriver_pinBlock(f->sfs->disk, f->fcb);
+	if(ffb == NULL){
+		printf("Error reading First Block\n");
+		return -1;
+	}
+	sfs_size_t size = ffb->fcb.size_in_bytes;
+	DiskDriver_unpinBlock(f->sfs->disk, ffb);
+	
+	if(pos < 0 || pos > size){
+		printf("Can't seek past the end of the file\n");
+		return -1;
+	}
+	f->pos_in_file = pos;
+	return pos;
 }
 
 
@@ -939,7 +1915,9 @@ int SimpleFS_mkDir(DirectoryHandle* d, char* dirname){
 	FileHandle dest_handle;
 	FirstDirectoryBlock new_dir;
 	if(strncmp(dirname, updir, 128) != 0){
-		SimpleFS_createFile(d, dirname, &dest_handle);
+		DiskDriver_begin(d->sfs->disk); //File and dir in one operation
+		createFile(d, dirname, &dest_handle, 
+						DiskDriver_spreadGroup(d->sfs->disk, d->dcb));
 	}
 	else{
 	 printf("Cannot create .. dir!\n");	
@@ -950,6 +1928,7 @@ int SimpleFS_mkDir(DirectoryHandle* d, char* dirname){
 	if(DiskDriver_readBlock(d->sfs->disk, &new_dir, 
 												dest_handle.fcb) != 0){
 		printf("Error reading created file for transormation in dir\n");
+		DiskDriver_end(d->sfs->disk);
 		return -1;
 	}
 	
@@ -957,13 +1936,14 @@ int SimpleFS_mkDir(DirectoryHandle* d, char* dirname){
 	new_dir.fcb.is_dir = 1; //BOOM!
 	new_dir.num_entries = 0;
 	int i;
-	for(i=0;i<F_DIR_BLOCK_OFFSET;i++){
-		new_dir.file_blocks[i] = 0xFFFFFFFF;
+	for(i=0;i<d->sfs->f_dir_block_offset;i++){
+		new_dir.file_blocks[i] = SFS_NO_BLOCK;
 	}
 	
 	//Update dir status on disk
-	if(DiskDriver_writeBlock(d->sfs->disk, &new_dir, 
-												dest_handle.fcb) != 0){
+	int res = DiskDriver_writeBlock(d->sfs->disk, &new_dir, dest_handle.fcb);
+	DiskDriver_end(d->sfs->disk);
+	if(res != 0){
 		printf("Error turning file into a dir\n");
 		return -1;
 	}
@@ -977,7 +1957,19 @@ int SimpleFS_mkDir(DirectoryHandle* d, char* dirname){
 
 
 int SimpleFS_remove(void* handle){
+	
+	//The whole tree goes away in a single operation
+	SimpleFS* fs = ((FileHandle*)handle)->sfs;
+	DiskDriver_begin(fs->disk);
+	int res = remHandle(handle);
+	DiskDriver_end(fs->disk);
+	return res;
+}
+
+
+int remHandle(void* handle){
 	FileHandle* file_handle = (FileHandle*)handle;
+	SimpleFS* fs = file_handle->sfs;
 	int index = ((FileHandle*)handle) -> fcb;
 	FirstDirectoryBlock temp;
 	
@@ -990,7 +1982,7 @@ int SimpleFS_remove(void* handle){
 	if(temp.fcb.is_dir == 0){ //If file
 		printf("File detected! Index: %d\n", index);
 		
-		if(remFile(file_handle->sfs, index) != 0){
+		if(SimpleFS_close(file_handle) != 0 || remFile(file_handle->sfs, index) != 0){
 			printf("Error deleting file\n");
 			return -1;
 		}
@@ -1020,7 +2012,7 @@ int SimpleFS_remove(void* handle){
 	
 	//Trying in dcb
 	int is_inside = 0;
-	for(i=0;i<F_DIR_BLOCK_OFFSET;i++){
+	for(i=0;i<fs->f_dir_block_offset;i++){
 		if(upper_dir.file_blocks[i] == index){
 			is_inside = 1;
 			break;
@@ -1029,7 +2021,7 @@ int SimpleFS_remove(void* handle){
 	
 	if(is_inside == 0){ //If pos is not in first dir block
 		//Find position in the array where the eliminated entry is
-		while(actual_index != 0xFFFFFFFF){
+		while(actual_index != SFS_NO_BLOCK){
 			
 			if(DiskDriver_readBlock(file_handle->sfs->disk, 
 										&rem_dir, actual_index) != 0){
@@ -1037,7 +2029,7 @@ int SimpleFS_remove(void* handle){
 				return -1;
 			}
 			
-			for(i=0;i<DIR_BLOCK_OFFSET;i++){
+			for(i=0;i<fs->dir_block_offset;i++){
 				if(rem_dir.file_blocks[i] == index){
 					is_inside = 1;
 					break;
@@ -1057,7 +2049,7 @@ int SimpleFS_remove(void* handle){
 		//Moving last item to erased one, then modifying num_entries in dcb
 		temp_rem = rem_dir;
 		rem_index = actual_index;
-		while(actual_index != 0xFFFFFFFF){
+		while(actual_index != SFS_NO_BLOCK){
 			
 			//Moving to last remainder
 			last_rem_index = actual_index;
@@ -1073,11 +2065,8 @@ int SimpleFS_remove(void* handle){
 		}
 		
 		//Finding last element in array
-		for(item_to_move=0;i<DIR_BLOCK_OFFSET;item_to_move++){
-			if(temp_rem.file_blocks[item_to_move] == 0xFFFFFFFF){
-				item_to_move--;
-				break;
-			}
+		for(item_to_move=0;item_to_move<fs->dir_block_offset-1;item_to_move++){
+			if(temp_rem.file_blocks[item_to_move+1] == SFS_NO_BLOCK) break;
 		}
 		
 		//Making and writing changes to blocks
@@ -1086,7 +2075,7 @@ int SimpleFS_remove(void* handle){
 			temp_rem.file_blocks[i] = temp_rem.file_blocks[item_to_move];		
 		else rem_dir.file_blocks[i] = temp_rem.file_blocks[item_to_move];
 		
-		temp_rem.file_blocks[item_to_move] = 0xFFFFFFFF;
+		temp_rem.file_blocks[item_to_move] = SFS_NO_BLOCK;
 		
 		if(DiskDriver_writeBlock(file_handle->sfs->disk, 
 											&rem_dir, rem_index) != 0){
@@ -1107,9 +2096,13 @@ int SimpleFS_remove(void* handle){
 				printf("Error deleting empty remainder!\n");
 				return -1;
 			}
+			upper_dir.fcb.size_in_blocks--;
+			if(detachRem(file_handle->sfs, &upper_dir, 
+									temp_rem.header.previous_block) != 0)
+				return -1;
 		}
 		else{
-			temp_rem.file_blocks[item_to_move] = 0xFFFFFFFF;
+			temp_rem.file_blocks[item_to_move] = SFS_NO_BLOCK;
 			if(DiskDriver_writeBlock(file_handle->sfs->disk, &temp_rem,
 												last_rem_index) != 0){
 				printf("Error writing last dir block to compact\n");
@@ -1118,29 +2111,29 @@ int SimpleFS_remove(void* handle){
 		}
 	}
 	else{ //If deleted item is in dcb
-		if(upper_dir.header.next_block==0xFFFFFFFF){ //If no remainders
+		if(upper_dir.header.next_block==SFS_NO_BLOCK){ //If no remainders
 			printf("No remainders detected!\n");
 			
 			is_inside = 0;
-			for(item_to_move=0;item_to_move<F_DIR_BLOCK_OFFSET;
+			for(item_to_move=0;item_to_move<fs->f_dir_block_offset;
 														item_to_move++){
-				if(upper_dir.file_blocks[item_to_move]==0xFFFFFFFF){
+				if(upper_dir.file_blocks[item_to_move]==SFS_NO_BLOCK){
 					upper_dir.file_blocks[i] = 
 								upper_dir.file_blocks[item_to_move-1];
-					upper_dir.file_blocks[item_to_move-1] = 0xFFFFFFFF;
+					upper_dir.file_blocks[item_to_move-1] = SFS_NO_BLOCK;
 					is_inside = 1;
 					break;
 				}
 			}
 			if(is_inside == 0) { //If first dir block is full but no rem
 				upper_dir.file_blocks[i] = 
-							upper_dir.file_blocks[F_DIR_BLOCK_OFFSET-1];
-				upper_dir.file_blocks[F_DIR_BLOCK_OFFSET-1] = 0xFFFFFFFF;
+							upper_dir.file_blocks[fs->f_dir_block_offset-1];
+				upper_dir.file_blocks[fs->f_dir_block_offset-1] = SFS_NO_BLOCK;
 			}
 		}
 		else{ //If item in dcb and remainders
 			printf("Remainders detected!\n");
-			while(actual_index!=0xFFFFFFFF){
+			while(actual_index!=SFS_NO_BLOCK){
 				//Moving to last remainder
 				last_rem_index = actual_index;
 				if(DiskDriver_readBlock(file_handle->sfs->disk, 
@@ -1154,11 +2147,8 @@ int SimpleFS_remove(void* handle){
 			
 			
 			//Finding last element in array
-			for(item_to_move=0;i<DIR_BLOCK_OFFSET;item_to_move++){
-				if(temp_rem.file_blocks[item_to_move] == 0xFFFFFFFF){
-					item_to_move--;
-					break;
-				}
+			for(item_to_move=0;item_to_move<fs->dir_block_offset-1;item_to_move++){
+				if(temp_rem.file_blocks[item_to_move+1] == SFS_NO_BLOCK) break;
 			}
 			
 			//Making and writing changes to blocks
@@ -1172,28 +2162,14 @@ int SimpleFS_remove(void* handle){
 					return -1;
 				}
 				upper_dir.fcb.size_in_blocks--;
-				actual_index = temp_rem.header.previous_block;
-				
-				if(actual_index!=0){
-					if(DiskDriver_readBlock(file_handle->sfs->disk, 
-										&temp_rem, actual_index) != 0){
-						printf("Error reading dir block to compact\n");
-						return -1;
-					}
-					temp_rem.header.next_block = 0xFFFFFFFF; //Detaching prev block
-					
-					if(DiskDriver_writeBlock(file_handle->sfs->disk, 
-										&temp_rem, actual_index) != 0){
-						printf("Error writing last dir \
-												block to compact\n");
-						return -1;
-					}
-				} //If prev block is dcb, special treatment below
+				if(detachRem(file_handle->sfs, &upper_dir, 
+									temp_rem.header.previous_block) != 0)
+					return -1;
 				
 				printf("Empty dir rem deleted\n");
 			}
 			else{
-				temp_rem.file_blocks[item_to_move] = 0xFFFFFFFF;
+				temp_rem.file_blocks[item_to_move] = SFS_NO_BLOCK;
 				if(DiskDriver_writeBlock(file_handle->sfs->disk,  
 										&temp_rem, last_rem_index) != 0){
 					printf("Error writing last dir block to compact\n");
@@ -1205,11 +2181,6 @@ int SimpleFS_remove(void* handle){
 	
 	//Update upper_dir
 	upper_dir.num_entries--;
-	if(actual_index == 0){
-		upper_dir.header.next_block = 0xFFFFFFFF;
-		//If the next rem was removed, detach that block by dcb.
-		//It has no real effect if there was no rem.
-	}
 	
 	if(DiskDriver_writeBlock(file_handle->sfs->disk, &upper_dir, 
 							((FileHandle*)handle) -> parent_dir) != 0){
@@ -1223,28 +2194,106 @@ int SimpleFS_remove(void* handle){
 	return 0;
 }
 
+int detachRem(SimpleFS* fs, FirstDirectoryBlock* upper, int prev){
+	
+	if(prev == upper->fcb.block_in_disk){ //Written with the dcb
+		upper->header.next_block = SFS_NO_BLOCK;
+		return 0;
+	}
+	
+	DirectoryBlock rem;
+	if(DiskDriver_readBlock(fs->disk, &rem, prev) != 0){
+		printf("Error reading dir block to compact\n");
+		return -1;
+	}
+	rem.header.next_block = SFS_NO_BLOCK; //Detaching prev block
+	if(DiskDriver_writeBlock(fs->disk, &rem, prev) != 0){
+		printf("Error writing last dir block to compact\n");
+		return -1;
+	}
+	return 0;
+}
+
+
 int remFile(SimpleFS* fs, int file_index){
-	FirstFileBlock ffb;
+	
+	//Indexed files: the map says where every block is, nothing to read
+	if(SimpleFS_indexed(fs)){
+		FirstFileBlock ffb;
+		sfs_block_t* direct = (sfs_block_t*)ffb.data;
+		sfs_block_t* indirect = direct + fs->map_direct;
+		unsigned int block_nums[SFS_MAX_MAP_PTRS+1];
+		int i, n = 0;
+		if(DiskDriver_readBlock(fs->disk, &ffb, file_index) != 0){
+			printf("Error reading file block to delete\n");
+			return -1;
+		}
+		for(i=0;i<fs->map_levels;i++){
+			if(indirect[i] != SFS_NO_BLOCK 
+					&& remIndex(fs, indirect[i], i+1) != 0) return -1;
+		}
+		for(i=0;i<fs->map_direct && direct[i] != SFS_NO_BLOCK;i++) 
+			block_nums[n++] = direct[i];
+		block_nums[n++] = file_index;
+		if(DiskDriver_freeBlocks(fs->disk, block_nums, n) != 0){
+			printf("Error freeing file block!\n");
+			return -1;
+		}
+		return 0;
+	}
+	
+	FileBlock* batch = (FileBlock*)malloc(SFS_BATCH*sizeof(FileBlock));
+	unsigned int batch_index[SFS_BATCH];
 	int actual_index = file_index;
+	int got, guess = 1;
 	
-	//Iterative destruction!
-	while(actual_index != 0xFFFFFFFF){
+	//Iterative destruction, SFS_BATCH blocks at a time!
+	while(actual_index != SFS_NO_BLOCK){
 		
-		//Loading next block in memory
-		if(DiskDriver_readBlock(fs->disk, &ffb, actual_index) != 0){
+		//Loading next blocks in memory
+		got = SimpleFS_readChain(fs, actual_index, batch, batch_index, 
+												SFS_BATCH, &guess);
+		if(got <= 0){
 			printf("Error reading file block to delete\n");
+			free(batch);
 			return -1;
 		}
+		actual_index = batch[got-1].header.next_block;
 		
-		//Destroying actual block
-		if(DiskDriver_freeBlock(fs->disk, actual_index)!=0){
+		//Destroying them
+		if(DiskDriver_freeBlocks(fs->disk, batch_index, got)!=0){
 			printf("Error freeing file block!\n");
+			free(batch);
 			return -1;
 		}
-		
-		actual_index = ffb.header.next_block;				
 	}
 	
+	free(batch);
+	return 0;
+}
+
+
+int remIndex(SimpleFS* fs, sfs_block_t block, int height){
+	
+	IndexBlock index;
+	unsigned int block_nums[SFS_MAX_MAP_PTRS+1];
+	int i, n = 0;
+	if(DiskDriver_readBlock(fs->disk, &index, block) != 0){
+		printf("Error reading index block to delete\n");
+		return -1;
+	}
+	
+	//Entries are taken in order: the first empty one ends them
+	for(i=0;i<fs->map_ptrs && index.blocks[i] != SFS_NO_BLOCK;i++){
+		if(height == 1) block_nums[n++] = index.blocks[i];
+		else if(remIndex(fs, index.blocks[i], height-1) != 0) return -1;
+	}
+	block_nums[n++] = block;
+	
+	if(DiskDriver_freeBlocks(fs->disk, block_nums, n) != 0){
+		printf("Error freeing file block!\n");
+		return -1;
+	}
 	return 0;
 }
 
@@ -1252,96 +2301,401 @@ int remFile(SimpleFS* fs, int file_index){
 int remDir(SimpleFS* fs, int dir_index){
 	FirstDirectoryBlock pwd;
 	DirectoryBlock pwd_rem;
-	FirstFileBlock temp;
 	
 	if(DiskDriver_readBlock(fs->disk, &pwd, dir_index) != 0){
 		printf("Error reading dir dcb to delete\n");
 		return -1;
 	}	
 	
+	//Blocks of the dir itself, freed all together at the end
+	int num_dir_blocks = 0, max_dir_blocks = pwd.fcb.size_in_blocks+1;
+	unsigned int* dir_blocks = (unsigned int*)malloc(
+									max_dir_blocks*sizeof(int));
+	
 	int actual_index = pwd.header.next_block;
 		
 	int i=0;
 	//For remainders
 	//Iterative destruction!
-	while(actual_index != 0xFFFFFFFF){
+	while(actual_index != SFS_NO_BLOCK){
 		
 		//Loading next block in memory
 		if(DiskDriver_readBlock(fs->disk, &pwd_rem, actual_index) != 0){
 			printf("Error reading dir remainder block to delete\n");
+			free(dir_blocks);
 			return -1;
 		}
 				
-		//Emptying that dir block
-		for(i=0;i<DIR_BLOCK_OFFSET;i++){
-			//Read every item in array,		
-			//Check if array is now empty
-			if (pwd_rem.file_blocks[i] == 0xFFFFFFFF) break;
-			
-			//If not empty, if file, invoke remFile, if dir, recursion!
-			if(DiskDriver_readBlock(fs->disk, &temp, 
-										pwd_rem.file_blocks[i]) != 0){
-										
-				printf("Error reading dir dcb to delete\n");
-				return -1;
-			}
-			
-			if(temp.fcb.is_dir == 0){ //If file, invoke remFile
-				if(remFile(fs, pwd_rem.file_blocks[i]) != 0){
-					
-					return -1;
-				}
-			}
-			else{ //If dir, recursion				
-				if(remDir(fs, pwd_rem.file_blocks[i]) != 0){
-					
-					return -1;
-				}
-			}
+		//Emptying that dir block: the array ends at the first empty item
+		for(i=0;i<fs->dir_block_offset;i++){
+			if (pwd_rem.file_blocks[i] == SFS_NO_BLOCK) break;
 		}
-		
-		//Destroying actual dir block
-		if(DiskDriver_freeBlock(fs->disk, actual_index) != 0){
-			printf("Error freeing dir remainder block!\n");
+		if(remEntries(fs, pwd_rem.file_blocks, i) != 0){
+			free(dir_blocks);
 			return -1;
 		}
 		
+		//Actual dir block will be destroyed with the others
+		if(num_dir_blocks == max_dir_blocks-1){ //size_in_blocks was wrong
+			max_dir_blocks *= 2;
+			dir_blocks = (unsigned int*)realloc(dir_blocks, 
+									max_dir_blocks*sizeof(int));
+		}
+		dir_blocks[num_dir_blocks++] = actual_index;
+		
 		actual_index = pwd_rem.header.next_block;				
 	}
 	
 	//Explore dcb array
-	for(i=0;i<F_DIR_BLOCK_OFFSET;i++){
-		//Read every item in array,
-		//if file, invoke remFile, if dir, recursion!
-		if(pwd.file_blocks[i] == 0xFFFFFFFF) break;
-		
-		if(DiskDriver_readBlock(fs->disk, &temp, 
-											pwd.file_blocks[i]) != 0){
-			printf("Error reading dir dcb to delete\n");
-			return -1;
-		}
-		
-		if(temp.fcb.is_dir == 0){ //If file, invoke remFile
-			if(remFile(fs, pwd.file_blocks[i]) != 0){
-				return -1;
-			}
+	for(i=0;i<fs->f_dir_block_offset;i++){
+		if(pwd.file_blocks[i] == SFS_NO_BLOCK) break;
+	}
+	if(remEntries(fs, pwd.file_blocks, i) != 0){
+		free(dir_blocks);
+		return -1;
+	}
+	
+	//Then eliminate dir remainders and dcb!
+	dir_blocks[num_dir_blocks++] = dir_index;
+	if(DiskDriver_freeBlocks(fs->disk, dir_blocks, num_dir_blocks) != 0){
+		printf("Error freeing dir blocks!\n");
+		free(dir_blocks);
+		return -1;
+	}
+	
+	free(dir_blocks);
+	return 0;
+}
+
+
+int remEntries(SimpleFS* fs, sfs_block_t* entries, int count){
+	
+	if(count == 0) return 0;
+	
+	//Reading every fcb at once
+	FirstFileBlock* temp = (FirstFileBlock*)malloc(
+									count*sizeof(FirstFileBlock));
+	void** bufs = (void**)malloc(count*sizeof(void*));
+	unsigned int* block_nums = (unsigned int*)malloc(count*sizeof(int));
+	int i, res = 0;
+	for(i=0;i<count;i++){
+		bufs[i] = &temp[i];
+		block_nums[i] = entries[i]; //Pointers may be wider than indices
+	}
+	
+	if(DiskDriver_readBlocks(fs->disk, bufs, block_nums, count) != 0){
+		printf("Error reading dir dcb to delete\n");
+		res = -1;
+	}
+	
+	//If file, invoke remFile, if dir, recursion!
+	for(i=0;i<count && res==0;i++){
+		if(temp[i].fcb.is_dir == 0) res = remFile(fs, entries[i]);
+		else res = remDir(fs, entries[i]);
+	}
+	
+	free(block_nums);
+	free(bufs);
+	free(temp);
+	return res;
+}
+
+
+int SimpleFS_readName(SimpleFS* fs, int file_index, char* dest){
+	
+	const FirstFileBlock* ffb = DiskDriver_pinBlock(fs->disk, file_index);
+	if(ffb == NULL) return -1;
+	
+	strncpy(dest, ffb->fcb.name, 128*sizeof(char));
+	DiskDriver_unpinBlock(fs->disk, ffb);
+	return 0;
+}
+
+
+int SimpleFS_readChain(SimpleFS* fs, int first, FileBlock* dest, 
+				unsigned int* block_nums, int max, int* guess){
+	
+	DiskDriver* disk = fs->disk;
+	void* bufs[SFS_BATCH];
+	int i, n = 1;
+	
+	//Guessing that the chain goes on in the next full blocks
+	int width = (max < *guess) ? max : *guess;
+	block_nums[0] = first;
+	while(n < width && first+n < disk->num_entries 
+					&& DiskDriver_bitmapGet(disk, first+n) == 1){
+		block_nums[n] = first+n;
+		n++;
+	}
+	
+	for(i=0;i<n;i++) bufs[i] = &dest[i];
+	if(DiskDriver_readBlocks(disk, bufs, block_nums, n) != 0) return -1;
+	
+	//Cutting the chain at the first wrong guess
+	for(i=1;i<n;i++){
+		if(dest[i-1].header.next_block != block_nums[i]) break;
+	}
+	
+	//Wider guesses while they are right, back to what was right otherwise
+	if(i == width) *guess = (2*width < SFS_BATCH) ? 2*width : SFS_BATCH;
+	else *guess = i;
+	
+	return i;
+}
+
+
+int SimpleFS_indexed(SimpleFS* fs){
+	return (fs->disk->header->fs_flags & SFS_FLAG_INDEXED) != 0;
+}
+
+
+int SimpleFS_head(SimpleFS* fs){
+	return SimpleFS_indexed(fs) ? 0 : fs->f_file_block_offset;
+}
+
+
+void SimpleFS_walkBegin(FileWalk* w, SimpleFS* fs, FirstFileBlock* ffb){
+	
+	int i;
+	w->sfs = fs;
+	w->ffb = ffb;
+	w->index = 0;
+	w->next = ffb->header.next_block;
+	w->prev = ffb->fcb.block_in_disk;
+	w->guess = 1;
+	for(i=0;i<fs->map_levels;i++){
+		w->cache[i].block = 0xFFFFFFFF;
+		w->cache[i].dirty = 0;
+	}
+}
+
+
+int SimpleFS_walkRead(FileWalk* w, FileBlock* dest, 
+						unsigned int* block_nums, int max){
+	
+	int n;
+	if(!SimpleFS_indexed(w->sfs)){ //Following the chain
+		if(w->next == SFS_NO_BLOCK) return 0;
+		n = SimpleFS_readChain(w->sfs, w->next, dest, block_nums, max, 
+															&w->guess);
+		if(n <= 0) return -1;
+		w->next = dest[n-1].header.next_block;
+		w->prev = block_nums[n-1];
+		w->index += n;
+		return n;
+	}
+	
+	//The map tells where they are: a single vectored read
+	void* bufs[SFS_BATCH];
+	for(n=0;n<max;n++){
+		sfs_block_t* slot = SimpleFS_mapSlot(w, w->index+n, 0);
+		if(slot == NULL || *slot == SFS_NO_BLOCK) break;
+		block_nums[n] = *slot;
+		bufs[n] = &dest[n];
+	}
+	if(n == 0) return 0;
+	if(DiskDriver_readBlocks(w->sfs->disk, bufs, block_nums, n) != 0) 
+		return -1;
+	w->prev = block_nums[n-1];
+	w->index += n;
+	return n;
+}
+
+
+int SimpleFS_walkAppend(FileWalk* w, unsigned int block_num){
+	
+	if(SimpleFS_indexed(w->sfs)){ //Else linked by the headers
+		sfs_block_t* slot = SimpleFS_mapSlot(w, w->index, 1);
+		if(slot == NULL) return -1;
+		*slot = block_num;
+	}
+	w->prev = block_num;
+	w->index++;
+	return 0;
+}
+
+
+int SimpleFS_walkSeek(FileWalk* w, unsigned int index, 
+						unsigned int from_index, unsigned int from_block){
+	
+	if(SimpleFS_indexed(w->sfs)){ //Straight there, the map knows
+		if(index > 0){
+			sfs_block_t* slot = SimpleFS_mapSlot(w, index-1, 0);
+			if(slot == NULL || *slot == SFS_NO_BLOCK) return -1;
+			w->prev = *slot;
 		}
-		else{ //If dir
-			if(remDir(fs, pwd.file_blocks[i]) != 0){
-				return -1;
-			}
+		w->index = index;
+		return 0;
+	}
+	
+	//From the tail in the fcb if the block met last is not closer
+	const FileControlBlock* fcb = &w->ffb->fcb;
+	unsigned int tail = fcb->size_in_blocks-2; //Data block index
+	if(fcb->last_block != fcb->block_in_disk && tail <= index 
+			&& (from_block == 0xFFFFFFFF || from_index > index 
+											|| from_index < tail)){
+		from_index = tail;
+		from_block = fcb->last_block;
+	}
+	
+	//From the block met last if it helps, it knows the one before it too
+	DiskDriver* disk = w->sfs->disk;
+	const BlockHeader* header;
+	if(from_block != 0xFFFFFFFF && from_index <= index && from_index >= w->index){
+		header = DiskDriver_pinBlock(disk, from_block);
+		if(header == NULL) return -1;
+		w->prev = header->previous_block;
+		w->next = from_block;
+		w->index = from_index;
+		DiskDriver_unpinBlock(disk, header);
+	}
+	
+	//Then header after header
+	while(w->index < index){
+		if(SimpleFS_walkNext(w) < 0) return -1;
+	}
+	return 0;
+}
+
+
+int SimpleFS_walkNext(FileWalk* w){
+	
+	if(SimpleFS_indexed(w->sfs)){
+		sfs_block_t* slot = SimpleFS_mapSlot(w, w->index, 0);
+		if(slot == NULL || *slot == SFS_NO_BLOCK) return -1;
+		w->prev = *slot;
+	}
+	else{
+		if(w->next == SFS_NO_BLOCK) return -1;
+		const BlockHeader* header = DiskDriver_pinBlock(w->sfs->disk, w->next);
+		if(header == NULL) return -1;
+		w->prev = w->next;
+		w->next = header->next_block;
+		DiskDriver_unpinBlock(w->sfs->disk, header);
+	}
+	w->index++;
+	return w->prev;
+}
+
+
+int SimpleFS_link(SimpleFS* fs, unsigned int block_num, unsigned int next){
+	
+	//Only the header changes: in place if the block can be pinned
+	BlockHeader* header = DiskDriver_pinWrite(fs->disk, block_num);
+	if(header != NULL){
+		header->next_block = next;
+		DiskDriver_unpinWrite(fs->disk, header, block_num);
+		return 0;
+	}
+	
+	FileBlock block;
+	if(DiskDriver_readBlock(fs->disk, &block, block_num) != 0){
+		printf("Error reading block to link\n");
+		return -1;
+	}
+	block.header.next_block = next;
+	if(DiskDriver_writeBlock(fs->disk, &block, block_num) != 0){
+		printf("Error linking block\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+int SimpleFS_walkClose(FileWalk* w){
+	
+	int i, res = 0;
+	for(i=0;i<w->sfs->map_levels;i++){
+		if(w->cache[i].dirty && DiskDriver_writeBlock(w->sfs->disk, 
+						&w->cache[i].data, w->cache[i].block) != 0){
+			printf("Error writing index block\n");
+			res = -1;
 		}
+		w->cache[i].dirty = 0;
+	}
+	return res;
+}
+
+
+sfs_block_t* SimpleFS_mapSlot(FileWalk* w, unsigned int index, int create){
+	
+	SimpleFS* fs = w->sfs;
+	sfs_block_t* direct = (sfs_block_t*)w->ffb->data;
+	if(index < fs->map_direct) return &direct[index];
+	
+	//Which tree, and where in it
+	unsigned long long pos = index - fs->map_direct, span = fs->map_ptrs;
+	int height = 1;
+	while(pos >= span){
+		pos -= span;
+		span *= fs->map_ptrs;
+		if(++height > fs->map_levels) return NULL; //Too big for the map
 	}
 	
-	//Then eliminate dir dcb!
-	if(DiskDriver_freeBlock(fs->disk, dir_index) != 0){
-		printf("Error freeing dir dcb block!\n");
+	//Down from the root. New index blocks go near the fcb
+	sfs_block_t* slot = &direct[fs->map_direct + height-1];
+	int level, parent = -1; //Level of the index block holding slot
+	for(level=height-1;level>=0;level--){
+		span /= fs->map_ptrs;
+		if(*slot == SFS_NO_BLOCK){
+			if(!create) return NULL;
+			int block = DiskDriver_allocBlock(fs->disk, 
+											w->ffb->fcb.block_in_disk);
+			if(block < 0 || SimpleFS_mapLoad(w, level, block, 1) != 0) 
+				return NULL;
+			*slot = block;
+			if(parent >= 0) w->cache[parent].dirty = 1;
+		}
+		else if(SimpleFS_mapLoad(w, level, *slot, 0) != 0) return NULL;
+		
+		slot = &w->cache[level].data.blocks[(pos/span) % fs->map_ptrs];
+		parent = level;
+	}
+	if(create) w->cache[0].dirty = 1;
+	return slot;
+}
+
+
+int SimpleFS_mapLoad(FileWalk* w, int level, unsigned int block_num, 
+														int fresh){
+	
+	MapCache* c = &w->cache[level];
+	if(c->block == block_num) return 0;
+	if(c->dirty && DiskDriver_writeBlock(w->sfs->disk, &c->data, 
+												c->block) != 0){
+		printf("Error writing index block\n");
 		return -1;
 	}
+	c->dirty = 0;
+	c->block = block_num;
 	
+	if(fresh){ //SFS_NO_BLOCK is all ones
+		memset(&c->data, 0xFF, sizeof(IndexBlock));
+		c->dirty = 1;
+	}
+	else if(DiskDriver_readBlock(w->sfs->disk, &c->data, block_num) != 0){
+		printf("Error reading index block\n");
+		c->block = 0xFFFFFFFF;
+		return -1;
+	}
 	return 0;
 }
 
+
+void SimpleFS_layout(SimpleFS* fs){
+	
+	int block_size = fs->disk->block_size;
+	int fcb_data = block_size - sizeof(FileControlBlock) - sizeof(BlockHeader);
+	fs->f_file_block_offset = fcb_data;
+	fs->file_block_offset = block_size - sizeof(BlockHeader);
+	fs->f_dir_block_offset = (fcb_data - sizeof(sfs_block_t))/sizeof(sfs_block_t);
+	fs->dir_block_offset = fs->file_block_offset/sizeof(sfs_block_t);
+	fs->map_ptrs = block_size/sizeof(sfs_block_t);
+	fs->map_levels = SFS_LEVELS(fs->map_ptrs);
+	fs->map_direct = fcb_data/sizeof(sfs_block_t) - fs->map_levels;
+}
+
+
 int SimpleFS_checkFreeSpace(SimpleFS* fs){
 	
 	int i=0,res=0;
@@ -105,7 +105,7 @@ int resume(SimpleFS* fs){
 	scanf("%s", diskname);
 	printf("\n");
 	
-	if(DiskDriver_resume(fs->disk, diskname) != 0){
+	if(SimpleFS_resume(fs, diskname, 0) != 0){
 		exit(-1);
 	}
 	
@@ -121,6 +121,7 @@ int resume(SimpleFS* fs){
 void printDiskStatus(DiskDriver* disk){
 	
 	printf("\nNumber of total Blocks = %d\n", disk->num_entries);
+	printf("Block size = %u\n", disk->block_size);
 	printf("Number of Free Blocks = %d\n", disk->free_blocks);
 	printf("First Block Offset (concerning bitmap) = %d\n", 
 												disk->first_block_offset);
@@ -370,6 +371,7 @@ named write_input.hex must exist.\n");
 		 MAP_SHARED, res, 0); 
 			
 		SimpleFS_write(&file_handle, src, write_size);
+		SimpleFS_close(&file_handle);
 		munmap(src, write_size);
 		close(res);
 		printf("<Shell> write_input.hex read succesfully\n");
@@ -9,6 +9,26 @@ void createFile_test(unsigned int num_files, DirectoryHandle dir_handle ,
 												FileHandle file_handle);
 void readDir_test(SimpleFS fs, DirectoryHandle dir_handle);
 void write_test(FileHandle file_handle, int num_bytes, char* symbol);
+void read_test(FileHandle file_handle, int num_bytes);
+void seek_test(DirectoryHandle dir_handle);
+void append_test(DirectoryHandle dir_handle);
+void pool_test(DirectoryHandle dir_handle);
+void group_test(DirectoryHandle dir_handle);
+void indexed_test(void);
+void lazyGroup_test(void);
+void staged_test(int mode);
+void writeOnce_test(DirectoryHandle dir_handle);
+void tail_test(unsigned int fs_flags);
+void crash_test(void);
+void blockSize_test(unsigned int block_size, unsigned int fs_flags);
+
+//Helpers of tail_test(): disks of the layout before SFS_FLAG_TAIL
+int oldSize(int j, int fit, int indexed);
+void oldFile(DiskDriver* disk, int fcb, int parent, int size, int indexed, 
+																int* next);
+void oldDir(DiskDriver* disk, int dcb, int parent, const char* name, 
+								sfs_block_t* entries, int n, int rem);
+void oldCheck(DirectoryHandle* d, int first, int n, int fit, int indexed);
 
 int main(int argc, char** argv) {
 	printf("FirstBlock size %ld\n", sizeof(FirstFileBlock));
@@ -67,6 +87,24 @@ int main(int argc, char** argv) {
 	write_test(file_handle, 180, "!");
 	write_test(file_handle, 10, "?");
 	
+	//Read File test, long enough to be read ahead
+	read_test(file_handle, 1 << 20);
+	
+	//Streaming in pieces, and positional reads/writes
+	seek_test(root);
+	
+	//Small records appended to a long file, each by a new handle
+	append_test(root);
+	
+	//Two files growing at the same time, each from its own pool
+	pool_test(root);
+	
+	//A file growing by a single write writes each of its blocks once
+	writeOnce_test(root);
+	
+	//New dirs spread over the groups, their files stay close
+	group_test(root);
+	
 	//Change Dir test
 	SimpleFS_changeDir(&root, ".."); //upwards on top dir
 	SimpleFS_changeDir(&root, "nodir"); //non-existent file
@@ -105,6 +143,28 @@ int main(int argc, char** argv) {
 	//Finally, check everything is ok
 	SimpleFS_checkFreeSpace(&fs);
 	
+	//Files with a block map, on a disk of their own
+	indexed_test();
+	
+	//Disks made before fcbs kept their tail are upgraded by resume
+	tail_test(0);
+	tail_test(SFS_FLAG_INDEXED);
+	
+	//Blocks taken by a group lost in a crash are freed by resume
+	crash_test();
+	
+	//Block size chosen at format time, the layout taken from the disk
+	blockSize_test(1024, 0);
+	blockSize_test(SFS_MAX_BLOCK_SIZE, 0);
+	blockSize_test(SFS_MAX_BLOCK_SIZE, SFS_FLAG_INDEXED);
+	
+	//New dirs on a lazy disk fill the groups already initialized
+	lazyGroup_test();
+	
+	//Writes staged in batches where blocks are not written in place
+	staged_test(DISK_PIO);
+	staged_test(DISK_ASYNC);
+	
 	return 0;
 }
 
@@ -204,4 +264,686 @@ void write_test(FileHandle file_handle, int num_bytes, char* symbol){
 	
 	int res = SimpleFS_write(&file_handle, src, dim);
 	printf("Bytes written: %d\n", res);
+	SimpleFS_close(&file_handle);
+}
+
+
+void read_test(FileHandle file_handle, int num_bytes){
+	char* src = malloc(num_bytes);
+	char* dest = malloc(num_bytes);
+	int i;
+	for(i=0;i<num_bytes;i++) src[i] = 'a' + i%26;
+	
+	SimpleFS_write(&file_handle, src, num_bytes);
+	SimpleFS_seek(&file_handle, 0);
+	unsigned long prefetched = file_handle.sfs->disk->prefetched;
+	int res = SimpleFS_read(&file_handle, dest, num_bytes);
+	printf("Bytes read: %d, read ahead: %lu blocks (depth %u)\n", res, 
+		file_handle.sfs->disk->prefetched - prefetched, file_handle.readahead);
+	if(res != num_bytes || memcmp(src, dest, num_bytes) != 0 
+			|| file_handle.readahead != SFS_READAHEAD){
+		printf("Read Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_close(&file_handle);
+	free(src);
+	free(dest);
+}
+
+
+void seek_test(DirectoryHandle dir_handle){
+	FileHandle file;
+	int size = 300*FILE_BLOCK_OFFSET + 123, piece = 1000, i, res;
+	char* src = malloc(size+piece);
+	char* dest = malloc(size+piece);
+	for(i=0;i<size+piece;i++) src[i] = 'A' + i%57;
+	
+	printf("\nTesting positional I/O\n");
+	SimpleFS_createFile(&dir_handle, "seek_file", &file);
+	
+	//Written and read back a piece at a time, going on from the cursor
+	for(i=0;i<size;i+=piece){
+		SimpleFS_write(&file, src+i, (size-i < piece) ? size-i : piece);
+	}
+	SimpleFS_seek(&file, 0);
+	for(i=0;(res = SimpleFS_read(&file, dest+i, 777)) > 0;i+=res);
+	printf("Bytes streamed: %d, position %ld\n", i, (long)file.pos_in_file);
+	if(i != size || memcmp(src, dest, size) != 0){
+		printf("Stream Error!!\n");
+		exit(-1);
+	}
+	
+	//Across a block boundary in the middle, then appending at the end
+	int pos = F_FILE_BLOCK_OFFSET + 150*FILE_BLOCK_OFFSET - 10;
+	memset(src+pos, '*', 20);
+	if(SimpleFS_pwrite(&file, src+pos, 20, pos) != 20 
+			|| SimpleFS_pwrite(&file, src+size, piece, size) != piece 
+			|| SimpleFS_pread(&file, dest, size+piece, 0) != size+piece 
+			|| memcmp(src, dest, size+piece) != 0
+			|| SimpleFS_pread(&file, dest, 30, pos-5) != 30
+			|| memcmp(src+pos-5, dest, 30) != 0){
+		printf("Positional I/O Error!!\n");
+		exit(-1);
+	}
+	
+	//The position stays where it was, and can't go past the end
+	if(file.pos_in_file != size || SimpleFS_seek(&file, size+piece+1) != -1 
+			|| SimpleFS_read(&file, dest, piece) != piece){
+		printf("Seek Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_close(&file);
+	SimpleFS_remove(&file);
+	free(src);
+	free(dest);
+}
+
+
+void append_test(DirectoryHandle dir_handle){
+	FileHandle file, opened;
+	DiskDriver* disk = dir_handle.sfs->disk;
+	int size = 500*FILE_BLOCK_OFFSET, record = 100, records = 300, i;
+	char* src = malloc(size + records*record);
+	char* dest = malloc(size + records*record);
+	FirstFileBlock ffb;
+	FileBlock block;
+	for(i=0;i<size+records*record;i++) src[i] = '0' + i%43;
+	
+	printf("\nTesting appends\n");
+	SimpleFS_createFile(&dir_handle, "append_file", &file);
+	SimpleFS_write(&file, src, size);
+	SimpleFS_close(&file);
+	
+	//A new handle knows nothing of the chain, the fcb knows the tail
+	for(i=0;i<records;i++){
+		SimpleFS_openFile(&dir_handle, "append_file", &opened);
+		if(SimpleFS_append(&opened, src+size+i*record, record) != record 
+				|| opened.pos_in_file != size+(i+1)*record){
+			printf("Append Error!!\n");
+			exit(-1);
+		}
+		SimpleFS_close(&opened);
+	}
+	size += records*record;
+	
+	//The tail is the end of the chain, and the content is all there
+	DiskDriver_readBlock(disk, &ffb, file.fcb);
+	int last = ffb.header.next_block;
+	DiskDriver_readBlock(disk, &block, last);
+	while(block.header.next_block != SFS_NO_BLOCK){
+		last = block.header.next_block;
+		DiskDriver_readBlock(disk, &block, last);
+	}
+	printf("size %d, tail %d (%d bytes), last block %d\n", 
+		(int)ffb.fcb.size_in_bytes, (int)ffb.fcb.last_block, 
+		ffb.fcb.last_fill, last);
+	if(ffb.fcb.size_in_bytes != size || ffb.fcb.last_block != last 
+			|| ffb.fcb.last_fill != (size-F_FILE_BLOCK_OFFSET-1)%FILE_BLOCK_OFFSET+1
+			|| SimpleFS_pread(&file, dest, size, 0) != size 
+			|| memcmp(src, dest, size) != 0){
+		printf("Tail Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_remove(&file);
+	free(src);
+	free(dest);
+}
+
+
+void pool_test(DirectoryHandle dir_handle){
+	FileHandle files[2];
+	char* names[2] = {"pool_A", "pool_B"};
+	int rounds = 16, chunk = 8*FILE_BLOCK_OFFSET;
+	char* src = calloc(rounds*chunk, sizeof(char));
+	DiskDriver* disk = dir_handle.sfs->disk;
+	FirstFileBlock ffb;
+	FileBlock block;
+	int i, r, jumps;
+	
+	printf("\nTesting reservation pools\n");
+	for(i=0;i<2;i++) SimpleFS_createFile(&dir_handle, names[i], &files[i]);
+	DiskDriver_commit(disk); //Frees still in the journal group are applied
+	unsigned int free_blocks = disk->free_blocks;
+	
+	//Appends interleaved: both files grow by 8 blocks a round
+	for(r=1;r<=rounds;r++){
+		for(i=0;i<2;i++) SimpleFS_write(&files[i], src, chunk);
+	}
+	
+	//Each chain is a single run, and closing gives back the rest
+	for(i=0;i<2;i++){
+		DiskDriver_readBlock(disk, &ffb, files[i].fcb);
+		int prev = ffb.header.next_block;
+		jumps = 0;
+		while(prev != SFS_NO_BLOCK){
+			DiskDriver_readBlock(disk, &block, prev);
+			if(block.header.next_block != SFS_NO_BLOCK 
+					&& block.header.next_block != prev+1) jumps++;
+			prev = block.header.next_block;
+		}
+		
+		//The rest of the pool is reserved in memory, empty on disk
+		if(files[i].pool_len > 0 
+				&& (DiskDriver_bitmapGet(disk, files[i].pool_start) != 0
+				|| DiskDriver_getFreeBlock(disk, files[i].pool_start) 
+										== (int)files[i].pool_start)){
+			printf("Pool reservation Error!!\n");
+			exit(-1);
+		}
+		SimpleFS_close(&files[i]);
+		printf("%s: %d blocks, %d jumps\n", names[i], 
+							(int)ffb.fcb.size_in_blocks, jumps);
+		if(jumps > (ffb.fcb.size_in_blocks-1)/SFS_POOL){
+			printf("Pool Error!!\n");
+			exit(-1);
+		}
+		free_blocks -= ffb.fcb.size_in_blocks-1;
+	}
+	if(files[0].pool_len != 0 || disk->free_blocks != free_blocks){
+		printf("Pool free blocks Error!!\n");
+		exit(-1);
+	}
+	for(i=0;i<2;i++) SimpleFS_remove(&files[i]);
+	free(src);
+}
+
+
+void group_test(DirectoryHandle dir_handle){
+	DirectoryHandle sub = dir_handle;
+	FileHandle file;
+	
+	printf("\nTesting allocation groups\n");
+	DiskDriver_commit(dir_handle.sfs->disk); //Frees wait for the commit
+	unsigned int free_blocks = dir_handle.sfs->disk->free_blocks;
+	SimpleFS_mkDir(&sub, "group_dir");
+	SimpleFS_createFile(&sub, "group_file", &file);
+	printf("root in group %d, dir in group %d, its file in group %d\n", 
+		dir_handle.dcb/DISK_CHUNK_BLOCKS, sub.dcb/DISK_CHUNK_BLOCKS, 
+		file.fcb/DISK_CHUNK_BLOCKS);
+	if(sub.dcb/DISK_CHUNK_BLOCKS == dir_handle.dcb/DISK_CHUNK_BLOCKS 
+			|| file.fcb != sub.dcb+1){
+		printf("Group Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_remove(&sub);
+	DiskDriver_commit(dir_handle.sfs->disk);
+	if(dir_handle.sfs->disk->free_blocks != free_blocks){
+		printf("Group free blocks Error!!\n");
+		exit(-1);
+	}
+}
+
+
+void indexed_test(void){
+	SimpleFS fs;
+	DiskDriver disk;
+	DirectoryHandle root;
+	FileHandle file;
+	int size = 9 << 20, i; //Deep enough for triple indirect blocks
+	char* src = malloc(size);
+	char* dest = malloc(size);
+	
+	printf("\nTesting indexed files\n");
+	fs.disk = &disk;
+	if(SimpleFS_formatFlags(&fs, "SFS_IDX.hex", 100000, BLOCK_SIZE, 
+						DISK_LAZY|DISK_JOURNAL, SFS_FLAG_INDEXED) != 0){
+		printf("Indexed format Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_init(&fs, &root);
+	SimpleFS_createFile(&root, "big", &file);
+	DiskDriver_commit(&disk);
+	unsigned int free_blocks = disk.free_blocks;
+	
+	//Written, overwritten in part, read back after a resume
+	for(i=0;i<size;i++) src[i] = 'a' + i%23;
+	if(SimpleFS_write(&file, src, size) != size){
+		printf("Indexed write Error!!\n");
+		exit(-1);
+	}
+	memset(src, '#', size/3);
+	SimpleFS_seek(&file, 0);
+	SimpleFS_write(&file, src, size/3);
+	SimpleFS_close(&file);
+	DiskDriver_unmount(&disk);
+	if(SimpleFS_resume(&fs, "SFS_IDX.hex", DISK_JOURNAL) != 0 
+			|| SimpleFS_openFile(&root, "big", &file) != 0
+			|| SimpleFS_read(&file, dest, size) != size 
+			|| memcmp(src, dest, size) != 0){
+		printf("Indexed read Error!!\n");
+		exit(-1);
+	}
+	printf("%d blocks, %u index blocks\n", size/FILE_BLOCK_OFFSET+1, 
+		free_blocks - disk.free_blocks - (size+FILE_BLOCK_OFFSET-1)/FILE_BLOCK_OFFSET);
+	
+	//Every data and index block is given back
+	SimpleFS_remove(&file);
+	DiskDriver_commit(&disk);
+	if(disk.free_blocks != free_blocks + 1){
+		printf("Indexed remove Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	unlink("SFS_IDX.hex");
+	free(src);
+	free(dest);
+}
+
+
+void crash_test(void){
+	SimpleFS fs;
+	DiskDriver disk, crashed;
+	DirectoryHandle root;
+	FileHandle file;
+	int size = 20*FILE_BLOCK_OFFSET;
+	char* src = malloc(size);
+	char* dest = malloc(size);
+	
+	printf("\nTesting the bitmap after a crash\n");
+	fs.disk = &disk;
+	if(SimpleFS_format(&fs, "SFS_CRASH.hex", 10000) != 0){
+		printf("Crash format Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_init(&fs, &root);
+	memset(src, 'k', size);
+	SimpleFS_createFile(&root, "kept", &file);
+	SimpleFS_write(&file, src, size);
+	SimpleFS_close(&file);
+	DiskDriver_commit(&disk);
+	unsigned int free_blocks = disk.free_blocks;
+	
+	//The new file's group never commits: its dir entry and fcb are lost,
+	//its data blocks stay marked full
+	SimpleFS_createFile(&root, "lost", &file);
+	SimpleFS_write(&file, src, size);
+	crashed = disk;
+	if(SimpleFS_resume(&fs, "SFS_CRASH.hex", DISK_JOURNAL) != 0 
+			|| disk.free_blocks != free_blocks
+			|| SimpleFS_openFile(&root, "lost", &file) == 0
+			|| SimpleFS_openFile(&root, "kept", &file) != 0
+			|| SimpleFS_read(&file, dest, size) != size 
+			|| memcmp(src, dest, size) != 0){
+		printf("Crash recovery Error!!\n");
+		exit(-1);
+	}
+	close(crashed.fd);
+	SimpleFS_close(&file);
+	DiskDriver_unmount(&disk);
+	unlink("SFS_CRASH.hex");
+	free(src);
+	free(dest);
+}
+
+
+void blockSize_test(unsigned int block_size, unsigned int fs_flags){
+	SimpleFS fs;
+	DiskDriver disk;
+	DirectoryHandle root, sub;
+	FileHandle file;
+	int size = 3 << 20, i, j;
+	char* src = malloc(size);
+	char* dest = malloc(size);
+	char name[128];
+	
+	printf("\nTesting %u byte blocks%s\n", block_size, 
+						(fs_flags & SFS_FLAG_INDEXED) ? " (indexed)" : "");
+	fs.disk = &disk;
+	if(SimpleFS_formatFlags(&fs, "SFS_BSZ.hex", 20000, 2*SFS_MAX_BLOCK_SIZE, 
+								DISK_LAZY|DISK_JOURNAL, fs_flags) == 0
+			|| SimpleFS_formatFlags(&fs, "SFS_BSZ.hex", 20000, block_size, 
+								DISK_LAZY|DISK_JOURNAL, fs_flags) != 0){
+		printf("Block size format Error!!\n");
+		exit(-1);
+	}
+	unsigned int free_blocks = disk.free_blocks;
+	
+	//A dir with more entries than its dcb holds, and a file of many blocks
+	SimpleFS_init(&fs, &root);
+	sub = root;
+	SimpleFS_mkDir(&sub, "sub");
+	for(j=0;j<fs.f_dir_block_offset+2;j++){
+		sprintf(name, "f%d", j);
+		SimpleFS_createFile(&sub, name, &file);
+		SimpleFS_write(&file, name, strlen(name)+1);
+		SimpleFS_close(&file);
+	}
+	for(i=0;i<size;i++) src[i] = 'a' + i%29;
+	unsigned int before = disk.free_blocks;
+	SimpleFS_createFile(&root, "big", &file);
+	if(SimpleFS_write(&file, src, size) != size){
+		printf("Block size write Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_close(&file);
+	printf("%u blocks for a %d byte file\n", before - disk.free_blocks, size);
+	DiskDriver_unmount(&disk);
+	
+	//The disk knows its block size, the layout is derived from it again
+	if(SimpleFS_resume(&fs, "SFS_BSZ.hex", DISK_JOURNAL) != 0 
+			|| disk.block_size != block_size
+			|| fs.file_block_offset != (int)(block_size-sizeof(BlockHeader))
+			|| SimpleFS_openFile(&root, "big", &file) != 0
+			|| SimpleFS_read(&file, dest, size) != size 
+			|| memcmp(src, dest, size) != 0){
+		printf("Block size resume Error!!\n");
+		exit(-1);
+	}
+	sub = root;
+	SimpleFS_changeDir(&sub, "sub");
+	for(j=0;j<fs.f_dir_block_offset+2;j++){
+		sprintf(name, "f%d", j);
+		if(SimpleFS_openFile(&sub, name, &file) != 0
+				|| SimpleFS_read(&file, dest, 128) != (int)strlen(name)+1
+				|| strcmp(name, dest) != 0){
+			printf("Block size dir Error!!\n");
+			exit(-1);
+		}
+	}
+	
+	//Everything is given back
+	SimpleFS_openFile(&root, "big", &file);
+	SimpleFS_remove(&file);
+	SimpleFS_remove(&sub);
+	DiskDriver_commit(&disk);
+	if(disk.free_blocks != free_blocks){
+		printf("Block size remove Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	unlink("SFS_BSZ.hex");
+	free(src);
+	free(dest);
+}
+
+
+void lazyGroup_test(void){
+	SimpleFS fs;
+	DiskDriver disk;
+	DirectoryHandle root, first, second;
+	
+	printf("\nTesting allocation groups on a lazy disk\n");
+	fs.disk = &disk;
+	if(SimpleFS_format(&fs, "SFS_GRP.hex", 8*DISK_CHUNK_BLOCKS) != 0){
+		printf("Lazy group format Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_init(&fs, &root);
+	
+	//The first dir needs a new group, a dir in it takes an old one
+	first = root;
+	SimpleFS_mkDir(&first, "first");
+	unsigned int init = disk.header->init_chunks;
+	second = first;
+	SimpleFS_mkDir(&second, "second");
+	printf("dirs in groups %d and %d, %u groups initialized\n", 
+		first.dcb/DISK_CHUNK_BLOCKS, second.dcb/DISK_CHUNK_BLOCKS, 
+		disk.header->init_chunks);
+	if(disk.header->init_chunks != init 
+			|| second.dcb/DISK_CHUNK_BLOCKS == first.dcb/DISK_CHUNK_BLOCKS){
+		printf("Lazy group Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	unlink("SFS_GRP.hex");
+}
+
+
+void writeOnce_test(DirectoryHandle dir_handle){
+	FileHandle file;
+	DiskDriver* disk = dir_handle.sfs->disk;
+	int size = 100*FILE_BLOCK_OFFSET;
+	char* src = calloc(size, sizeof(char));
+	
+	//The bytes past the fcb fill the data blocks, the fcb is written last
+	SimpleFS_createFile(&dir_handle, "write_once", &file);
+	int head = SimpleFS_head(dir_handle.sfs);
+	unsigned long expected = (size-head+FILE_BLOCK_OFFSET-1)/FILE_BLOCK_OFFSET + 1;
+	unsigned long written = disk->written;
+	SimpleFS_write(&file, src, size);
+	printf("Growing write: %lu blocks written, %lu expected\n", 
+								disk->written - written, expected);
+	if(disk->written - written != expected){
+		printf("Write once Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_remove(&file);
+	free(src);
+}
+
+
+void staged_test(int mode){
+	SimpleFS fs;
+	DiskDriver disk;
+	DirectoryHandle root;
+	FileHandle file;
+	int size = 200*FILE_BLOCK_OFFSET, i;
+	char* src = malloc(size);
+	char* dest = malloc(size);
+	
+	printf("\nTesting staged writes (%s)\n", (mode & DISK_PIO) ? "pio" : "async");
+	fs.disk = &disk;
+	if(SimpleFS_formatMode(&fs, "SFS_STG.hex", 4096, mode) != 0){
+		printf("Staged format Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_init(&fs, &root);
+	SimpleFS_createFile(&root, "staged", &file);
+	
+	//Half written, then overwritten across it and grown to the end
+	for(i=0;i<size;i++) src[i] = 'a' + i%31;
+	int half = size/2 + 77, pos = size/3 + 5;
+	memset(src+pos, '=', size-pos);
+	if(SimpleFS_write(&file, src, half) != half 
+			|| SimpleFS_pwrite(&file, src+pos, size-pos, pos) != size-pos
+			|| SimpleFS_pread(&file, dest, size, 0) != size 
+			|| memcmp(src, dest, size) != 0){
+		printf("Staged write Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_close(&file);
+	writeOnce_test(root);
+	DiskDriver_unmount(&disk);
+	unlink("SFS_STG.hex");
+	free(src);
+	free(dest);
+}
+
+
+//Bytes of the file in block j of tail_test(): a few files fill the old
+//fcb, or the old blocks but the last few bytes, the others are tiny
+int oldSize(int j, int fit, int indexed){
+	int old_head = F_FILE_BLOCK_OFFSET + SFS_TAIL_SHIFT;
+	int direct = SFS_MAP_DIRECT + SFS_TAIL_SHIFT/sizeof(sfs_block_t);
+	if(j == 2) return indexed ? FILE_BLOCK_OFFSET : old_head;
+	if(j == 3 || j == fit+3) 
+		return indexed ? (direct+3)*FILE_BLOCK_OFFSET - 5 
+						: old_head + 3*FILE_BLOCK_OFFSET - 5;
+	return j%50;
+}
+
+
+//Writes in block fcb a file of the layout before SFS_FLAG_TAIL, size 
+//bytes ('a'+i%23): its data blocks (and index block) from *next on
+void oldFile(DiskDriver* disk, int fcb, int parent, int size, int indexed, 
+																int* next){
+	sfs_block_t old[BLOCK_SIZE/sizeof(sfs_block_t)];
+	char* old_data = (char*)old + offsetof(FirstFileBlock, data) - SFS_TAIL_SHIFT;
+	sfs_block_t* map = (sfs_block_t*)old_data;
+	int head = indexed ? 0 : F_FILE_BLOCK_OFFSET + SFS_TAIL_SHIFT;
+	int direct = SFS_MAP_DIRECT + SFS_TAIL_SHIFT/sizeof(sfs_block_t);
+	int i, first = *next, blocks = (size > head) ? 
+			(size-head+FILE_BLOCK_OFFSET-1)/FILE_BLOCK_OFFSET : 0;
+	char* src = calloc(head + (blocks+1)*FILE_BLOCK_OFFSET, sizeof(char));
+	for(i=0;i<size;i++) src[i] = 'a' + i%23;
+	
+	FirstFileBlock ffb;
+	ffb.header.previous_block = SFS_NO_BLOCK;
+	ffb.header.next_block = (blocks > 0) ? first : SFS_NO_BLOCK;
+	ffb.header.block_in_file = 0;
+	ffb.fcb.directory_block = parent;
+	ffb.fcb.block_in_disk = fcb;
+	memset(ffb.fcb.name, 0, 128);
+	sprintf(ffb.fcb.name, "f%d", fcb);
+	ffb.fcb.size_in_bytes = size;
+	ffb.fcb.size_in_blocks = blocks+1;
+	ffb.fcb.is_dir = 0;
+	memcpy(old, &ffb, offsetof(FirstFileBlock, fcb) 
+						+ offsetof(FileControlBlock, last_block));
+	memset(old_data, indexed ? 0xFF : 0, F_FILE_BLOCK_OFFSET + SFS_TAIL_SHIFT);
+	if(!indexed) memcpy(old_data, src, head);
+	
+	//Data blocks one after another, then the index block past the direct ones
+	FileBlock block;
+	IndexBlock index;
+	memset(&index, 0xFF, sizeof(IndexBlock));
+	for(i=0;i<blocks;i++){
+		block.header.previous_block = (i > 0) ? first+i-1 : fcb;
+		block.header.next_block = (i < blocks-1) ? first+i+1 : SFS_NO_BLOCK;
+		block.header.block_in_file = i+1;
+		memcpy(block.data, src+head+i*FILE_BLOCK_OFFSET, FILE_BLOCK_OFFSET);
+		DiskDriver_writeBlock(disk, &block, first+i);
+		if(indexed && i < direct) map[i] = first+i;
+		else if(indexed) index.blocks[i-direct] = first+i;
+	}
+	*next = first+blocks;
+	if(indexed && blocks > direct){
+		map[direct] = *next;
+		DiskDriver_writeBlock(disk, &index, (*next)++);
+	}
+	DiskDriver_writeBlock(disk, old, fcb);
+	free(src);
+}
+
+
+//Writes in block dcb a dir of the layout before SFS_FLAG_TAIL with n
+//entries: the ones its dcb doesn't hold go in a remainder in block rem
+void oldDir(DiskDriver* disk, int dcb, int parent, const char* name, 
+								sfs_block_t* entries, int n, int rem){
+	sfs_block_t old[BLOCK_SIZE/sizeof(sfs_block_t)];
+	int fit = F_DIR_BLOCK_OFFSET + SFS_TAIL_SHIFT/sizeof(sfs_block_t);
+	int in_dcb = (n < fit) ? n : fit;
+	FirstDirectoryBlock dir;
+	DirectoryBlock dir_rem;
+	
+	memset(old, 0xFF, BLOCK_SIZE);
+	dir.header.previous_block = SFS_NO_BLOCK;
+	dir.header.next_block = (n > fit) ? rem : SFS_NO_BLOCK;
+	dir.header.block_in_file = 0;
+	dir.fcb.directory_block = parent;
+	dir.fcb.block_in_disk = dcb;
+	memset(dir.fcb.name, 0, 128);
+	strncpy(dir.fcb.name, name, 128);
+	dir.fcb.size_in_bytes = 0;
+	dir.fcb.size_in_blocks = (n > fit) ? 2 : 1;
+	dir.fcb.is_dir = 1;
+	memcpy(old, &dir, offsetof(FirstDirectoryBlock, fcb) 
+						+ offsetof(FileControlBlock, last_block));
+	memcpy((char*)old + offsetof(FirstDirectoryBlock, num_entries) 
+								- SFS_TAIL_SHIFT, &n, sizeof(int));
+	memcpy((char*)old + offsetof(FirstDirectoryBlock, file_blocks) 
+					- SFS_TAIL_SHIFT, entries, in_dcb*sizeof(sfs_block_t));
+	DiskDriver_writeBlock(disk, old, dcb);
+	
+	if(n > fit){
+		memset(&dir_rem, 0xFF, sizeof(DirectoryBlock));
+		dir_rem.header.previous_block = dcb;
+		dir_rem.header.next_block = SFS_NO_BLOCK;
+		dir_rem.header.block_in_file = 1;
+		memcpy(dir_rem.file_blocks, entries+fit, (n-fit)*sizeof(sfs_block_t));
+		DiskDriver_writeBlock(disk, &dir_rem, rem);
+	}
+}
+
+
+//Files in blocks first... of d (n of them) are read, appended to (from
+//their tail) and read again, then removed
+void oldCheck(DirectoryHandle* d, int first, int n, int fit, int indexed){
+	FileHandle file;
+	char name[128];
+	int i, j, size;
+	
+	for(j=first;j<first+n;j++){
+		size = oldSize(j, fit, indexed);
+		char* src = malloc(size+30);
+		char* dest = malloc(size+31);
+		for(i=0;i<size+30;i++) src[i] = 'a' + i%23;
+		sprintf(name, "f%d", j);
+		if(SimpleFS_openFile(d, name, &file) != 0
+				|| SimpleFS_pread(&file, dest, size+1, 0) != size
+				|| memcmp(src, dest, size) != 0
+				|| SimpleFS_append(&file, src+size, 30) != 30
+				|| SimpleFS_pread(&file, dest, size+31, 0) != size+30
+				|| memcmp(src, dest, size+30) != 0){
+			printf("Upgraded file %s Error!!\n", name);
+			exit(-1);
+		}
+		SimpleFS_close(&file);
+		SimpleFS_remove(&file);
+		free(src);
+		free(dest);
+	}
+}
+
+
+void tail_test(unsigned int fs_flags){
+	SimpleFS fs;
+	DiskDriver disk;
+	DirectoryHandle root, sub;
+	int indexed = (fs_flags & SFS_FLAG_INDEXED) != 0;
+	int fit = F_DIR_BLOCK_OFFSET + SFS_TAIL_SHIFT/sizeof(sfs_block_t);
+	int j, next = 2*fit+3;
+	sfs_block_t* entries = malloc((fit+1)*sizeof(sfs_block_t));
+	
+	printf("\nTesting the upgrade of a disk made before fcbs kept their tail%s\n",
+										indexed ? " (indexed)" : "");
+	fs.disk = &disk;
+	if(SimpleFS_formatFlags(&fs, "SFS_OLD.hex", 100000, BLOCK_SIZE, DISK_LAZY, 
+												fs_flags) != 0){
+		printf("Old layout format Error!!\n");
+		exit(-1);
+	}
+	unsigned int free_blocks = disk.free_blocks;
+	
+	//The top dir holds a dir and files, one more than its old dcb did (in
+	//a remainder). The dir holds as many files as its old dcb did
+	entries[0] = 1;
+	for(j=2;j<fit+2;j++){
+		entries[j-1] = j;
+		oldFile(&disk, j, 0, oldSize(j, fit, indexed), indexed, &next);
+	}
+	oldDir(&disk, 0, SFS_NO_BLOCK, "/", entries, fit+1, fit+2);
+	for(j=fit+3;j<2*fit+3;j++){
+		entries[j-fit-3] = j;
+		oldFile(&disk, j, 1, oldSize(j, fit, indexed), indexed, &next);
+	}
+	oldDir(&disk, 1, 0, "sub", entries, fit, SFS_NO_BLOCK);
+	disk.header->fs_flags &= ~SFS_FLAG_TAIL;
+	DiskDriver_unmount(&disk);
+	
+	//Every file reads back the same, its tail found after the upgrade
+	if(SimpleFS_resume(&fs, "SFS_OLD.hex", 0) != 0 
+			|| !(disk.header->fs_flags & SFS_FLAG_TAIL)){
+		printf("Upgrade Error!!\n");
+		exit(-1);
+	}
+	SimpleFS_init(&fs, &root);
+	oldCheck(&root, 2, fit, fit, indexed);
+	sub = root;
+	if(SimpleFS_changeDir(&sub, "sub") != 0){
+		printf("Upgraded dir Error!!\n");
+		exit(-1);
+	}
+	oldCheck(&sub, fit+3, fit, fit, indexed);
+	
+	//Nothing was left behind: the blocks of the old index blocks too
+	SimpleFS_remove(&sub);
+	printf("%u free blocks, %u before\n", disk.free_blocks, free_blocks);
+	if(disk.free_blocks != free_blocks){
+		printf("Upgrade free blocks Error!!\n");
+		exit(-1);
+	}
+	DiskDriver_unmount(&disk);
+	unlink("SFS_OLD.hex");
+	free(entries);
 }